@@ -0,0 +1,161 @@
+#
+#  Copyright (c) 2024-Present, Arkin Terli. All rights reserved.
+#
+#  NOTICE:  All information contained herein is, and remains the property of Arkin Terli.
+#  The intellectual and technical concepts contained herein are proprietary to Arkin Terli
+#  and may be covered by U.S. and Foreign Patents, patents in process, and are protected by
+#  trade secret or copyright law. Dissemination of this information or reproduction of this
+#  material is strictly forbidden unless prior written permission is obtained from Arkin Terli.
+
+# Converts the oaiWeights<size>.bin files created by downloadGPT2.py into the indexed checkpoint format.
+#
+#  Header:  magic "LLMCKPT\0" (8 bytes), u32 version, u32 alignment, u64 number of tensors
+#  Index:   for each tensor: u32 name length, name (UTF-8), u32 data type, u32 number of dimensions,
+#           u64 dimensions[], u64 payload offset from the beginning of the file, u64 payload size in bytes
+#  Payload: tensor data, each starting at an offset aligned to the alignment (page size)
+#
+# All integers are little-endian. The tensor names are the variable names in the OpenAI GPT2 checkpoints.
+
+import os
+import struct
+import sys
+
+
+MAGIC = b"LLMCKPT\0"
+VERSION = 1
+ALIGNMENT = 16384           # Page size of Apple Silicon. It is a multiple of the common 4096 bytes page size.
+DTYPE_FLOAT32 = 0
+DTYPE_INT8 = 1              # Signed bytes.
+DTYPE_INT4 = 2              # Signed 4-bit values, packed two per byte, the low nibble first.
+
+MODEL_PARAMS = {
+    "124M":  {"nVocab": 50257, "nCtx": 1024, "nEmbd":  768, "nLayers": 12},
+    "355M":  {"nVocab": 50257, "nCtx": 1024, "nEmbd": 1024, "nLayers": 24},
+    "774M":  {"nVocab": 50257, "nCtx": 1024, "nEmbd": 1280, "nLayers": 36},
+    "1558M": {"nVocab": 50257, "nCtx": 1024, "nEmbd": 1600, "nLayers": 48},
+}
+
+
+def gpt2TensorSpecs(modelSize):
+    # Returns (name, shape) of all tensors in the order they are stored in the oaiWeights<size>.bin files.
+    p = MODEL_PARAMS[modelSize]
+    embd = p["nEmbd"]
+    specs = []
+    for i in range(p["nLayers"]):
+        specs += [
+            (f"h{i}/attn/c_attn/b", [3 * embd]),
+            (f"h{i}/attn/c_attn/w", [embd, 3 * embd]),
+            (f"h{i}/attn/c_proj/b", [embd]),
+            (f"h{i}/attn/c_proj/w", [embd, embd]),
+            (f"h{i}/ln_1/b", [embd]),
+            (f"h{i}/ln_1/g", [embd]),
+            (f"h{i}/ln_2/b", [embd]),
+            (f"h{i}/ln_2/g", [embd]),
+            (f"h{i}/mlp/c_fc/b", [4 * embd]),
+            (f"h{i}/mlp/c_fc/w", [embd, 4 * embd]),
+            (f"h{i}/mlp/c_proj/b", [embd]),
+            (f"h{i}/mlp/c_proj/w", [4 * embd, embd]),
+        ]
+    specs += [
+        ("ln_f/b", [embd]),
+        ("ln_f/g", [embd]),
+        ("wpe", [p["nCtx"], embd]),
+        ("wte", [p["nVocab"], embd]),
+    ]
+    return specs
+
+
+def alignUp(value, alignment):
+    return (value + alignment - 1) // alignment * alignment
+
+
+def packIndexEntry(name, dtype, shape, offset, numBytes):
+    encodedName = name.encode("utf-8")
+    entry = struct.pack("<I", len(encodedName)) + encodedName
+    entry += struct.pack("<II", dtype, len(shape)) + struct.pack(f"<{len(shape)}Q", *shape)
+    return entry + struct.pack("<QQ", offset, numBytes)
+
+
+def writeCheckpoint(filepath, tensors):
+    # Writes tensors into the indexed checkpoint format.
+    # tensors: list of (name, dtype, shape, numBytes, writePayload) where writePayload(file) writes numBytes bytes.
+    # The size of the index does not depend on the offsets, so the payload offsets are computed before writing.
+    headerSize = len(MAGIC) + struct.calcsize("<IIQ")
+    for name, dtype, shape, numBytes, _ in tensors:
+        headerSize += len(packIndexEntry(name, dtype, shape, 0, numBytes))
+
+    offsets = []
+    offset = alignUp(headerSize, ALIGNMENT)
+    for _, _, _, numBytes, _ in tensors:
+        offsets.append(offset)
+        offset = alignUp(offset + numBytes, ALIGNMENT)
+
+    with open(filepath, "wb") as file:
+        file.write(MAGIC + struct.pack("<IIQ", VERSION, ALIGNMENT, len(tensors)))
+        for (name, dtype, shape, numBytes, _), payloadOffset in zip(tensors, offsets):
+            file.write(packIndexEntry(name, dtype, shape, payloadOffset, numBytes))
+        for (_, _, _, _, writePayload), payloadOffset in zip(tensors, offsets):
+            file.write(b"\0" * (payloadOffset - file.tell()))
+            writePayload(file)
+
+
+def readWeights(sourceFilepath, modelSize):
+    # Returns (name, shape, offset) of all tensors in the oaiWeights<size>.bin file.
+    tensors = []
+    with open(sourceFilepath, "rb") as file:
+        for name, shape in gpt2TensorSpecs(modelSize):
+            (numElements,) = struct.unpack("<Q", file.read(8))
+            expected = 1
+            for d in shape:
+                expected *= d
+            if numElements != expected:
+                raise ValueError(f"Unexpected number of elements in {name}: {numElements} != {expected}")
+            tensors.append((name, shape, file.tell()))
+            file.seek(numElements * 4, os.SEEK_CUR)
+        if file.read(1):
+            raise ValueError("The weights file has more data than the model parameters.")
+    return tensors
+
+
+def convertWeights(sourceFilepath, targetFilepath, modelSize):
+    source = open(sourceFilepath, "rb")
+
+    def payloadWriter(offset, numBytes):
+        def writePayload(file):
+            source.seek(offset)
+            remaining = numBytes
+            while remaining > 0:
+                chunk = source.read(min(remaining, 1 << 24))
+                file.write(chunk)
+                remaining -= len(chunk)
+        return writePayload
+
+    tensors = []
+    for name, shape, offset in readWeights(sourceFilepath, modelSize):
+        numBytes = 4
+        for d in shape:
+            numBytes *= d
+        tensors.append((name, DTYPE_FLOAT32, shape, numBytes, payloadWriter(offset, numBytes)))
+
+    try:
+        writeCheckpoint(targetFilepath, tensors)
+    finally:
+        source.close()
+
+
+def main():
+    if len(sys.argv) != 2 or sys.argv[1] not in MODEL_PARAMS:
+        print("Please provide a model size to convert as an argument. Options: 124M, 355M, 774M, 1558M")
+        print("Example:")
+        print("         python " + sys.argv[0] + " 124M")
+        exit()
+
+    modelSize = sys.argv[1]
+    sourceFilepath = os.path.join("./GPT2", "oaiWeights" + modelSize + ".bin")
+    targetFilepath = os.path.join("./GPT2", "oaiWeights" + modelSize + ".ckpt")
+    convertWeights(sourceFilepath, targetFilepath, modelSize)
+    print("Converted " + sourceFilepath + " to " + targetFilepath)
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,107 @@
+#
+#  Copyright (c) 2024-Present, Arkin Terli. All rights reserved.
+#
+#  NOTICE:  All information contained herein is, and remains the property of Arkin Terli.
+#  The intellectual and technical concepts contained herein are proprietary to Arkin Terli
+#  and may be covered by U.S. and Foreign Patents, patents in process, and are protected by
+#  trade secret or copyright law. Dissemination of this information or reproduction of this
+#  material is strictly forbidden unless prior written permission is obtained from Arkin Terli.
+
+# Quantizes the oaiWeights<size>.bin files created by downloadGPT2.py into an indexed checkpoint with weight-only
+# INT8 or INT4 quantization.
+#
+# The Linear weights and the token embeddings, which are also the LM head weights, are quantized symmetrically in
+# groups of GROUP_SIZE consecutive weights. Each group has a float32 scale. The Linear weights are stored transposed,
+# {out, in}, so the groups are along the input dimension. A weight <name> is stored as two tensors:
+#
+#   <name>_q       INT8 or packed INT4 codes {rows, cols}
+#   <name>_scales  float32 scales {rows, cols / GROUP_SIZE}
+#
+# The biases, the layer normalization parameters and the positional embeddings stay in float32.
+
+import os
+import sys
+
+import numpy as np
+
+from convertWeights import (DTYPE_FLOAT32, DTYPE_INT4, DTYPE_INT8, MODEL_PARAMS, readWeights, writeCheckpoint)
+
+
+GROUP_SIZE = 64     # Must be the same as kernels::kQuantGroupSize.
+
+
+def isQuantized(name):
+    return name.endswith("/w") or name == "wte"
+
+
+def quantize(weights, numBits):
+    # Returns the codes and the scales of a {rows, cols} matrix.
+    rows, cols = weights.shape
+    groups = weights.reshape(rows, cols // GROUP_SIZE, GROUP_SIZE)
+    maxCode = (1 << (numBits - 1)) - 1
+    scales = np.abs(groups).max(axis=-1) / maxCode
+    scales[scales == 0] = 1
+    codes = np.clip(np.rint(groups / scales[..., None]), -maxCode, maxCode).astype(np.int8).reshape(rows, cols)
+    if numBits == 4:
+        nibbles = codes.view(np.uint8) & 0xF
+        codes = nibbles[:, 0::2] | (nibbles[:, 1::2] << 4)
+    return codes, scales.astype(np.float32)
+
+
+def quantizeWeights(sourceFilepath, targetFilepath, modelSize, numBits):
+    source = np.memmap(sourceFilepath, dtype=np.uint8, mode="r")
+    codeType = DTYPE_INT8 if numBits == 8 else DTYPE_INT4
+    tensors = []
+
+    def loadMatrix(name, shape, offset):
+        weights = np.frombuffer(source, dtype="<f4", count=int(np.prod(shape)), offset=offset).reshape(shape)
+        return weights if name == "wte" else weights.T       # Linear weights: {in, out} --> {out, in}
+
+    # The codes and the scales of a weight are written one after the other, so a weight is quantized only once.
+    quantized = {}
+
+    def quantizedWriter(name, shape, offset, part):
+        def writePayload(file):
+            if name not in quantized:
+                quantized.clear()
+                quantized[name] = quantize(loadMatrix(name, shape, offset), numBits)
+            file.write(quantized[name][part].tobytes())
+        return writePayload
+
+    def payloadWriter(offset, numBytes):
+        return lambda file: file.write(source[offset:offset + numBytes].tobytes())
+
+    for name, shape, offset in readWeights(sourceFilepath, modelSize):
+        if isQuantized(name):
+            rows, cols = shape if name == "wte" else shape[::-1]
+            if cols % GROUP_SIZE != 0:
+                raise ValueError(f"Columns of {name} are not multiple of the group size: {cols}")
+            numGroups = cols // GROUP_SIZE
+            tensors.append((name + "_q", codeType, [rows, cols], rows * cols * numBits // 8,
+                            quantizedWriter(name, shape, offset, 0)))
+            tensors.append((name + "_scales", DTYPE_FLOAT32, [rows, numGroups], rows * numGroups * 4,
+                            quantizedWriter(name, shape, offset, 1)))
+        else:
+            numBytes = 4 * int(np.prod(shape))
+            tensors.append((name, DTYPE_FLOAT32, shape, numBytes, payloadWriter(offset, numBytes)))
+
+    writeCheckpoint(targetFilepath, tensors)
+
+
+def main():
+    if len(sys.argv) != 3 or sys.argv[1] not in MODEL_PARAMS or sys.argv[2] not in ["int8", "int4"]:
+        print("Please provide a model size and a quantization type as arguments.")
+        print("Model size options: 124M, 355M, 774M, 1558M. Quantization type options: int8, int4")
+        print("Example:")
+        print("         python " + sys.argv[0] + " 124M int8")
+        exit()
+
+    modelSize, quantType = sys.argv[1], sys.argv[2]
+    sourceFilepath = os.path.join("./GPT2", "oaiWeights" + modelSize + ".bin")
+    targetFilepath = os.path.join("./GPT2", "oaiWeights" + modelSize + "-" + quantType + ".ckpt")
+    quantizeWeights(sourceFilepath, targetFilepath, modelSize, 8 if quantType == "int8" else 4)
+    print("Quantized " + sourceFilepath + " to " + targetFilepath)
+
+
+if __name__ == "__main__":
+    main()
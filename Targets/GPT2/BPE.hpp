@@ -9,138 +9,500 @@
 
 #pragma once
 
+// Project includes
+#include "MappedFile.hpp"
+#include "ThreadPool.hpp"
+// External includes
+// System includes
+#include <atomic>
+#include <algorithm>
 #include <cassert>
+#include <cstdint>
+#include <cstring>
+#include <filesystem>
 #include <fstream>
+#include <future>
+#include <functional>
 #include <iostream>
-#include <regex>
-#include <set>
+#include <limits>
+#include <locale>
+#include <queue>
+#include <span>
+#include <stdexcept>
 #include <string>
+#include <string_view>
 #include <unordered_map>
 #include <utility>
-
-
+#include <vector>
+
+
+// BPE is the byte-level Byte-Pair-Encoding tokenizer of GPT2. The symbols, the byte-encoded strings of the tokens and
+// the merge results, are interned to integer ids, and the merge rules are stored in a flat table of the symbol id
+// pairs. A word is merged on a linked list of its symbols with a min-heap of the candidate pairs, so each merge costs
+// O(log n) instead of a rescan of all pairs. The merged tokens of the recent words are cached.
+// The text is split into the words by a scanner on the UTF-8 bytes, which implements the GPT2 pre-tokenizer pattern
+// ('s|'t|'re|'ve|'m|'ll|'d| ?[a-zA-Z]+| ?\d+| ?[^\s\w]+|\s+) without a regular expression engine.
+// The const encoders are thread-safe, since each worker merges the words in its own state.
+// All tables are flat arrays, so they can be saved to a binary tokenizer image, and used from the mapped image without
+// parsing the text files.
 class BPE
 {
 public:
+    // Receives the tokens of the consecutive parts of a streamed text in order.
+    using TokenSink = std::function<void(const uint16_t* tokenIds, size_t numTokens)>;
+
+    static constexpr size_t kStreamChunkSize = 4 << 20;     // Bytes of text encoded by a task.
+
     // Constructor
     BPE() = default;
 
     // Constructor
     BPE(const std::string& mergesFile, const std::string& vocabsFile)
-        : m_re(L"('s|'t|'re|'ve|'m|'ll|'d| ?[a-zA-Z]+| ?\\d+| ?[^\\s\\w]+|\\s+)")
     {
-        m_bpeRanks.clear();
-        m_b2u.clear();
-        m_u2b.clear();
-        m_t2i.clear();
-        m_i2t.clear();
+        // The vocabulary is loaded first, so the symbols of the tokens are interned in the token order.
+        std::unordered_map<std::string, int32_t> symbolIds;
+        std::vector<std::string> tokens;
+        loadVocab(vocabsFile, symbolIds, tokens);
+        auto b2u = bytesToUnicode();
+        loadMergeRules(mergesFile, b2u, symbolIds);
+        buildTokenTables(tokens, b2u);
+
+        m_symbolTokenIds = m_symbolTokenIdStorage;
+        m_tokenOffsets   = m_tokenOffsetStorage;
+        m_sortedTokenIds = m_sortedTokenIdStorage;
+        m_tokenPool      = std::string_view(m_tokenPoolStorage.data(), m_tokenPoolStorage.size());
+    }
+
+    // Constructor. Maps a tokenizer image that is saved by saveImage().
+    explicit BPE(const std::string& imageFile) : m_image{imageFile}
+    {
+        ImageHeader header;
+        if (m_image.size() < sizeof(header))
+        {
+            throw std::runtime_error("Invalid tokenizer image: " + imageFile);
+        }
+        std::memcpy(&header, m_image.data(), sizeof(header));
+        if (std::memcmp(header.magic, kImageMagic, sizeof(header.magic)) != 0 || header.version != kImageVersion)
+        {
+            throw std::runtime_error("Invalid tokenizer image: " + imageFile);
+        }
 
-        loadMergeRules(mergesFile);
-        loadVocab(vocabsFile);
-        bytesToUnicode();
+        auto layout = imageLayout(header);
+        if (m_image.size() != layout.size)
+        {
+            throw std::runtime_error("Tokenizer image size does not match its header: " + imageFile);
+        }
+
+        // The sections are aligned to their element types in the mapping.
+        auto section = [&](size_t offset) { return m_image.data() + offset; };
+        m_merges.map({reinterpret_cast<const uint64_t*>(section(layout.mergeKeys)), header.mergeCapacity},
+                     {reinterpret_cast<const MergeTable::Merge*>(section(layout.merges)), header.mergeCapacity},
+                     header.mergeShift);
+        m_symbolTokenIds = {reinterpret_cast<const int32_t*>(section(layout.symbolTokenIds)), header.numSymbols};
+        m_tokenOffsets   = {reinterpret_cast<const uint32_t*>(section(layout.tokenOffsets)), header.numTokens + 1};
+        m_sortedTokenIds = {reinterpret_cast<const uint32_t*>(section(layout.sortedTokenIds)), header.numTokens};
+        m_tokenPool = {reinterpret_cast<const char*>(section(layout.tokenPool)), header.poolSize};
+        std::copy(std::begin(header.byteSymbols), std::end(header.byteSymbols), m_byteSymbols);
+
+        if (m_tokenOffsets.back() != header.poolSize)
+        {
+            throw std::runtime_error("Invalid tokenizer image: " + imageFile);
+        }
     }
 
-    std::vector<ssize_t> encode(const std::string& text, const std::string& eot="<|endoftext|>")
+    BPE(const BPE&) = delete;
+    BPE& operator=(const BPE&) = delete;
+    BPE(BPE&&) = default;
+    BPE& operator=(BPE&&) = default;
+
+    // Saves the tables to a tokenizer image. The image is written to a temporary file first, so a process never maps
+    // a partially written image.
+    void saveImage(const std::string& imageFile) const
     {
-        std::vector<std::string> tokens;
-        size_t s = 0;
-        size_t i = text.find(eot);
-        while (i != std::string::npos)
+        ImageHeader header;
+        std::memcpy(header.magic, kImageMagic, sizeof(header.magic));
+        header.version       = kImageVersion;
+        header.numTokens     = static_cast<uint32_t>(m_sortedTokenIds.size());
+        header.numSymbols    = static_cast<uint32_t>(m_symbolTokenIds.size());
+        header.mergeCapacity = static_cast<uint32_t>(m_merges.keys().size());
+        header.mergeShift    = m_merges.shift();
+        header.poolSize      = static_cast<uint32_t>(m_tokenPool.size());
+        std::copy(std::begin(m_byteSymbols), std::end(m_byteSymbols), header.byteSymbols);
+        auto layout = imageLayout(header);
+
+        std::vector<char> image(layout.size, 0);
+        auto write = [&](size_t offset, const void* data, size_t numBytes)
         {
-            tokenize(text.substr(s, i - s), tokens);
-            tokens.emplace_back(eot);
-            s = i + eot.size();
-            i = text.find(eot, s);
+            if (numBytes > 0) std::memcpy(image.data() + offset, data, numBytes);
+        };
+        write(0, &header, sizeof(header));
+        write(layout.mergeKeys, m_merges.keys().data(), m_merges.keys().size_bytes());
+        write(layout.merges, m_merges.merges().data(), m_merges.merges().size_bytes());
+        write(layout.symbolTokenIds, m_symbolTokenIds.data(), m_symbolTokenIds.size_bytes());
+        write(layout.tokenOffsets, m_tokenOffsets.data(), m_tokenOffsets.size_bytes());
+        write(layout.sortedTokenIds, m_sortedTokenIds.data(), m_sortedTokenIds.size_bytes());
+        write(layout.tokenPool, m_tokenPool.data(), m_tokenPool.size());
+
+        auto tempFile = imageFile + ".tmp";
+        {
+            std::ofstream out(tempFile, std::ios::binary | std::ios::trunc);
+            out.write(image.data(), static_cast<std::streamsize>(image.size()));
+            if (!out)
+            {
+                throw std::ios_base::failure("Failed to write the tokenizer image: " + tempFile);
+            }
         }
-        tokenize(text.substr(s), tokens);
+        std::filesystem::rename(tempFile, imageFile);
+    }
 
+    std::vector<ssize_t> encode(const std::string& text, const std::string& eot="<|endoftext|>")
+    {
         std::vector<ssize_t> tokenIds;
-        tokenIds.reserve(tokens.size());
-        for (const auto& token : tokens)
+        encode(text, eot, m_state, tokenIds);
+        return tokenIds;
+    }
+
+    // Encodes the documents in parallel, and returns the tokens of each document. Zero threads uses the number of
+    // hardware threads.
+    std::vector<std::vector<ssize_t>> encodeBatch(std::span<const std::string_view> documents, size_t numThreads = 0,
+                                                  const std::string& eot="<|endoftext|>") const
+    {
+        if (numThreads == 0) numThreads = std::max(1u, std::thread::hardware_concurrency());
+        ThreadPool pool(std::max<size_t>(1, std::min(documents.size(), numThreads)));
+        std::vector<EncodeState> states(pool.size());
+        std::vector<std::vector<ssize_t>> tokenIds(documents.size());
+        encodeParallel(pool, states, documents, eot, [&](size_t i, std::vector<ssize_t>& documentTokenIds)
         {
-            tokenIds.emplace_back(m_t2i.at(token));
-        }
+            tokenIds[i] = std::move(documentTokenIds);
+        });
         return tokenIds;
     }
 
-    std::string decode(const std::vector<ssize_t>& tokenIds)
+    // Encodes a text in memory, e.g. a mapped file, in parallel chunks, and passes the tokens to the sink in order.
+    void encodeStream(std::string_view text, const TokenSink& sink, size_t numThreads = 0,
+                      size_t chunkSize = kStreamChunkSize, const std::string& eot="<|endoftext|>") const
     {
-        std::string str;
-        for (ssize_t id : tokenIds)
+        ThreadPool pool(numThreads);
+        std::vector<EncodeState> states(pool.size());
+        std::vector<std::string_view> chunks;
+        size_t pos = 0;
+        while (pos < text.size())
+        {
+            // Only a few chunks per worker are encoded at once, so the tokens of the whole text are not kept.
+            pos += splitChunks(text.substr(pos), chunkSize, pool.size() * 2, true, chunks);
+            encodeChunks(pool, states, chunks, eot, sink);
+        }
+    }
+
+    // Encodes a text that is read from the stream in parallel chunks, and passes the tokens to the sink in order.
+    void encodeStream(std::istream& in, const TokenSink& sink, size_t numThreads = 0,
+                      size_t chunkSize = kStreamChunkSize, const std::string& eot="<|endoftext|>") const
+    {
+        ThreadPool pool(numThreads);
+        std::vector<EncodeState> states(pool.size());
+        std::vector<std::string_view> chunks;
+        std::string buffer;
+        bool last = false;
+        while (!last || !buffer.empty())
         {
-            str += m_i2t.at(id);
+            // The text after the last chunk boundary is carried over to the next read.
+            if (!last)
+            {
+                auto size = buffer.size();
+                buffer.resize(std::max(size + chunkSize, pool.size() * chunkSize));
+                in.read(buffer.data() + size, static_cast<std::streamsize>(buffer.size() - size));
+                buffer.resize(size + static_cast<size_t>(in.gcount()));
+                last = !in;
+            }
+
+            auto numBytes = splitChunks(buffer, chunkSize, pool.size(), last, chunks);
+            encodeChunks(pool, states, chunks, eot, sink);
+            buffer.erase(0, numBytes);
         }
+    }
 
-        auto wstr = utf8ToWString(str);
+    // Returns a sink that writes the tokens to a preallocated buffer, and counts them in numTokens.
+    static TokenSink bufferSink(uint16_t* tokenIds, size_t capacity, size_t& numTokens)
+    {
+        numTokens = 0;
+        return [=, &numTokens](const uint16_t* chunkTokenIds, size_t numChunkTokens)
+        {
+            if (numTokens + numChunkTokens > capacity)
+            {
+                throw std::length_error("Token buffer is too small.");
+            }
+            std::copy(chunkTokenIds, chunkTokenIds + numChunkTokens, tokenIds + numTokens);
+            numTokens += numChunkTokens;
+        };
+    }
+
+    std::string decode(const std::vector<ssize_t>& tokenIds) const
+    {
         std::string text;
-        for (wchar_t c : wstr)
+        for (ssize_t id : tokenIds)
         {
-            text.push_back(char(m_u2b.at(c)));
+            text += tokenBytes(id);
         }
         return text;
     }
 
-private:
-    // pairWStringHasher is used in BPERanks to make a pair of wstrings hashable, so the pair can be used as the key to
-    // unordered_map.
-    struct pairWStringHasher
+    // Returns the raw bytes of a token. A token may end in the middle of a UTF-8 character.
+    std::string_view tokenBytes(ssize_t tokenId) const
     {
-        size_t operator()(const std::pair<std::wstring, std::wstring>& p) const
+        if (tokenId < 0 || static_cast<size_t>(tokenId) >= m_sortedTokenIds.size())
         {
-            auto hash1 = std::hash<std::wstring>{}(p.first);
-            auto hash2 = std::hash<std::wstring>{}(p.second);
-            return (hash1 != hash2) ? hash1 ^ hash2 : hash1;
+            throw std::out_of_range("Token id is not in the vocabulary.");
         }
-    };
-
-    // BPERanks maps each merge rule, which is a pair of wstrings, to its rank. This mapping allows quick lookup for
-    // the optimal merge rule.
-    using BPERanks = std::unordered_map<std::pair<std::wstring, std::wstring>, ssize_t, pairWStringHasher>;
+        auto offset = m_tokenOffsets[tokenId];
+        return m_tokenPool.substr(offset, m_tokenOffsets[tokenId + 1] - offset);
+    }
 
-    static std::wstring utf8ToWString(const std::string& str)
+    // Returns the id of the token with the given raw bytes.
+    ssize_t tokenId(std::string_view bytes) const
     {
-        std::wstring wstr;
-        wstr.reserve(str.size());   // Reserve enough space in advance.
-
-        size_t i = 0;
-        while (i < str.size())
+        auto it = std::lower_bound(m_sortedTokenIds.begin(), m_sortedTokenIds.end(), bytes,
+                                   [this](uint32_t id, std::string_view str) { return tokenBytes(id) < str; });
+        if (it == m_sortedTokenIds.end() || tokenBytes(*it) != bytes)
         {
-            wchar_t wc;
-            auto ch = static_cast<unsigned char>(str[i]);
+            throw std::out_of_range("Token is not in the vocabulary.");
+        }
+        return *it;
+    }
 
-            if (ch <= 0x7f)
-            {
-                wc = ch;
-                i += 1;
-            }
-            else if (ch <= 0xdf)
+    // Returns the words of the pre-tokenizer pattern in the text, in the order of the text. The characters that do
+    // not match the pattern are skipped, as in the encoding.
+    std::vector<std::string_view> splitWords(std::string_view text) const
+    {
+        std::vector<std::string_view> words;
+        size_t pos = 0;
+        while (pos < text.size())
+        {
+            auto end = scanWord(text, pos);
+            if (end == pos)
             {
-                wc = (ch & 0x1f) << 6;
-                wc |= (static_cast<unsigned char>(str[i + 1]) & 0x3f);
-                i += 2;
+                decodeUTF8(text, pos);
+                continue;
             }
-            else if (ch <= 0xef)
+            words.emplace_back(text.substr(pos, end - pos));
+            pos = end;
+        }
+        return words;
+    }
+
+    size_t vocabSize() const    { return m_sortedTokenIds.size(); }
+
+private:
+    // MergeTable maps a pair of symbol ids to the rank of its merge rule and the merged symbol id. It is a flat open
+    // addressing hash table with linear probing, so a lookup neither allocates nor chases pointers.
+    class MergeTable
+    {
+    public:
+        struct Merge
+        {
+            int32_t rank{0};
+            int32_t merged{0};
+        };
+
+        void reserve(size_t numMerges)
+        {
+            size_t capacity = 16;
+            m_shift = 60;
+            while (capacity < numMerges * 2)
             {
-                wc = (ch & 0x0f) << 12;
-                wc |= (static_cast<unsigned char>(str[i + 1]) & 0x3f) << 6;
-                wc |= (static_cast<unsigned char>(str[i + 2]) & 0x3f);
-                i += 3;
+                capacity *= 2;
+                --m_shift;
             }
-            else if (ch <= 0xf7)
+            m_keyStorage.assign(capacity, kEmpty);
+            m_mergeStorage.assign(capacity, {});
+            m_keys   = m_keyStorage;
+            m_merges = m_mergeStorage;
+        }
+
+        // Uses the tables of a tokenizer image.
+        void map(std::span<const uint64_t> keys, std::span<const Merge> merges, int shift)
+        {
+            m_keys   = keys;
+            m_merges = merges;
+            m_shift  = shift;
+        }
+
+        // Inserts a merge rule. The rule with the lower rank is kept if a pair has two rules.
+        void insert(int32_t left, int32_t right, Merge merge)
+        {
+            auto key = pairKey(left, right);
+            for (auto i = slot(key); ; i = (i + 1) & (m_keyStorage.size() - 1))
             {
-                wc = (ch & 0x07) << 18;
-                wc |= (static_cast<unsigned char>(str[i + 1]) & 0x3f) << 12;
-                wc |= (static_cast<unsigned char>(str[i + 2]) & 0x3f) << 6;
-                wc |= (static_cast<unsigned char>(str[i + 3]) & 0x3f);
-                i += 4;
+                if (m_keyStorage[i] == key) return;
+                if (m_keyStorage[i] == kEmpty)
+                {
+                    m_keyStorage[i] = key;
+                    m_mergeStorage[i] = merge;
+                    return;
+                }
             }
-            else
+        }
+
+        const Merge* find(int32_t left, int32_t right) const
+        {
+            auto key = pairKey(left, right);
+            for (auto i = slot(key); ; i = (i + 1) & (m_keys.size() - 1))
             {
-                // Invalid UTF-8 leading byte.
-                throw std::runtime_error("Invalid UTF-8 sequence.");
+                if (m_keys[i] == key) return &m_merges[i];
+                if (m_keys[i] == kEmpty) return nullptr;
             }
+        }
 
-            wstr.push_back(wc);
+        std::span<const uint64_t> keys() const      { return m_keys; }
+        std::span<const Merge> merges() const       { return m_merges; }
+        int shift() const                           { return m_shift; }
+
+    private:
+        static constexpr uint64_t kEmpty = std::numeric_limits<uint64_t>::max();
+
+        static uint64_t pairKey(int32_t left, int32_t right)
+        {
+            return (uint64_t(uint32_t(left)) << 32) | uint32_t(right);
+        }
+
+        // Fibonacci hashing. The high bits of the product are well mixed.
+        size_t slot(uint64_t key) const     { return (key * 0x9e3779b97f4a7c15ull) >> m_shift; }
+
+        std::vector<uint64_t>  m_keyStorage;       // The tables built from the merge rules.
+        std::vector<Merge>  m_mergeStorage;
+        std::span<const uint64_t>  m_keys;
+        std::span<const Merge>  m_merges;
+        int  m_shift{60};
+    };
+
+    // A symbol of a word in the merge list.
+    struct Symbol
+    {
+        int32_t id;
+        int32_t prev;
+        int32_t next;
+    };
+
+    // A candidate merge of the symbol at the position left with its next symbol.
+    struct MergeCandidate
+    {
+        int32_t rank;
+        int32_t left;
+        int32_t leftId;
+        int32_t rightId;
+
+        // The lowest rank is merged first, and the leftmost pair among the same ranks.
+        bool operator>(const MergeCandidate& other) const
+        {
+            return rank != other.rank ? rank > other.rank : left > other.left;
+        }
+    };
+
+    // Transparent string hash, so the word cache can be searched with the string views of the text.
+    struct StringHash
+    {
+        using is_transparent = void;
+        size_t operator()(std::string_view str) const     { return std::hash<std::string_view>{}(str); }
+    };
+
+    // Scratch buffers and the word cache of an encoder thread.
+    struct EncodeState
+    {
+        std::vector<Symbol>  symbols;
+        std::unordered_map<std::string, std::vector<ssize_t>, StringHash, std::equal_to<>>  wordCache;
+    };
+
+    static constexpr size_t kWordCacheSize = 1 << 16;
+
+    // The tokenizer image is the header followed by the sections of the tables. Each section starts at a multiple of
+    // 8 bytes. The image is only read on the machine that wrote it, so the native byte order is used.
+    static constexpr char kImageMagic[8] = {'G', 'P', 'T', '2', 'B', 'P', 'E', '\0'};
+    static constexpr uint32_t kImageVersion = 1;
+
+    struct ImageHeader
+    {
+        char magic[8];
+        uint32_t version;
+        uint32_t numTokens;
+        uint32_t numSymbols;
+        uint32_t mergeCapacity;
+        int32_t  mergeShift;
+        uint32_t poolSize;
+        int32_t  byteSymbols[256];
+    };
+
+    // Byte offsets of the image sections.
+    struct ImageLayout
+    {
+        size_t mergeKeys;
+        size_t merges;
+        size_t symbolTokenIds;
+        size_t tokenOffsets;
+        size_t sortedTokenIds;
+        size_t tokenPool;
+        size_t size;
+    };
+
+    static ImageLayout imageLayout(const ImageHeader& header)
+    {
+        auto align = [](size_t offset) { return (offset + 7) & ~size_t(7); };
+        ImageLayout layout;
+        layout.mergeKeys      = align(sizeof(ImageHeader));
+        layout.merges         = align(layout.mergeKeys + size_t(header.mergeCapacity) * sizeof(uint64_t));
+        layout.symbolTokenIds = align(layout.merges + size_t(header.mergeCapacity) * sizeof(MergeTable::Merge));
+        layout.tokenOffsets   = align(layout.symbolTokenIds + size_t(header.numSymbols) * sizeof(int32_t));
+        layout.sortedTokenIds = align(layout.tokenOffsets + (size_t(header.numTokens) + 1) * sizeof(uint32_t));
+        layout.tokenPool      = align(layout.sortedTokenIds + size_t(header.numTokens) * sizeof(uint32_t));
+        layout.size           = layout.tokenPool + header.poolSize;
+        return layout;
+    }
+
+    // Decodes the UTF-8 character at the position i, and advances i to the next character.
+    static wchar_t decodeUTF8(std::string_view str, size_t& i)
+    {
+        wchar_t wc;
+        auto ch = static_cast<unsigned char>(str[i]);
+        size_t size = ch <= 0x7f ? 1 : ch <= 0xdf ? 2 : ch <= 0xef ? 3 : 4;
+        if (ch > 0xf7 || i + size > str.size())
+        {
+            // Invalid UTF-8 leading byte or a truncated sequence.
+            throw std::runtime_error("Invalid UTF-8 sequence.");
+        }
+
+        if (size == 1)
+        {
+            wc = ch;
+        }
+        else if (size == 2)
+        {
+            wc = (ch & 0x1f) << 6;
+            wc |= (static_cast<unsigned char>(str[i + 1]) & 0x3f);
+        }
+        else if (size == 3)
+        {
+            wc = (ch & 0x0f) << 12;
+            wc |= (static_cast<unsigned char>(str[i + 1]) & 0x3f) << 6;
+            wc |= (static_cast<unsigned char>(str[i + 2]) & 0x3f);
+        }
+        else
+        {
+            wc = (ch & 0x07) << 18;
+            wc |= (static_cast<unsigned char>(str[i + 1]) & 0x3f) << 12;
+            wc |= (static_cast<unsigned char>(str[i + 2]) & 0x3f) << 6;
+            wc |= (static_cast<unsigned char>(str[i + 3]) & 0x3f);
+        }
+        i += size;
+        return wc;
+    }
+
+    static std::wstring utf8ToWString(const std::string& str)
+    {
+        std::wstring wstr;
+        wstr.reserve(str.size());   // Reserve enough space in advance.
+
+        size_t i = 0;
+        while (i < str.size())
+        {
+            wstr.push_back(decodeUTF8(str, i));
         }
         return wstr;
     }
@@ -180,17 +542,17 @@ private:
         return str;
     }
 
-    void bytesToUnicode()
+    static std::unordered_map<uint8_t, wchar_t> bytesToUnicode()
     {
+        std::unordered_map<uint8_t, wchar_t> b2u;
         auto insertRange = [&](ssize_t start, ssize_t end)
         {
             for (ssize_t c = start; c <= end; c++)
             {
-                m_b2u.insert({uint8_t(c), wchar_t(c)});
+                b2u.insert({uint8_t(c), wchar_t(c)});
             }
         };
 
-        m_b2u.clear();
         insertRange(L'!', L'~');
         insertRange(L'¡', L'¬');
         insertRange(L'®', L'ÿ');
@@ -198,166 +560,334 @@ private:
         ssize_t n = 0;
         for (ssize_t b = 0; b < 256; b++)
         {
-            if (!m_b2u.contains(uint8_t(b)))
+            if (!b2u.contains(uint8_t(b)))
             {
-                m_b2u.insert({uint8_t(b), wchar_t(256 + n)});
+                b2u.insert({uint8_t(b), wchar_t(256 + n)});
                 n++;
             }
         }
+        return b2u;
+    }
+
+    // Decodes the byte-encoded string of each token to its raw bytes once, so decoding is a table lookup. The bytes
+    // of all tokens are stored in a pool in the token id order.
+    void buildTokenTables(const std::vector<std::string>& tokens, const std::unordered_map<uint8_t, wchar_t>& b2u)
+    {
+        std::unordered_map<wchar_t, uint8_t> u2b;
+        for (auto [b, u] : b2u) u2b.emplace(u, b);
 
-        m_u2b.clear();
-        for (auto e : m_b2u)
+        m_tokenOffsetStorage.clear();
+        m_tokenPoolStorage.clear();
+        for (const auto& token : tokens)
         {
-            m_u2b.insert({e.second, e.first});
+            m_tokenOffsetStorage.emplace_back(static_cast<uint32_t>(m_tokenPoolStorage.size()));
+            for (wchar_t c : utf8ToWString(token))
+            {
+                m_tokenPoolStorage.push_back(char(u2b.at(c)));
+            }
         }
+        m_tokenOffsetStorage.emplace_back(static_cast<uint32_t>(m_tokenPoolStorage.size()));
+
+        auto bytes = [&](uint32_t id)
+        {
+            auto offset = m_tokenOffsetStorage[id];
+            return std::string_view(m_tokenPoolStorage.data() + offset, m_tokenOffsetStorage[id + 1] - offset);
+        };
+        m_sortedTokenIdStorage.resize(tokens.size());
+        for (size_t i=0; i<tokens.size(); ++i) m_sortedTokenIdStorage[i] = static_cast<uint32_t>(i);
+        std::sort(m_sortedTokenIdStorage.begin(), m_sortedTokenIdStorage.end(),
+                  [&](uint32_t a, uint32_t b) { return bytes(a) < bytes(b); });
     }
 
-    // Given a token as a UTF8 string, encode each byte into a wchar_t.
-    void byteEncodeToken(const std::string& token, std::wstring& encodedToken) const
+    // Returns the id of a symbol. The new symbols get the next id.
+    int32_t internSymbol(std::unordered_map<std::string, int32_t>& symbolIds, const std::string& symbol)
     {
-        encodedToken.resize(0);
-        for (char c : token)
-        {
-            wchar_t wc = m_b2u.at(uint8_t(c));
-            encodedToken.push_back(wc);
-        }
+        auto [it, inserted] = symbolIds.try_emplace(symbol, static_cast<int32_t>(m_symbolTokenIdStorage.size()));
+        if (inserted) m_symbolTokenIdStorage.emplace_back(-1);
+        return it->second;
     }
 
-    void loadMergeRules(const std::string& filename)
+    void loadMergeRules(const std::string& filename, const std::unordered_map<uint8_t, wchar_t>& b2u,
+                        std::unordered_map<std::string, int32_t>& symbolIds)
     {
         std::fstream ins(filename, std::ios::in);
-        m_bpeRanks.clear();
 
+        std::vector<std::string> lines;
         std::string line;
         ssize_t n = 0;
         while (std::getline(ins, line))
         {
-            if (n++ > 0)        // Skip the version comment.
+            if (n++ > 0 && !line.empty()) lines.emplace_back(line);      // Skip the version comment.
+        }
+        ins.close();
+
+        m_merges.reserve(lines.size());
+        for (size_t rank=0; rank<lines.size(); ++rank)
+        {
+            const auto& rule = lines[rank];
+            auto d = rule.find(' ');        // Merges file uses ASCII spaces.
+            auto left  = rule.substr(0, d);
+            auto right = rule.substr(d + 1);
+            m_merges.insert(internSymbol(symbolIds, left), internSymbol(symbolIds, right),
+                            {static_cast<int32_t>(rank), internSymbol(symbolIds, left + right)});
+        }
+
+        // Byte-level symbols of the words.
+        for (size_t b=0; b<256; ++b)
+        {
+            m_byteSymbols[b] = internSymbol(symbolIds, wstringToUTF8(std::wstring(1, b2u.at(uint8_t(b)))));
+        }
+    }
+
+    // Splits a word, in UTF-8 bytes, into the tokens of the merge rules.
+    void bpe(std::string_view word, EncodeState& state, std::vector<ssize_t>& tokenIds) const
+    {
+        auto& symbols = state.symbols;
+        auto cached = state.wordCache.find(word);
+        if (cached != state.wordCache.end())
+        {
+            tokenIds.insert(tokenIds.end(), cached->second.begin(), cached->second.end());
+            return;
+        }
+
+        auto numSymbols = static_cast<int32_t>(word.size());
+        symbols.resize(word.size());
+        for (int32_t i=0; i<numSymbols; ++i)
+        {
+            symbols[i] = {m_byteSymbols[uint8_t(word[i])], i - 1, i + 1};
+        }
+
+        std::priority_queue<MergeCandidate, std::vector<MergeCandidate>, std::greater<>> candidates;
+        auto addCandidate = [&](int32_t left)
+        {
+            if (left < 0 || symbols[left].next >= numSymbols) return;
+            auto leftId  = symbols[left].id;
+            auto rightId = symbols[symbols[left].next].id;
+            auto merge = m_merges.find(leftId, rightId);
+            if (merge) candidates.push({merge->rank, left, leftId, rightId});
+        };
+        for (int32_t i=0; i<numSymbols - 1; ++i) addCandidate(i);
+
+        while (!candidates.empty())
+        {
+            auto candidate = candidates.top();
+            candidates.pop();
+
+            // Skip the candidates of the pairs that were changed by the earlier merges.
+            auto& left = symbols[candidate.left];
+            if (left.id != candidate.leftId || left.next >= numSymbols) continue;
+            auto& right = symbols[left.next];
+            if (right.id != candidate.rightId) continue;
+
+            left.id   = m_merges.find(candidate.leftId, candidate.rightId)->merged;
+            right.id  = -1;
+            left.next = right.next;
+            if (right.next < numSymbols) symbols[right.next].prev = candidate.left;
+
+            addCandidate(left.prev);
+            addCandidate(candidate.left);
+        }
+
+        std::vector<ssize_t> wordTokenIds;
+        for (int32_t i=0; i<numSymbols; i=symbols[i].next)
+        {
+            auto tokenId = m_symbolTokenIds[symbols[i].id];
+            if (tokenId < 0)
             {
-                auto d = line.find(' ');        // Merges file uses ASCII spaces.
-                m_bpeRanks.insert({{utf8ToWString(line.substr(0, d)), utf8ToWString(line.substr(d + 1))}, n - 1});
+                throw std::out_of_range("BPE symbol is not in the vocabulary.");
             }
+            wordTokenIds.emplace_back(tokenId);
         }
+        tokenIds.insert(tokenIds.end(), wordTokenIds.begin(), wordTokenIds.end());
 
-        ins.close();
+        if (state.wordCache.size() >= kWordCacheSize) state.wordCache.clear();
+        state.wordCache.emplace(std::string(word), std::move(wordTokenIds));
     }
 
-    static void getPairs(const std::wstring& word, std::vector<std::pair<std::wstring, std::wstring>>& pairs)
+    // Character classes of the pre-tokenizer pattern.
+    enum class CharClass
     {
-        pairs.clear();
-        if (word.size() < 2) return;
-        pairs.reserve(word.size());
+        kLetter,        // [a-zA-Z]
+        kDigit,         // \d
+        kSpace,         // \s
+        kOther,         // [^\s\w]
+        kWord,          // The other \w characters, i.e. the underscore and the non-ASCII letters.
+    };
 
-        wchar_t previous = word[0];
-        for (size_t i=1; i<word.size(); ++i)
+    // The classes are the ones of std::wregex, which uses the ctype facet of the global locale.
+    CharClass charClass(wchar_t wc) const
+    {
+        if ((wc >= L'a' && wc <= L'z') || (wc >= L'A' && wc <= L'Z')) return CharClass::kLetter;
+        if (m_ctype->is(std::ctype_base::digit, wc)) return CharClass::kDigit;
+        if (m_ctype->is(std::ctype_base::space, wc)) return CharClass::kSpace;
+        if (wc == L'_' || m_ctype->is(std::ctype_base::alnum, wc)) return CharClass::kWord;
+        return CharClass::kOther;
+    }
+
+    // Returns the end of the run of the characters of a class that starts at the position pos.
+    size_t scanRun(std::string_view text, size_t pos, CharClass cls) const
+    {
+        while (pos < text.size())
         {
-            pairs.emplace_back(std::wstring(1, previous), std::wstring(1, word[i]));
-            previous = word[i];
+            auto next = pos;
+            if (charClass(decodeUTF8(text, next)) != cls) break;
+            pos = next;
         }
+        return pos;
     }
 
-    void bpe(const std::wstring& token, std::vector<std::wstring>* result)
+    // Returns the end of the word that starts at the position pos, or pos if no alternative of the pattern matches.
+    // The alternatives are tried in the order of the pattern, as in the ECMAScript regular expressions.
+    size_t scanWord(std::string_view text, size_t pos) const
     {
-        std::set<ssize_t> merged;       // Stores indices in pairs that were merged.
-        auto left = [](ssize_t i, std::set<ssize_t>& merged) -> ssize_t
+        // Contractions. They are ASCII, so the bytes are compared.
+        if (text[pos] == '\'')
         {
-            for (ssize_t j = i - 1; j >= -1; j--)
+            for (std::string_view suffix : {"s", "t", "re", "ve", "m", "ll", "d"})
             {
-                if (!merged.contains(j)) return j;
+                if (text.compare(pos + 1, suffix.size(), suffix) == 0) return pos + 1 + suffix.size();
             }
-            return -1;
-        };
+        }
 
-        auto right = [](ssize_t i, ssize_t cap, std::set<ssize_t>& merged) -> ssize_t
+        // An optional space followed by a run of letters, digits or other symbols. The class of the first character
+        // selects the alternative, since the classes are disjoint. Without the space, a space can not start a run.
+        auto start = text[pos] == ' ' ? pos + 1 : pos;
+        if (start < text.size())
         {
-            for (ssize_t j = i + 1; j < cap; j++)
+            auto next = start;
+            auto cls = charClass(decodeUTF8(text, next));
+            if (cls == CharClass::kLetter || cls == CharClass::kDigit || cls == CharClass::kOther)
             {
-                if (!merged.contains(j)) return j;
+                return scanRun(text, next, cls);
             }
-            return cap;
-        };
+        }
 
-        std::vector<std::pair<std::wstring, std::wstring>> pairs;
-        getPairs(token, pairs);
+        return scanRun(text, pos, CharClass::kSpace);
+    }
 
-        while (true)
+    // Splits the text into the words of the pre-tokenizer pattern, and appends the tokens of each word. The characters
+    // that do not match the pattern are skipped.
+    void tokenize(std::string_view text, EncodeState& state, std::vector<ssize_t>& tokenIds) const
+    {
+        size_t pos = 0;
+        while (pos < text.size())
         {
-            ssize_t minScore = std::numeric_limits<ssize_t>::max();
-            ssize_t toMerge  = -1;      // Indices into pairs.
-
-            for (ssize_t i=0; i<static_cast<ssize_t>(pairs.size()); ++i)
+            auto end = scanWord(text, pos);
+            if (end == pos)
             {
-                if (!merged.contains(i))         // Pair i is not merged.
-                {
-                    auto iter = m_bpeRanks.find(pairs[i]);
-                    ssize_t score = iter != m_bpeRanks.end() ? iter->second : std::numeric_limits<ssize_t>::max();
-                    if (score < minScore)
-                    {
-                        minScore = score;
-                        toMerge = i;
-                    }
-                }
+                decodeUTF8(text, pos);
+                continue;
             }
-
-            if (toMerge == -1) break;
-
-            merged.insert(toMerge);
-            auto mergeInto = pairs[toMerge].first + pairs[toMerge].second;
-
-            ssize_t l = left(toMerge, merged);
-            if (l >= 0) pairs[l].second = mergeInto;
-            ssize_t r = right(toMerge, static_cast<ssize_t>(pairs.size()), merged);
-            if (r < static_cast<ssize_t>(pairs.size())) pairs[r].first = mergeInto;
+            bpe(text.substr(pos, end - pos), state, tokenIds);
+            pos = end;
         }
+    }
 
-        if (merged.size() == pairs.size())
+    // Appends the tokens of a text. The end-of-text markers are encoded as the end-of-text token.
+    void encode(std::string_view text, std::string_view eot, EncodeState& state, std::vector<ssize_t>& tokenIds) const
+    {
+        size_t s = 0;
+        size_t i = text.find(eot);
+        while (i != std::string_view::npos)
         {
-            result->emplace_back(token);
+            tokenize(text.substr(s, i - s), state, tokenIds);
+            tokenIds.emplace_back(tokenId(eot));
+            s = i + eot.size();
+            i = text.find(eot, s);
         }
-        else
+        tokenize(text.substr(s), state, tokenIds);
+    }
+
+    // Encodes the texts on the pool, and calls the output with the index and the tokens of each text. The workers
+    // take the next text from a shared counter, and each worker uses its own state.
+    void encodeParallel(ThreadPool& pool, std::vector<EncodeState>& states, std::span<const std::string_view> texts,
+                        std::string_view eot, const std::function<void(size_t, std::vector<ssize_t>&)>& output) const
+    {
+        std::atomic<size_t> next{0};
+        std::vector<std::future<void>> futures;
+        for (auto& state : states)
         {
-            for (ssize_t i = 0; i < static_cast<ssize_t>(pairs.size()); ++i)
+            futures.emplace_back(pool.submit([&]
             {
-                if (!merged.contains(i))
+                for (auto i = next++; i < texts.size(); i = next++)
                 {
-                    if (left(i, merged) < 0) result->emplace_back(pairs[i].first);
-                    result->emplace_back(pairs[i].second);
+                    std::vector<ssize_t> tokenIds;
+                    encode(texts[i], eot, state, tokenIds);
+                    output(i, tokenIds);
                 }
-            }
+            }));
         }
+        // All workers must finish before an exception is rethrown, since they use the local state.
+        for (auto& future : futures) future.wait();
+        for (auto& future : futures) future.get();
     }
 
-    void tokenize(const std::string& text, std::vector<std::string>& result)
+    // Encodes the chunks of a streamed text, and passes their tokens to the sink in the chunk order.
+    void encodeChunks(ThreadPool& pool, std::vector<EncodeState>& states, const std::vector<std::string_view>& chunks,
+                      std::string_view eot, const TokenSink& sink) const
     {
-        auto wtext = utf8ToWString(text);
-        std::wsmatch match;
-        std::wstring::const_iterator searchStart(wtext.cbegin());
+        if (vocabSize() > size_t(std::numeric_limits<uint16_t>::max()) + 1)
+        {
+            throw std::overflow_error("BPE vocabulary does not fit into 16-bit token ids.");
+        }
 
-        while (std::regex_search(searchStart, wtext.cend(), match, m_re))
+        std::vector<std::vector<uint16_t>> chunkTokenIds(chunks.size());
+        encodeParallel(pool, states, chunks, eot, [&](size_t i, std::vector<ssize_t>& tokenIds)
         {
-            auto wtoken = match.str();
-            std::wstring encodedToken;
-            byteEncodeToken(wstringToUTF8(wtoken), encodedToken);
+            chunkTokenIds[i].assign(tokenIds.begin(), tokenIds.end());
+        });
+        for (const auto& tokenIds : chunkTokenIds) sink(tokenIds.data(), tokenIds.size());
+    }
 
-            std::vector<std::wstring> bpeTokens;
-            bpe(encodedToken, &bpeTokens);
+    // Returns true if the text can be split before the position pos without changing its tokens. It is a space after
+    // a character that is not a space, so the word before pos ends at pos, and a new word starts at pos. The markers
+    // are never split, since they have no spaces.
+    bool isChunkBoundary(std::string_view text, size_t pos) const
+    {
+        auto prev = static_cast<unsigned char>(text[pos - 1]);
+        return text[pos] == ' ' && prev <= 0x7f && charClass(prev) != CharClass::kSpace;
+    }
 
-            for (const auto& ws : bpeTokens)
+    // Splits up to maxChunks chunks of about chunkSize bytes from the beginning of the text, and returns the number
+    // of bytes of the chunks. The rest of the text is left for the next call unless the text is the last part.
+    size_t splitChunks(std::string_view text, size_t chunkSize, size_t maxChunks, bool last,
+                       std::vector<std::string_view>& chunks) const
+    {
+        chunks.clear();
+        size_t pos = 0;
+        while (pos < text.size() && chunks.size() < maxChunks)
+        {
+            auto end = pos + chunkSize;
+            if (end >= text.size())
             {
-                result.emplace_back(wstringToUTF8(ws));
+                if (!last) break;
+                end = text.size();
             }
-
-            searchStart = match.suffix().first;
+            else
+            {
+                // The nearest boundary before the chunk size, or the first one after it.
+                auto cut = end;
+                while (cut > pos + 1 && !isChunkBoundary(text, cut)) --cut;
+                if (!isChunkBoundary(text, cut))
+                {
+                    cut = end;
+                    while (cut < text.size() && !isChunkBoundary(text, cut)) ++cut;
+                    if (cut == text.size() && !last) break;
+                }
+                end = cut;
+            }
+            chunks.emplace_back(text.substr(pos, end - pos));
+            pos = end;
         }
+        return pos;
     }
 
-    void loadVocab(const std::string& filename)
+    // Loads the byte-encoded strings of the tokens in the id order.
+    void loadVocab(const std::string& filename, std::unordered_map<std::string, int32_t>& symbolIds,
+                   std::vector<std::string>& tokens)
     {
         std::fstream ins(filename, std::ios::in);
 
-        m_t2i.clear();
-        m_i2t.clear();
-
         std::string line;
         std::string token;
         ssize_t n = 0;
@@ -369,8 +899,10 @@ private:
             }
             else
             {
-                m_t2i.insert({token, std::stoi(line)});
-                m_i2t.insert({std::stoi(line), token});
+                auto id = std::stoi(line);
+                if (static_cast<size_t>(id) >= tokens.size()) tokens.resize(id + 1);
+                tokens[id] = token;
+                m_symbolTokenIdStorage[internSymbol(symbolIds, token)] = id;
             }
             n++;
         }
@@ -378,10 +910,80 @@ private:
         ins.close();
     }
 
-    std::wregex m_re;
-    BPERanks m_bpeRanks;
-    std::unordered_map<uint8_t, wchar_t>      m_b2u;
-    std::unordered_map<wchar_t, uint8_t>      m_u2b;
-    std::unordered_map<std::string, ssize_t>  m_t2i;
-    std::unordered_map<ssize_t, std::string>  m_i2t;
+    std::locale  m_locale;
+    const std::ctype<wchar_t>*  m_ctype{&std::use_facet<std::ctype<wchar_t>>(m_locale)};
+    MergeTable  m_merges;
+    std::span<const int32_t>   m_symbolTokenIds;    // Token id of each symbol, or -1 if the symbol is not a token.
+    std::span<const uint32_t>  m_tokenOffsets;      // Offset of the bytes of each token in the pool, and the end.
+    std::span<const uint32_t>  m_sortedTokenIds;    // Token ids in the order of their bytes.
+    std::string_view  m_tokenPool;                  // Raw bytes of all tokens.
+    int32_t  m_byteSymbols[256]{};
+    EncodeState  m_state;               // State of the non-const encode().
+
+    // The tables are either built from the text files or mapped from a tokenizer image.
+    std::vector<int32_t>   m_symbolTokenIdStorage;
+    std::vector<uint32_t>  m_tokenOffsetStorage;
+    std::vector<uint32_t>  m_sortedTokenIdStorage;
+    std::vector<char>  m_tokenPoolStorage;
+    MappedFile  m_image;
+};
+
+
+// StreamDecoder decodes the generated tokens one by one. A UTF-8 character may span tokens, so the bytes of an
+// incomplete character are kept until the next tokens complete it, and only complete characters are returned.
+class StreamDecoder
+{
+public:
+    // Constructor.
+    explicit StreamDecoder(const BPE& bpe) : m_bpe{bpe}
+    {
+        m_buffer.reserve(64);
+    }
+
+    // Returns the complete characters after the token is appended. The view is valid until the next call.
+    std::string_view decode(ssize_t tokenId)
+    {
+        // The incomplete bytes are moved to the front in place, so the buffer does not allocate once it is large
+        // enough for the longest token.
+        m_buffer.erase(0, m_numComplete);
+        m_buffer.append(m_bpe.tokenBytes(tokenId));
+        m_numComplete = completeLength(m_buffer);
+        return std::string_view(m_buffer).substr(0, m_numComplete);
+    }
+
+    // Returns the remaining bytes of an incomplete character at the end of the stream.
+    std::string_view flush()
+    {
+        m_buffer.erase(0, m_numComplete);
+        m_numComplete = m_buffer.size();
+        return m_buffer;
+    }
+
+    void reset()
+    {
+        m_buffer.clear();
+        m_numComplete = 0;
+    }
+
+private:
+    // Returns the length of the complete characters at the beginning of the bytes. Only the last character can be
+    // incomplete. The invalid bytes are counted as complete, so they do not stall the stream.
+    static size_t completeLength(std::string_view bytes)
+    {
+        auto size = bytes.size();
+        for (size_t i=size; i>0 && size - i < 4; --i)
+        {
+            auto ch = static_cast<unsigned char>(bytes[i - 1]);
+            if ((ch & 0xc0) == 0x80) continue;      // Continuation byte.
+
+            size_t length = ch >= 0xc0 && ch <= 0xdf ? 2 : ch >= 0xe0 && ch <= 0xef ? 3 :
+                            ch >= 0xf0 && ch <= 0xf7 ? 4 : 1;
+            return i - 1 + length > size ? i - 1 : size;
+        }
+        return size;
+    }
+
+    const BPE&  m_bpe;
+    std::string  m_buffer;
+    size_t  m_numComplete{0};
 };
@@ -0,0 +1,404 @@
+//
+//  Copyright © 2024-Present, Arkin Terli. All rights reserved.
+//
+//  NOTICE:  All information contained herein is, and remains the property of Arkin Terli.
+//  The intellectual and technical concepts contained herein are proprietary to Arkin Terli
+//  and may be covered by U.S. and Foreign Patents, patents in process, and are protected by
+//  trade secret or copyright law. Dissemination of this information or reproduction of this
+//  material is strictly forbidden unless prior written permission is obtained from Arkin Terli.
+
+#pragma once
+
+// Project includes
+#include "Kernels.hpp"
+#include "MappedFile.hpp"
+#include "ThreadPool.hpp"
+// External includes
+#include <aix.hpp>
+// System includes
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <future>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+
+// Data types of the tensors in an indexed checkpoint.
+enum class CheckpointDataType : uint32_t
+{
+    kFloat32 = 0,
+    kInt8    = 1,       // Signed bytes.
+    kInt4    = 2,       // Signed 4-bit values, packed two per byte, the low nibble first.
+};
+
+// IndexedCheckpoint reads the self-describing checkpoint format. All integers are little-endian.
+//
+//  Header:  magic "LLMCKPT\0" (8 bytes), u32 version, u32 alignment, u64 number of tensors
+//  Index:   for each tensor: u32 name length, name (UTF-8), u32 data type, u32 number of dimensions,
+//           u64 dimensions[], u64 payload offset from the beginning of the file, u64 payload size in bytes
+//  Payload: tensor data, each starting at an offset aligned to the alignment (page size)
+//
+// The tensors are found by their names, so the payloads can be loaded in any order, in parallel, or lazily.
+class IndexedCheckpoint
+{
+public:
+    static constexpr char     kMagic[8] = {'L', 'L', 'M', 'C', 'K', 'P', 'T', '\0'};
+    static constexpr uint32_t kVersion  = 1;
+
+    struct Entry
+    {
+        std::string name;
+        CheckpointDataType dataType{CheckpointDataType::kFloat32};
+        std::vector<uint64_t> shape;
+        uint64_t offset{0};
+        uint64_t numBytes{0};
+    };
+
+    // Constructor.
+    explicit IndexedCheckpoint(const std::string& filename) : m_filename{filename}, m_file{filename}
+    {
+        if (!isIndexedCheckpoint(m_file))
+        {
+            throw std::runtime_error("Not an indexed checkpoint file: " + filename);
+        }
+
+        size_t offset = sizeof(kMagic);
+        auto version   = read<uint32_t>(offset);
+        m_alignment    = read<uint32_t>(offset);
+        auto numTensors = read<uint64_t>(offset);
+        if (version != kVersion)
+        {
+            throw std::runtime_error("Unsupported checkpoint version " + std::to_string(version) + ": " + filename);
+        }
+
+        m_entries.reserve(numTensors);
+        for (uint64_t i=0; i<numTensors; ++i)
+        {
+            Entry entry;
+            auto nameLength = read<uint32_t>(offset);
+            checkRange(offset, nameLength);
+            entry.name.assign(reinterpret_cast<const char*>(m_file.data() + offset), nameLength);
+            offset += nameLength;
+            entry.dataType = static_cast<CheckpointDataType>(read<uint32_t>(offset));
+            auto numDims = read<uint32_t>(offset);
+            for (uint32_t d=0; d<numDims; ++d)
+            {
+                entry.shape.emplace_back(read<uint64_t>(offset));
+            }
+            entry.offset   = read<uint64_t>(offset);
+            entry.numBytes = read<uint64_t>(offset);
+            checkRange(entry.offset, entry.numBytes);
+
+            m_nameToEntry[entry.name] = m_entries.size();
+            m_entries.emplace_back(std::move(entry));
+        }
+    }
+
+    static bool isIndexedCheckpoint(const MappedFile& file)
+    {
+        return file.size() >= sizeof(kMagic) && std::memcmp(file.data(), kMagic, sizeof(kMagic)) == 0;
+    }
+
+    static bool isIndexedCheckpoint(const std::string& filename)
+    {
+        return isIndexedCheckpoint(MappedFile(filename));
+    }
+
+    // Returns the entry of a tensor, or nullptr if the checkpoint does not have the tensor.
+    const Entry* find(const std::string& name) const
+    {
+        auto iter = m_nameToEntry.find(name);
+        return iter != m_nameToEntry.end() ? &m_entries[iter->second] : nullptr;
+    }
+
+    const Entry& at(const std::string& name) const
+    {
+        auto entry = find(name);
+        if (!entry)
+        {
+            throw std::runtime_error("Checkpoint does not have the tensor " + name + ": " + m_filename);
+        }
+        return *entry;
+    }
+
+    // Returns the payload of a tensor in the mapped file.
+    const uint8_t* data(const Entry& entry) const   { return m_file.data() + entry.offset; }
+
+    const std::vector<Entry>& entries() const       { return m_entries; }
+    const std::string& filename() const             { return m_filename; }
+    uint32_t alignment() const                      { return m_alignment; }
+
+private:
+    template<typename T>
+    T read(size_t& offset) const
+    {
+        checkRange(offset, sizeof(T));
+        T value;
+        std::memcpy(&value, m_file.data() + offset, sizeof(T));
+        offset += sizeof(T);
+        return value;
+    }
+
+    void checkRange(size_t offset, size_t numBytes) const
+    {
+        if (offset + numBytes > m_file.size())
+        {
+            throw std::runtime_error("Unexpected end of the checkpoint file: " + m_filename);
+        }
+    }
+
+    std::string  m_filename;
+    MappedFile   m_file;
+    uint32_t     m_alignment{0};
+    std::vector<Entry>  m_entries;
+    std::unordered_map<std::string, size_t>  m_nameToEntry;
+};
+
+
+// Phase timings of a parallel weights load.
+struct WeightLoadStats
+{
+    double indexSeconds{0};     // Parsing the checkpoint index, or the record headers of the oaiWeights format.
+    double readSeconds{0};      // Wall time until all payloads are copied from the mapped pages into the parameters.
+    double totalSeconds{0};
+    size_t numBytes{0};         // Total size of the payloads.
+};
+
+namespace detail
+{
+
+// Conversion of a payload while it is copied into the parameter buffer.
+enum class WeightConversion
+{
+    kNone,
+    kFloat32ToFloat16,
+    kFloat32ToBFloat16,
+};
+
+// Location of a parameter payload in the mapped pages of a weights file.
+struct WeightRecord
+{
+    std::string name;
+    uint8_t* dest{nullptr};
+    const uint8_t* payload{nullptr};
+    uint64_t numBytes{0};
+    WeightConversion conversion{WeightConversion::kNone};
+};
+
+inline uint8_t* parameterData(aix::Tensor& param)
+{
+    switch (param.dataType())
+    {
+        case aix::DataType::kFloat32:   return reinterpret_cast<uint8_t*>(param.value().data<float>());
+        case aix::DataType::kFloat16:
+        case aix::DataType::kBFloat16:  return reinterpret_cast<uint8_t*>(param.value().data<uint16_t>());
+        case aix::DataType::kInt8:      return reinterpret_cast<uint8_t*>(param.value().data<int8_t>());
+        case aix::DataType::kUInt8:     return param.value().data<uint8_t>();
+        default:    throw std::runtime_error("Unsupported parameter data type to load weights.");
+    }
+}
+
+// Returns the conversion to load a float32 payload into a parameter, or throws if the parameter type is not supported.
+inline WeightConversion float32Conversion(const std::string& name, const aix::Tensor& param)
+{
+    switch (param.dataType())
+    {
+        case aix::DataType::kFloat32:   return WeightConversion::kNone;
+        case aix::DataType::kFloat16:   return WeightConversion::kFloat32ToFloat16;
+        case aix::DataType::kBFloat16:  return WeightConversion::kFloat32ToBFloat16;
+        default:    throw std::runtime_error("Parameter " + name + " type does not match the float32 weights.");
+    }
+}
+
+// Returns the record of a parameter in an indexed checkpoint after checking that the payload matches the parameter.
+// Float32 payloads can be loaded into half precision parameters.
+inline WeightRecord indexedWeightRecord(const IndexedCheckpoint& checkpoint, const std::string& name,
+                                        aix::Tensor& param)
+{
+    const auto& entry = checkpoint.at(name);
+    auto numElements = param.value().size();
+    auto type = param.dataType();
+
+    auto conversion = WeightConversion::kNone;
+    bool valid = false;
+    switch (entry.dataType)
+    {
+        case CheckpointDataType::kFloat32:
+            conversion = float32Conversion(name, param);
+            valid = entry.numBytes == numElements * sizeof(float);
+            break;
+        case CheckpointDataType::kInt8:
+            valid = type == aix::DataType::kInt8 && entry.numBytes == numElements;
+            break;
+        case CheckpointDataType::kInt4:
+            valid = type == aix::DataType::kUInt8 && entry.numBytes == numElements;
+            break;
+    }
+    if (!valid)
+    {
+        throw std::runtime_error("Parameter " + name + " type or size does not match the checkpoint.");
+    }
+    return {name, parameterData(param), checkpoint.data(entry), entry.numBytes, conversion};
+}
+
+// Copies a payload into a parameter buffer with its conversion.
+inline void convertWeights(const uint8_t* payload, uint64_t numBytes, WeightConversion conversion, uint8_t* dest)
+{
+    auto floats = reinterpret_cast<const float*>(payload);
+    auto halves = reinterpret_cast<uint16_t*>(dest);
+    switch (conversion)
+    {
+        case WeightConversion::kNone:
+            std::memcpy(dest, payload, numBytes);
+            break;
+        case WeightConversion::kFloat32ToFloat16:
+            for (size_t i=0; i<numBytes / sizeof(float); ++i) halves[i] = kernels::floatToHalf(floats[i]);
+            break;
+        case WeightConversion::kFloat32ToBFloat16:
+            for (size_t i=0; i<numBytes / sizeof(float); ++i) halves[i] = kernels::floatToBFloat16(floats[i]);
+            break;
+    }
+}
+
+// Returns the offset of the converted bytes in the parameter buffer for an offset in the payload. The offset must be
+// a multiple of the element size of the payload.
+inline uint64_t convertedOffset(uint64_t offset, WeightConversion conversion)
+{
+    switch (conversion)
+    {
+        case WeightConversion::kFloat32ToFloat16:
+        case WeightConversion::kFloat32ToBFloat16:  return offset / 2;
+        default:                                    return offset;
+    }
+}
+
+// Copies the payloads from the mapped pages directly into the parameter buffers. The payloads are split into chunks
+// that are copied concurrently. The pages of the next chunks are read ahead with madvise while the earlier chunks are
+// copied, so the storage queue stays full and the copies rarely wait for a page fault. The number of chunks in flight
+// is limited to bound the memory of the pages read ahead.
+inline void loadWeightRecords(const std::vector<WeightRecord>& records, size_t numThreads, WeightLoadStats& stats)
+{
+    constexpr uint64_t kChunkBytes = 4 << 20;       // A multiple of the element sizes of all payloads.
+
+    struct Chunk
+    {
+        const WeightRecord* record;
+        uint64_t offset;
+        uint64_t numBytes;
+    };
+
+    std::vector<Chunk> chunks;
+    for (const auto& record : records)
+    {
+        for (uint64_t offset=0; offset<record.numBytes; offset+=kChunkBytes)
+        {
+            chunks.push_back({&record, offset, std::min(kChunkBytes, record.numBytes - offset)});
+        }
+        stats.numBytes += record.numBytes;
+    }
+
+    auto start = std::chrono::steady_clock::now();
+    {
+        // The pool is destroyed first, so the pending copies finish before the futures, even if a copy throws.
+        std::vector<std::future<void>> copies;
+        ThreadPool pool(numThreads);
+        size_t maxChunksInFlight = 2 * pool.size();
+
+        for (size_t c=0; c<chunks.size(); ++c)
+        {
+            if (c >= maxChunksInFlight) copies[c - maxChunksInFlight].get();
+
+            const auto& chunk = chunks[c];
+            MappedFile::willNeed(chunk.record->payload + chunk.offset, chunk.numBytes);
+            copies.emplace_back(pool.submit([&chunk]
+            {
+                const auto& record = *chunk.record;
+                convertWeights(record.payload + chunk.offset, chunk.numBytes, record.conversion,
+                               record.dest + convertedOffset(chunk.offset, record.conversion));
+            }));
+        }
+
+        for (auto& copy : copies)
+        {
+            if (copy.valid()) copy.get();
+        }
+    }
+    stats.readSeconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+}   // namespace detail
+
+
+// Loads the named parameters from an indexed checkpoint or an oaiWeights file using multiple threads. The format is
+// detected from the file header. Each parameter is copied from the mapped pages directly into its buffer, so if the
+// module is already moved to the device, the weights are uploaded straight into the device buffers. The parameters
+// must be in the oaiWeights order to load the oaiWeights format, which is the order of GPT2::namedParameters(). Zero
+// threads uses the number of hardware threads.
+inline WeightLoadStats loadWeightsParallel(std::vector<std::pair<std::string, aix::Tensor>> params,
+                                           const std::string& filename, size_t numThreads = 0)
+{
+    auto start = std::chrono::steady_clock::now();
+    WeightLoadStats stats;
+    std::vector<detail::WeightRecord> records;
+
+    // The mappings are kept until the payloads are copied.
+    std::unique_ptr<IndexedCheckpoint> checkpoint;
+    MappedFile file;
+    if (IndexedCheckpoint::isIndexedCheckpoint(filename))
+    {
+        checkpoint = std::make_unique<IndexedCheckpoint>(filename);
+        for (auto& [name, param] : params)
+        {
+            records.emplace_back(detail::indexedWeightRecord(*checkpoint, name, param));
+        }
+    }
+    else
+    {
+        // Only the record headers are read here. The payloads are copied by the load stage.
+        file = MappedFile(filename);
+        size_t offset = 0;
+        for (auto& [name, param] : params)
+        {
+            uint64_t numElements = 0;
+            if (offset + sizeof(numElements) > file.size())
+            {
+                throw std::runtime_error("Unexpected end of the weights file: " + filename);
+            }
+            std::memcpy(&numElements, file.data() + offset, sizeof(numElements));
+            offset += sizeof(numElements);
+
+            if (numElements != param.value().size())
+            {
+                throw std::runtime_error("Parameter " + name + " size does not match the size in the weights file.");
+            }
+
+            auto numBytes = numElements * sizeof(float);
+            if (offset + numBytes > file.size())
+            {
+                throw std::runtime_error("Unexpected end of the weights file: " + filename);
+            }
+            records.push_back({name, detail::parameterData(param), file.data() + offset, numBytes,
+                               detail::float32Conversion(name, param)});
+            offset += numBytes;
+        }
+
+        if (offset != file.size())
+        {
+            throw std::runtime_error("The weights file has more data than the model parameters: " + filename);
+        }
+    }
+    stats.indexSeconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+    // The parameter buffers must not be in use by the device while they are written on the host.
+    if (!params.empty()) params.front().second.device()->synchronize();
+
+    detail::loadWeightRecords(records, numThreads, stats);
+    stats.totalSeconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    return stats;
+}
@@ -0,0 +1,363 @@
+//
+//  Copyright © 2024-Present, Arkin Terli. All rights reserved.
+//
+//  NOTICE:  All information contained herein is, and remains the property of Arkin Terli.
+//  The intellectual and technical concepts contained herein are proprietary to Arkin Terli
+//  and may be covered by U.S. and Foreign Patents, patents in process, and are protected by
+//  trade secret or copyright law. Dissemination of this information or reproduction of this
+//  material is strictly forbidden unless prior written permission is obtained from Arkin Terli.
+
+#pragma once
+
+// Project includes
+#include "Profiler.hpp"
+// External includes
+#include <aix.hpp>
+// System includes
+#include <cstring>
+#include <stdexcept>
+#include <utility>
+#include <vector>
+
+
+// KVBlockPool is a fixed-size arena of KV cache blocks on the device. Each block stores the keys and values of
+// blockSize tokens for all layers. Sequences allocate blocks on demand and return them to the free list when they
+// finish, so the memory is neither reserved for the full context size nor fragmented by the sequence lengths.
+// The blocks are reference counted, so the full blocks of a common prefix can be shared by many sequences.
+// Each layer has its own key and value arenas. The layers of a sharded model may have their arenas on different
+// devices, and a tensor-parallel layer has an arena for the heads of each device.
+class KVBlockPool
+{
+public:
+    // Width and device of the arenas of a layer.
+    struct Arena
+    {
+        size_t embdDim{0};
+        aix::Device* device{nullptr};
+    };
+
+    // Constructor.
+    KVBlockPool(size_t numLayers, size_t embdDim, size_t blockSize, size_t numBlocks, aix::Device* device)
+        : KVBlockPool(std::vector<Arena>(numLayers, Arena{embdDim, device}), blockSize, numBlocks)
+    {
+    }
+
+    // Constructor. The arenas of the layers are given in the layer order.
+    KVBlockPool(const std::vector<Arena>& arenas, size_t blockSize, size_t numBlocks)
+        : m_arenas{arenas}, m_blockSize{blockSize}, m_numBlocks{numBlocks}
+    {
+        if (blockSize == 0 || numBlocks == 0)
+        {
+            throw std::invalid_argument("KV block pool size and block size must be greater than zero.");
+        }
+        if (arenas.empty())
+        {
+            throw std::invalid_argument("KV block pool must have at least one layer.");
+        }
+
+        for (const auto& arena : arenas)
+        {
+            m_keys.emplace_back(aix::Shape{numBlocks * blockSize, arena.embdDim}, aix::device(arena.device));
+            m_values.emplace_back(aix::Shape{numBlocks * blockSize, arena.embdDim}, aix::device(arena.device));
+        }
+
+        // Lower block indices are allocated first.
+        for (size_t i=numBlocks; i>0; --i)
+        {
+            m_freeBlocks.emplace_back(i - 1);
+        }
+        m_refCounts.resize(numBlocks, 0);
+    }
+
+    // Returns a free block with a single reference.
+    size_t allocate()
+    {
+        if (m_freeBlocks.empty())
+        {
+            throw std::runtime_error("KV block pool is out of blocks.");
+        }
+        auto block = m_freeBlocks.back();
+        m_freeBlocks.pop_back();
+        m_refCounts[block] = 1;
+        return block;
+    }
+
+    // Adds a reference to an allocated block.
+    void retain(size_t block)       { ++m_refCounts[block]; }
+
+    // Removes a reference, and returns the block to the free list when it has no references.
+    void release(size_t block)
+    {
+        if (--m_refCounts[block] == 0) m_freeBlocks.emplace_back(block);
+    }
+
+    size_t refCount(size_t block) const     { return m_refCounts[block]; }
+
+    // Returns the number of blocks to store the given number of tokens.
+    size_t blocksFor(size_t numTokens) const    { return (numTokens + m_blockSize - 1) / m_blockSize; }
+
+    // Key and value arenas of a layer. ( {numBlocks * blockSize, embd} )
+    aix::Tensor& keys(size_t layer)             { return m_keys[layer]; }
+    aix::Tensor& values(size_t layer)           { return m_values[layer]; }
+    const aix::Tensor& keys(size_t layer) const      { return m_keys[layer]; }
+    const aix::Tensor& values(size_t layer) const    { return m_values[layer]; }
+
+    size_t numLayers() const        { return m_keys.size(); }
+    size_t embdDim(size_t layer) const          { return m_arenas[layer].embdDim; }
+    aix::Device* device(size_t layer) const     { return m_arenas[layer].device; }
+    size_t blockSize() const        { return m_blockSize; }
+    size_t numBlocks() const        { return m_numBlocks; }
+    size_t numFreeBlocks() const    { return m_freeBlocks.size(); }
+    // Device of the first layer, which is the device of the model inputs.
+    aix::Device* device() const     { return m_arenas.front().device; }
+
+private:
+    std::vector<Arena>  m_arenas;
+    size_t  m_blockSize{0};
+    size_t  m_numBlocks{0};
+    std::vector<aix::Tensor>  m_keys;
+    std::vector<aix::Tensor>  m_values;
+    std::vector<size_t>  m_freeBlocks;
+    std::vector<size_t>  m_refCounts;
+};
+
+
+// KVCache keeps the attention keys and values of all processed tokens of a sequence for each transformer layer. This
+// allows the incremental decoding to project only the new tokens and attend over the cached keys and values of the
+// past tokens. The tokens are stored in the blocks of a pool, and the block table maps the token t to the row
+// (t % blockSize) of the block blockTable[t / blockSize].
+// The appended rows are kept as device tensors until they are flushed into the blocks on the host, so the appends do
+// not wait for the device. The attention reads the flushed rows from the blocks and the pending rows from the tensors.
+class KVCache
+{
+public:
+    // Constructor.
+    KVCache() = default;
+
+    // Constructor.
+    explicit KVCache(KVBlockPool& pool) : m_pool{&pool}
+    {
+    }
+
+    // Destructor.
+    ~KVCache()
+    {
+        clear();
+    }
+
+    KVCache(const KVCache&) = delete;
+    KVCache& operator=(const KVCache&) = delete;
+
+    KVCache(KVCache&& other) noexcept
+    {
+        *this = std::move(other);
+    }
+
+    KVCache& operator=(KVCache&& other) noexcept
+    {
+        if (this != &other)
+        {
+            clear();
+            m_pool = std::exchange(other.m_pool, nullptr);
+            m_blockTable = std::move(other.m_blockTable);
+            m_size = std::exchange(other.m_size, 0);
+            m_pendingTokens = std::exchange(other.m_pendingTokens, 0);
+            m_rowIndicesSize = std::exchange(other.m_rowIndicesSize, 0);
+            m_rowIndices = std::move(other.m_rowIndices);
+            m_pendingRows = std::move(other.m_pendingRows);
+        }
+        return *this;
+    }
+
+    // Appends the keys and values of the new tokens to the layer cache. ( k{seq, embd}, v{seq, embd} )
+    // The rows are written into the blocks by the next flush. A layer flushes itself after kMaxPendingAppends appends,
+    // so the pending tensors are bounded if the caller never flushes.
+    // NOTE: The number of cached tokens is advanced separately, once all layers processed the new tokens.
+    void append(size_t layer, const aix::Tensor& k, const aix::Tensor& v)
+    {
+        auto numTokens = k.shape()[0];
+        reserve(m_size + numTokens);
+        m_pendingTokens = numTokens;
+        if (m_pool->refCount(m_blockTable[m_size / m_pool->blockSize()]) > 1)
+        {
+            throw std::logic_error("KV cache can not append to a shared block.");
+        }
+
+        if (m_pendingRows.size() < m_pool->numLayers()) m_pendingRows.resize(m_pool->numLayers());
+        m_pendingRows[layer].push_back({m_size, k, v});
+        if (m_pendingRows[layer].size() >= kMaxPendingAppends) flush(layer);
+    }
+
+    // Writes the pending rows of a layer into the blocks on the host. It waits for the device unless it is already
+    // synchronized, i.e. after the tokens are read back.
+    void flush(size_t layer)
+    {
+        if (layer >= m_pendingRows.size() || m_pendingRows[layer].empty()) return;
+        synchronizeDevice(m_pendingRows[layer].front().keys.device());
+
+        auto embdDim   = m_pool->embdDim(layer);
+        auto rowBytes  = embdDim * sizeof(float);
+        auto kArena    = m_pool->keys(layer).value().data<float>();
+        auto vArena    = m_pool->values(layer).value().data<float>();
+        for (const auto& rows : m_pendingRows[layer])
+        {
+            auto kData = rows.keys.value().data<float>();
+            auto vData = rows.values.value().data<float>();
+            for (size_t i=0; i<rows.keys.shape()[0]; ++i)
+            {
+                auto row = rowIndex(rows.startToken + i);
+                std::memcpy(kArena + row * embdDim, kData + i * embdDim, rowBytes);
+                std::memcpy(vArena + row * embdDim, vData + i * embdDim, rowBytes);
+            }
+        }
+        m_pendingRows[layer].clear();
+    }
+
+    // Writes the pending rows of all layers into the blocks.
+    void flush()
+    {
+        for (size_t i=0; i<m_pendingRows.size(); ++i) flush(i);
+    }
+
+    // Returns all cached keys of a layer. The flushed rows are gathered from the blocks. ( {ctx, embd} )
+    aix::Tensor keys(size_t layer) const
+    {
+        return cachedRows(layer, m_pool->keys(layer), &PendingRows::keys);
+    }
+
+    // Returns all cached values of a layer. The flushed rows are gathered from the blocks. ( {ctx, embd} )
+    aix::Tensor values(size_t layer) const
+    {
+        return cachedRows(layer, m_pool->values(layer), &PendingRows::values);
+    }
+
+    // Advances the number of cached tokens after the new tokens are appended to all layers.
+    void advance(size_t numTokens)
+    {
+        m_size += numTokens;
+        m_pendingTokens = 0;
+    }
+
+    // Allocates the blocks to store the given number of tokens.
+    void reserve(size_t numTokens)
+    {
+        while (m_blockTable.size() < m_pool->blocksFor(numTokens))
+        {
+            m_blockTable.emplace_back(m_pool->allocate());
+        }
+    }
+
+    // Starts an empty cache with the shared blocks of a prefix. The prefix has blocks.size() * blockSize tokens, so
+    // the new tokens are appended to the new blocks.
+    void attachPrefix(const std::vector<size_t>& blocks)
+    {
+        if (m_size != 0 || !m_blockTable.empty())
+        {
+            throw std::logic_error("KV cache prefix can only be attached to an empty cache.");
+        }
+        for (auto block : blocks) m_pool->retain(block);
+        m_blockTable = blocks;
+        m_size = blocks.size() * m_pool->blockSize();
+        m_rowIndicesSize = 0;
+        m_rowIndices.clear();
+    }
+
+    // Removes the cached tokens after the first numTokens tokens, and returns the unused blocks to the pool.
+    void truncate(size_t numTokens)
+    {
+        if (numTokens >= m_size) return;
+        flush();        // The pending rows are written before their blocks are released.
+        while (m_blockTable.size() > m_pool->blocksFor(numTokens))
+        {
+            m_pool->release(m_blockTable.back());
+            m_blockTable.pop_back();
+        }
+        m_size = numTokens;
+        m_rowIndicesSize = 0;       // The released blocks may be replaced by the other blocks.
+        m_rowIndices.clear();
+    }
+
+    // Removes all cached tokens and returns the blocks to the pool.
+    void clear()
+    {
+        if (m_pool)
+        {
+            for (auto block : m_blockTable) m_pool->release(block);
+        }
+        m_blockTable.clear();
+        m_size = 0;
+        m_pendingTokens = 0;
+        m_rowIndicesSize = 0;
+        m_rowIndices.clear();
+        m_pendingRows.clear();
+    }
+
+    // Returns the row of a token in the arena of the pool.
+    size_t rowIndex(size_t token) const
+    {
+        return m_blockTable[token / m_pool->blockSize()] * m_pool->blockSize() + token % m_pool->blockSize();
+    }
+
+    const std::vector<size_t>& blockTable() const   { return m_blockTable; }
+    const KVBlockPool& pool() const     { return *m_pool; }
+    size_t numLayers() const            { return m_pool ? m_pool->numLayers() : 0; }
+
+    // Returns the number of cached tokens. It is also the position of the next token in the sequence.
+    size_t size() const     { return m_size; }
+
+private:
+    static constexpr size_t kMaxPendingAppends = 16;
+
+    // Keys and values of the tokens [startToken, startToken + seq) that are not written into the blocks yet.
+    struct PendingRows
+    {
+        size_t startToken{0};
+        aix::Tensor keys;
+        aix::Tensor values;
+    };
+
+    // Returns the flushed rows of a layer gathered from the arena, followed by the pending rows.
+    aix::Tensor cachedRows(size_t layer, const aix::Tensor& arena, aix::Tensor PendingRows::* rows) const
+    {
+        // The tokens of the current step are appended but not advanced yet.
+        auto numTokens = m_size + m_pendingTokens;
+        const std::vector<PendingRows>* pending = layer < m_pendingRows.size() ? &m_pendingRows[layer] : nullptr;
+        auto numFlushed = pending && !pending->empty() ? pending->front().startToken : numTokens;
+        if (numFlushed == numTokens) return arena.indexSelect(0, rowIndices(numTokens, m_pool->device(layer)));
+
+        std::vector<aix::Tensor> parts;
+        if (numFlushed > 0) parts.emplace_back(arena.indexSelect(0, rowIndices(numFlushed, m_pool->device(layer))));
+        for (const auto& entry : *pending) parts.emplace_back(entry.*rows);
+        return parts.size() == 1 ? parts.front() : aix::vstack(parts);      // {ctx, embd}
+    }
+
+    // Returns the arena rows of the first numTokens tokens on the device. All layers on a device share the same rows
+    // in a step, so they are created once per step and device.
+    const aix::Tensor& rowIndices(size_t numTokens, aix::Device* device) const
+    {
+        if (m_rowIndicesSize != numTokens)
+        {
+            m_rowIndices.clear();
+            m_rowIndicesSize = numTokens;
+        }
+
+        for (const auto& [indicesDevice, indices] : m_rowIndices)
+        {
+            if (indicesDevice == device) return indices;
+        }
+        std::vector<int32_t> rows(numTokens);
+        for (size_t i=0; i<numTokens; ++i) rows[i] = static_cast<int32_t>(rowIndex(i));
+        m_rowIndices.emplace_back(device, aix::Tensor(rows.data(), rows.size(), aix::DataType::kInt32,
+                                                      aix::Shape{rows.size()},
+                                                      aix::dtype(aix::DataType::kInt32).device(device)));
+        return m_rowIndices.back().second;
+    }
+
+    KVBlockPool*  m_pool{nullptr};
+    std::vector<size_t>  m_blockTable;
+    size_t  m_size{0};
+    size_t  m_pendingTokens{0};         // Number of tokens appended in the current step.
+    mutable size_t  m_rowIndicesSize{0};
+    mutable std::vector<std::pair<aix::Device*, aix::Tensor>>  m_rowIndices;      // Row indices of each device.
+    std::vector<std::vector<PendingRows>>  m_pendingRows;      // Rows of each layer to flush into the blocks.
+};
@@ -0,0 +1,769 @@
+//
+//  Copyright © 2024-Present, Arkin Terli. All rights reserved.
+//
+//  NOTICE:  All information contained herein is, and remains the property of Arkin Terli.
+//  The intellectual and technical concepts contained herein are proprietary to Arkin Terli
+//  and may be covered by U.S. and Foreign Patents, patents in process, and are protected by
+//  trade secret or copyright law. Dissemination of this information or reproduction of this
+//  material is strictly forbidden unless prior written permission is obtained from Arkin Terli.
+
+#pragma once
+
+// Project includes
+#include "ThreadPool.hpp"
+#include "Workspace.hpp"
+// External includes
+#include <aix.hpp>
+// System includes
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <future>
+#include <limits>
+#include <memory>
+#include <thread>
+#include <vector>
+#if defined(__AVX512F__) || (defined(__AVX2__) && defined(__FMA__))
+#include <immintrin.h>
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+
+
+// Fused CPU kernels for the operations that are too fine-grained when they are composed of AIX operations.
+// All kernels expect contiguous float32 tensors with data accessible by the host. The outputs are written directly into
+// the tensors taken from the current workspace frame, and the scratch buffers are reused by the thread.
+// The matmul and attention kernels split their outputs across the kernel threads.
+namespace kernels
+{
+
+// Vector of floats of the widest SIMD instruction set the kernels are compiled for: AVX-512, AVX2 with FMA, or NEON.
+// The portable fallback is a GCC/Clang vector of the baseline instruction set, i.e. SSE2. fma(a, b, c) returns a·b + c.
+struct FloatVec
+{
+#if defined(__AVX512F__)
+    static constexpr size_t kWidth = 16;
+    __m512 v;
+    static FloatVec zero()                              { return {_mm512_setzero_ps()}; }
+    static FloatVec broadcast(float x)                  { return {_mm512_set1_ps(x)}; }
+    static FloatVec load(const float* p)                { return {_mm512_loadu_ps(p)}; }
+    void store(float* p) const                          { _mm512_storeu_ps(p, v); }
+    static FloatVec fma(FloatVec a, FloatVec b, FloatVec c)     { return {_mm512_fmadd_ps(a.v, b.v, c.v)}; }
+    static FloatVec add(FloatVec a, FloatVec b)         { return {_mm512_add_ps(a.v, b.v)}; }
+    float sum() const                                   { return _mm512_reduce_add_ps(v); }
+#elif defined(__AVX2__) && defined(__FMA__)
+    static constexpr size_t kWidth = 8;
+    __m256 v;
+    static FloatVec zero()                              { return {_mm256_setzero_ps()}; }
+    static FloatVec broadcast(float x)                  { return {_mm256_set1_ps(x)}; }
+    static FloatVec load(const float* p)                { return {_mm256_loadu_ps(p)}; }
+    void store(float* p) const                          { _mm256_storeu_ps(p, v); }
+    static FloatVec fma(FloatVec a, FloatVec b, FloatVec c)     { return {_mm256_fmadd_ps(a.v, b.v, c.v)}; }
+    static FloatVec add(FloatVec a, FloatVec b)         { return {_mm256_add_ps(a.v, b.v)}; }
+    float sum() const
+    {
+        __m128 x = _mm_add_ps(_mm256_castps256_ps128(v), _mm256_extractf128_ps(v, 1));
+        x = _mm_add_ps(x, _mm_movehl_ps(x, x));
+        return _mm_cvtss_f32(_mm_add_ss(x, _mm_movehdup_ps(x)));
+    }
+#elif defined(__ARM_NEON)
+    static constexpr size_t kWidth = 4;
+    float32x4_t v;
+    static FloatVec zero()                              { return {vdupq_n_f32(0)}; }
+    static FloatVec broadcast(float x)                  { return {vdupq_n_f32(x)}; }
+    static FloatVec load(const float* p)                { return {vld1q_f32(p)}; }
+    void store(float* p) const                          { vst1q_f32(p, v); }
+    static FloatVec fma(FloatVec a, FloatVec b, FloatVec c)     { return {vfmaq_f32(c.v, a.v, b.v)}; }
+    static FloatVec add(FloatVec a, FloatVec b)         { return {vaddq_f32(a.v, b.v)}; }
+    float sum() const                                   { return vaddvq_f32(v); }
+#else
+    static constexpr size_t kWidth = 4;
+    typedef float Type __attribute__((vector_size(16)));
+    Type v;
+    static FloatVec zero()                              { return {Type{}}; }
+    static FloatVec broadcast(float x)                  { return {Type{x, x, x, x}}; }
+    static FloatVec load(const float* p)                { FloatVec r; std::memcpy(&r.v, p, sizeof(r.v)); return r; }
+    void store(float* p) const                          { std::memcpy(p, &v, sizeof(v)); }
+    static FloatVec fma(FloatVec a, FloatVec b, FloatVec c)     { return {a.v * b.v + c.v}; }
+    static FloatVec add(FloatVec a, FloatVec b)         { return {a.v + b.v}; }
+    float sum() const                                   { return (v[0] + v[1]) + (v[2] + v[3]); }
+#endif
+};
+
+// Returns the dot product of a[n] and b[n]. Four vector accumulators hide the latency of the FMA instructions.
+inline float dot(const float* a, const float* b, size_t n)
+{
+    constexpr size_t W = FloatVec::kWidth;
+    FloatVec acc[4] = {FloatVec::zero(), FloatVec::zero(), FloatVec::zero(), FloatVec::zero()};
+    size_t i = 0;
+    for (; i + 4 * W <= n; i += 4 * W)
+    {
+        for (size_t l=0; l<4; ++l)
+        {
+            acc[l] = FloatVec::fma(FloatVec::load(a + i + l * W), FloatVec::load(b + i + l * W), acc[l]);
+        }
+    }
+    for (; i + W <= n; i += W) acc[0] = FloatVec::fma(FloatVec::load(a + i), FloatVec::load(b + i), acc[0]);
+
+    float result = FloatVec::add(FloatVec::add(acc[0], acc[1]), FloatVec::add(acc[2], acc[3])).sum();
+    for (; i<n; ++i) result += a[i] * b[i];
+    return result;
+}
+
+// Adds p·x[n] to acc[n].
+inline void axpy(float p, const float* x, float* acc, size_t n)
+{
+    constexpr size_t W = FloatVec::kWidth;
+    const auto pv = FloatVec::broadcast(p);
+    size_t i = 0;
+    for (; i + W <= n; i += W) FloatVec::fma(pv, FloatVec::load(x + i), FloatVec::load(acc + i)).store(acc + i);
+    for (; i<n; ++i) acc[i] += p * x[i];
+}
+
+// Pool of the kernel threads. The thread that calls a kernel runs a part of it, so the pool has one thread less.
+inline std::unique_ptr<ThreadPool>& threadPool()
+{
+    static std::unique_ptr<ThreadPool> pool;
+    return pool;
+}
+
+// Sets the number of threads of the kernels. Zero uses the number of hardware threads. It must not be called while
+// a kernel is running. The kernels are single-threaded until it is called.
+inline void setNumThreads(size_t numThreads)
+{
+    if (numThreads == 0) numThreads = std::max(1u, std::thread::hardware_concurrency());
+    threadPool() = numThreads > 1 ? std::make_unique<ThreadPool>(numThreads - 1) : nullptr;
+}
+
+inline size_t numThreads()
+{
+    return threadPool() ? threadPool()->size() + 1 : 1;
+}
+
+// Calls fn(begin, end) on the disjoint ranges of [0, count) in parallel. The ranges are multiples of the grain, except
+// the last one, so a range is never smaller than the grain.
+template<typename F>
+inline void parallelFor(size_t count, size_t grain, const F& fn)
+{
+    const size_t numGrains = (count + grain - 1) / grain;
+    const size_t numRanges = std::min(numGrains, numThreads());
+    if (numRanges <= 1)
+    {
+        if (count > 0) fn(size_t{0}, count);
+        return;
+    }
+
+    const size_t rangeSize = (numGrains + numRanges - 1) / numRanges * grain;
+    std::vector<std::future<void>> futures;
+    futures.reserve(numRanges - 1);
+    for (size_t begin=rangeSize; begin<count; begin+=rangeSize)
+    {
+        futures.emplace_back(threadPool()->submit([&fn, begin, end=std::min(begin + rangeSize, count)]
+        {
+            fn(begin, end);
+        }));
+    }
+    fn(size_t{0}, std::min(rangeSize, count));
+    for (auto& future : futures) future.wait();
+}
+
+// Conversions between float32 and the 16-bit float formats. The values are rounded to the nearest even.
+inline float halfToFloat(uint16_t value)
+{
+    uint32_t sign = static_cast<uint32_t>(value & 0x8000u) << 16;
+    uint32_t exp  = (value >> 10) & 0x1Fu;
+    uint32_t mant = value & 0x3FFu;
+    uint32_t bits = sign;
+    if (exp == 0x1F)
+    {
+        bits |= 0x7F800000u | (mant << 13);             // Inf or NaN.
+    }
+    else if (exp != 0)
+    {
+        bits |= ((exp + 112) << 23) | (mant << 13);
+    }
+    else if (mant != 0)
+    {
+        // Subnormal half values are normal in float32.
+        exp = 113;
+        while ((mant & 0x400u) == 0)
+        {
+            mant <<= 1;
+            --exp;
+        }
+        bits |= (exp << 23) | ((mant & 0x3FFu) << 13);
+    }
+
+    float result;
+    std::memcpy(&result, &bits, sizeof(result));
+    return result;
+}
+
+inline uint16_t floatToHalf(float value)
+{
+    uint32_t bits;
+    std::memcpy(&bits, &value, sizeof(bits));
+    auto sign    = static_cast<uint16_t>((bits >> 16) & 0x8000u);
+    auto absBits = bits & 0x7FFFFFFFu;
+
+    if (absBits >= 0x7F800000u) return sign | 0x7C00u | (absBits > 0x7F800000u ? 0x200u : 0u);    // Inf or NaN.
+    if (absBits >= 0x477FF000u) return sign | 0x7C00u;       // Values from 65520 are rounded to Inf.
+    if (absBits <  0x38800000u)
+    {
+        // Subnormal half values are multiples of 2^-24.
+        float absValue;
+        std::memcpy(&absValue, &absBits, sizeof(absValue));
+        return sign | static_cast<uint16_t>(std::nearbyint(absValue * 16777216.0f));
+    }
+
+    auto half = static_cast<uint16_t>((((absBits >> 23) - 112) << 10) | ((absBits >> 13) & 0x3FFu));
+    auto rest = absBits & 0x1FFFu;
+    if (rest > 0x1000u || (rest == 0x1000u && (half & 1u))) ++half;     // The carry may increment the exponent.
+    return sign | half;
+}
+
+inline float bfloat16ToFloat(uint16_t value)
+{
+    uint32_t bits = static_cast<uint32_t>(value) << 16;
+    float result;
+    std::memcpy(&result, &bits, sizeof(result));
+    return result;
+}
+
+inline uint16_t floatToBFloat16(float value)
+{
+    uint32_t bits;
+    std::memcpy(&bits, &value, sizeof(bits));
+    if ((bits & 0x7FFFFFFFu) > 0x7F800000u) return static_cast<uint16_t>((bits >> 16) | 0x40u);     // Quiet NaN.
+    bits += 0x7FFFu + ((bits >> 16) & 1u);
+    return static_cast<uint16_t>(bits >> 16);
+}
+
+// Number of independent accumulators of the row statistics. They let the compiler vectorize the statistics loop.
+constexpr size_t kStatLanes = 8;
+
+// Normalizes a row with its mean and variance, then scales and shifts it: (x - mean) / sqrt(var + eps) * g + b.
+// The statistics are computed in a single pass with Welford's algorithm on kStatLanes interleaved partitions of the
+// row, and the partitions are merged with Chan's formula. The variance is unbiased if requested.
+inline void layerNormRow(const float* x, const float* g, const float* b, size_t n, float eps, bool unbiased,
+                         float* out)
+{
+    float count[kStatLanes] = {};
+    float mean[kStatLanes] = {};
+    float m2[kStatLanes] = {};
+
+    size_t i = 0;
+    for (; i + kStatLanes <= n; i += kStatLanes)
+    {
+        for (size_t l=0; l<kStatLanes; ++l)
+        {
+            count[l] += 1;
+            float delta = x[i + l] - mean[l];
+            mean[l] += delta / count[l];
+            m2[l]   += delta * (x[i + l] - mean[l]);
+        }
+    }
+    for (size_t l=0; i<n; ++i, ++l)
+    {
+        count[l] += 1;
+        float delta = x[i] - mean[l];
+        mean[l] += delta / count[l];
+        m2[l]   += delta * (x[i] - mean[l]);
+    }
+
+    float totalCount = count[0];
+    float totalMean  = mean[0];
+    float totalM2    = m2[0];
+    for (size_t l=1; l<kStatLanes; ++l)
+    {
+        if (count[l] == 0) continue;
+        float merged = totalCount + count[l];
+        float delta  = mean[l] - totalMean;
+        totalMean += delta * count[l] / merged;
+        totalM2   += m2[l] + delta * delta * totalCount * count[l] / merged;
+        totalCount = merged;
+    }
+
+    const float variance = totalM2 / (unbiased && n > 1 ? static_cast<float>(n - 1) : static_cast<float>(n));
+    const float invStd   = 1.0f / std::sqrt(variance + eps);
+    for (size_t j=0; j<n; ++j)
+    {
+        out[j] = (x[j] - totalMean) * invStd * g[j] + b[j];
+    }
+}
+
+// Computes the layer normalization over the last dimension with the scale g{n} and the shift b{n} in a single kernel
+// without any temporary tensor. ( x{rows, n} --> {rows, n} )
+inline aix::Tensor layerNorm(const aix::Tensor& x, const aix::Tensor& g, const aix::Tensor& b, float eps,
+                             bool unbiased)
+{
+    const size_t n = x.shape().back();
+    const size_t rows = x.value().size() / n;
+    const float* xData = x.value().data<float>();
+    const float* gData = g.value().data<float>();
+    const float* bData = b.value().data<float>();
+
+    auto result = Workspace::allocate(x.shape(), x.device());
+    float* out = result.value().data<float>();
+    for (size_t r=0; r<rows; ++r)
+    {
+        layerNormRow(xData + r * n, gData, bData, n, eps, unbiased, out + r * n);
+    }
+
+    return result;
+}
+
+// Number of keys processed at once by the attention kernel.
+constexpr size_t kAttentionTileSize = 64;
+
+// Computes causal multi-head self-attention for all heads in a single pass. The heads are read in place from the
+// {seq, embd} layout, and the outputs are written merged, so no split or stack operation is needed.
+// The softmax is computed online over key tiles (flash-attention style), so the {seq, ctx} score matrix is never
+// materialized. The causal mask is implicit, the keys after the query position are skipped instead of masked.
+// q{seq, embd} is the queries of the new tokens at positions [startPos, startPos + seq).
+// The keys and values of all tokens are read through the block table from the k and v arenas of a KV block pool.
+// The token t is stored at the row (t % blockSize) of the block blockTable[t / blockSize].
+// The heads are split across the kernel threads.
+inline aix::Tensor causalAttention(const aix::Tensor& q, const aix::Tensor& k, const aix::Tensor& v,
+                                   const std::vector<size_t>& blockTable, size_t blockSize,
+                                   size_t numHeads, size_t startPos)
+{
+    const size_t seqLen  = q.shape()[0];
+    const size_t embdDim = q.shape()[1];
+    const size_t headDim = embdDim / numHeads;
+    const float  scale   = 1.0f / std::sqrt(static_cast<float>(headDim));
+
+    const float* qData = q.value().data<float>();
+    const float* kData = k.value().data<float>();
+    const float* vData = v.value().data<float>();
+
+    auto result = Workspace::allocate({seqLen, embdDim}, q.device());
+    float* out = result.value().data<float>();
+    std::fill(out, out + seqLen * embdDim, 0.0f);
+    auto row = [&](size_t t) { return (blockTable[t / blockSize] * blockSize + t % blockSize) * embdDim; };
+
+    parallelFor(numHeads, 1, [&](size_t h0, size_t h1)
+    {
+        float scores[kAttentionTileSize];
+        for (size_t h=h0; h<h1; ++h)
+        {
+            for (size_t i=0; i<seqLen; ++i)
+            {
+                const float* qi = qData + i * embdDim + h * headDim;
+                float* acc = out + i * embdDim + h * headDim;
+
+                float runningMax = -std::numeric_limits<float>::infinity();
+                float runningSum = 0;
+                const size_t numKeys = startPos + i + 1;       // A query attends to itself and all past tokens.
+
+                for (size_t t0=0; t0<numKeys; t0+=kAttentionTileSize)
+                {
+                    const size_t t1 = std::min(t0 + kAttentionTileSize, numKeys);
+
+                    // Scores of the tile.
+                    float tileMax = -std::numeric_limits<float>::infinity();
+                    for (size_t j=t0; j<t1; ++j)
+                    {
+                        scores[j - t0] = dot(qi, kData + row(j) + h * headDim, headDim) * scale;
+                        tileMax = std::max(tileMax, scores[j - t0]);
+                    }
+
+                    // Rescale the accumulated results to the new maximum.
+                    const float newMax = std::max(runningMax, tileMax);
+                    const float correction = std::exp(runningMax - newMax);
+                    runningSum *= correction;
+                    for (size_t d=0; d<headDim; ++d) acc[d] *= correction;
+
+                    // Accumulate the weighted values of the tile.
+                    for (size_t j=t0; j<t1; ++j)
+                    {
+                        const float p = std::exp(scores[j - t0] - newMax);
+                        runningSum += p;
+                        axpy(p, vData + row(j) + h * headDim, acc, headDim);
+                    }
+                    runningMax = newMax;
+                }
+
+                for (size_t d=0; d<headDim; ++d) acc[d] /= runningSum;
+            }
+        }
+    });
+
+    return result;
+}
+
+// Epilogue of the matmul kernels. It is applied to each output while it is still in the cache, so the bias, the
+// activation and the residual connection need no extra pass over the outputs. The steps are applied in the order
+// bias, GeLU, residual.
+struct Epilogue
+{
+    const float* bias{nullptr};         // {n}
+    bool gelu{false};
+    const float* residual{nullptr};     // {m, n}
+};
+
+// GeLU activation with the tanh approximation that is used by GPT2. The other devices compute the same formula with
+// the AIX operations, so all devices produce the same activations.
+constexpr float kGeLUSqrt2OverPi = 0.7978845608f;
+constexpr float kGeLUCubicCoeff  = 0.044715f;
+
+inline float gelu(float x)
+{
+    return 0.5f * x * (1.0f + std::tanh(kGeLUSqrt2OverPi * (x + kGeLUCubicCoeff * x * x * x)));
+}
+
+inline float applyEpilogue(const Epilogue& epilogue, float value, size_t i, size_t j, size_t n)
+{
+    if (epilogue.bias) value += epilogue.bias[j];
+    if (epilogue.gelu) value = gelu(value);
+    if (epilogue.residual) value += epilogue.residual[i * n + j];
+    return value;
+}
+
+// Tiles of the matmul kernels. A tile of kMatmulRowTile rows and kMatmulColTile columns of the outputs is accumulated
+// in the SIMD registers over kMatmulDepthTile rows of the weights at a time. The weight panel of a column tile stays in
+// the L1 cache while it is multiplied by all rows of x.
+constexpr size_t kMatmulRowTile   = 6;
+constexpr size_t kMatmulColVecs   = 2;
+constexpr size_t kMatmulColTile   = kMatmulColVecs * FloatVec::kWidth;
+constexpr size_t kMatmulDepthTile = 256;
+
+// The matmuls of fewer rows, i.e. the decode steps, are bound by the memory bandwidth of the weights. They stream the
+// rows of the weights instead, and accumulate up to kMatmulStreamCols outputs of each row in the L1 cache.
+constexpr size_t kMatmulStreamRows = 2;
+constexpr size_t kMatmulStreamCols = 4096;
+
+// Computes c{R, kMatmulColTile} (+)= x{R, depth}·W{depth, kMatmulColTile} where w[d] points to the row d of the weight
+// panel. The rows of x are ldx apart, and the rows of c are ldc apart. c is overwritten unless accumulate is set.
+template<size_t R>
+inline void matmulMicroKernel(const float* x, size_t ldx, const float* const* w, size_t depth, float* c, size_t ldc,
+                              bool accumulate)
+{
+    constexpr size_t W = FloatVec::kWidth;
+    FloatVec acc[R][kMatmulColVecs];
+    for (size_t r=0; r<R; ++r)
+    {
+        for (size_t v=0; v<kMatmulColVecs; ++v)
+        {
+            acc[r][v] = accumulate ? FloatVec::load(c + r * ldc + v * W) : FloatVec::zero();
+        }
+    }
+
+    for (size_t d=0; d<depth; ++d)
+    {
+        FloatVec b[kMatmulColVecs];
+        for (size_t v=0; v<kMatmulColVecs; ++v) b[v] = FloatVec::load(w[d] + v * W);
+        for (size_t r=0; r<R; ++r)
+        {
+            const auto a = FloatVec::broadcast(x[r * ldx + d]);
+            for (size_t v=0; v<kMatmulColVecs; ++v) acc[r][v] = FloatVec::fma(a, b[v], acc[r][v]);
+        }
+    }
+
+    for (size_t r=0; r<R; ++r)
+    {
+        for (size_t v=0; v<kMatmulColVecs; ++v) acc[r][v].store(c + r * ldc + v * W);
+    }
+}
+
+inline void matmulMicroKernel(size_t rows, const float* x, size_t ldx, const float* const* w, size_t depth, float* c,
+                              size_t ldc, bool accumulate)
+{
+    static_assert(kMatmulRowTile == 6);
+    switch (rows)
+    {
+        case 1:  matmulMicroKernel<1>(x, ldx, w, depth, c, ldc, accumulate);   break;
+        case 2:  matmulMicroKernel<2>(x, ldx, w, depth, c, ldc, accumulate);   break;
+        case 3:  matmulMicroKernel<3>(x, ldx, w, depth, c, ldc, accumulate);   break;
+        case 4:  matmulMicroKernel<4>(x, ldx, w, depth, c, ldc, accumulate);   break;
+        case 5:  matmulMicroKernel<5>(x, ldx, w, depth, c, ldc, accumulate);   break;
+        default: matmulMicroKernel<6>(x, ldx, w, depth, c, ldc, accumulate);   break;
+    }
+}
+
+// Computes x{m, k}·W{k, n} into out{m, n} for m up to kMatmulStreamRows by streaming the rows of W. It takes the
+// weights like tiledMatmul.
+template<typename LoadTile>
+inline void streamedMatmul(const float* x, size_t m, size_t k, size_t n, const LoadTile& loadTile,
+                           const Epilogue& epilogue, float* out)
+{
+    parallelFor(n, kMatmulColTile, [&](size_t c0, size_t c1)
+    {
+        thread_local std::vector<float> buffer;
+        buffer.resize(kMatmulStreamCols);
+        float acc[kMatmulStreamRows][kMatmulStreamCols];
+
+        for (size_t j0=c0; j0<c1; j0+=kMatmulStreamCols)
+        {
+            const size_t cols = std::min(kMatmulStreamCols, c1 - j0);
+            for (size_t r=0; r<m; ++r) std::fill(acc[r], acc[r] + cols, 0.0f);
+            for (size_t d=0; d<k; ++d)
+            {
+                const float* w = loadTile(d, j0, cols, buffer.data());
+                for (size_t r=0; r<m; ++r) axpy(x[r * k + d], w, acc[r], cols);
+            }
+
+            for (size_t r=0; r<m; ++r)
+            {
+                for (size_t c=0; c<cols; ++c)
+                {
+                    out[r * n + j0 + c] = applyEpilogue(epilogue, acc[r][c], r, j0 + c, n);
+                }
+            }
+        }
+    });
+}
+
+// Computes x{m, k}·W{k, n} into out{m, n} tile by tile. loadTile(d, j0, count, buffer) returns the weights
+// W[d, j0:j0+count] as float32, either in place or converted into the buffer. The column tiles are split across the
+// kernel threads, and the epilogue is applied to a tile after its last depth tile, while it is still in the L1 cache.
+template<typename LoadTile>
+inline void tiledMatmul(const float* x, size_t m, size_t k, size_t n, const LoadTile& loadTile,
+                        const Epilogue& epilogue, float* out)
+{
+    if (m <= kMatmulStreamRows) return streamedMatmul(x, m, k, n, loadTile, epilogue, out);
+
+    parallelFor(n, kMatmulColTile, [&](size_t c0, size_t c1)
+    {
+        thread_local std::vector<float> panel;
+        panel.resize(kMatmulDepthTile * kMatmulColTile);
+        const float* w[kMatmulDepthTile];
+        float edge[kMatmulRowTile * kMatmulColTile];        // Outputs of the last column tile if it is partial.
+
+        for (size_t j0=c0; j0<c1; j0+=kMatmulColTile)
+        {
+            const size_t cols = std::min(kMatmulColTile, c1 - j0);
+            for (size_t d0=0; d0<k; d0+=kMatmulDepthTile)
+            {
+                const size_t depth = std::min(kMatmulDepthTile, k - d0);
+                for (size_t d=0; d<depth; ++d)
+                {
+                    float* buffer = panel.data() + d * kMatmulColTile;
+                    w[d] = loadTile(d0 + d, j0, cols, buffer);
+                    if (cols < kMatmulColTile)
+                    {
+                        // The partial tile is padded with zeros, so the kernel reads only within the buffer.
+                        if (w[d] != buffer) std::copy(w[d], w[d] + cols, buffer);
+                        std::fill(buffer + cols, buffer + kMatmulColTile, 0.0f);
+                        w[d] = buffer;
+                    }
+                }
+
+                const bool lastDepthTile = d0 + depth == k;
+                for (size_t i0=0; i0<m; i0+=kMatmulRowTile)
+                {
+                    const size_t rows = std::min(kMatmulRowTile, m - i0);
+                    float* tile = out + i0 * n + j0;
+                    if (cols == kMatmulColTile)
+                    {
+                        matmulMicroKernel(rows, x + i0 * k + d0, k, w, depth, tile, n, d0 > 0);
+                    }
+                    else
+                    {
+                        for (size_t r=0; r<rows && d0 > 0; ++r)
+                        {
+                            std::copy(tile + r * n, tile + r * n + cols, edge + r * kMatmulColTile);
+                        }
+                        matmulMicroKernel(rows, x + i0 * k + d0, k, w, depth, edge, kMatmulColTile, d0 > 0);
+                        for (size_t r=0; r<rows; ++r)
+                        {
+                            std::copy(edge + r * kMatmulColTile, edge + r * kMatmulColTile + cols, tile + r * n);
+                        }
+                    }
+
+                    if (!lastDepthTile) continue;
+                    for (size_t r=0; r<rows; ++r)
+                    {
+                        for (size_t c=0; c<cols; ++c)
+                        {
+                            tile[r * n + c] = applyEpilogue(epilogue, tile[r * n + c], i0 + r, j0 + c, n);
+                        }
+                    }
+                }
+            }
+        }
+    });
+}
+
+// Computes x{m, k}·Wᵀ into out{m, n} where W is {n, k}. loadRow(j, buffer) returns the row j of W as float32, either
+// in place or converted into the buffer{k}. Each row of W is loaded once and reused for all rows of x, so the weights
+// are read only once. The rows of W are split across the kernel threads.
+template<typename LoadRow>
+inline void transposedMatmul(const float* x, size_t m, size_t k, size_t n, const LoadRow& loadRow,
+                             const Epilogue& epilogue, float* out)
+{
+    parallelFor(n, kMatmulColTile, [&](size_t j0, size_t j1)
+    {
+        thread_local std::vector<float> wRow;
+        wRow.resize(k);
+        for (size_t j=j0; j<j1; ++j)
+        {
+            const float* w = loadRow(j, wRow.data());
+            for (size_t i=0; i<m; ++i)
+            {
+                out[i * n + j] = applyEpilogue(epilogue, dot(x + i * k, w, k), i, j, n);
+            }
+        }
+    });
+}
+
+// Computes x·W with the epilogue where W{k, n} is float32. ( x{m, k} --> {m, n} )
+inline aix::Tensor matmul(const aix::Tensor& x, const aix::Tensor& w, const Epilogue& epilogue = {})
+{
+    const size_t m = x.shape()[0];
+    const size_t k = x.shape()[1];
+    const size_t n = w.shape()[1];
+    const float* wData = w.value().data<float>();
+    auto loadTile = [wData, n](size_t d, size_t j0, size_t, float*) { return wData + d * n + j0; };
+
+    auto result = Workspace::allocate({m, n}, x.device());
+    tiledMatmul(x.value().data<float>(), m, k, n, loadTile, epilogue, result.value().data<float>());
+    return result;
+}
+
+// Computes x·Wᵀ with the epilogue where W{n, k} is float32. ( x{m, k} --> {m, n} )
+inline aix::Tensor matmulTransposed(const aix::Tensor& x, const aix::Tensor& w, const Epilogue& epilogue = {})
+{
+    const size_t m = x.shape()[0];
+    const size_t k = x.shape()[1];
+    const size_t n = w.shape()[0];
+    const float* wData = w.value().data<float>();
+    auto loadRow = [wData, k](size_t j, float*) { return wData + j * k; };
+
+    auto result = Workspace::allocate({m, n}, x.device());
+    transposedMatmul(x.value().data<float>(), m, k, n, loadRow, epilogue, result.value().data<float>());
+    return result;
+}
+
+// Computes x·W for W{k, n}, or x·Wᵀ for W{n, k} if transposed, where W is float16 or bfloat16.
+// ( x{m, k} --> {m, n} ) The weights are converted to float32 as they are loaded, and the products are accumulated in
+// float32.
+inline aix::Tensor halfMatmul(const aix::Tensor& x, const aix::Tensor& w, bool transposed,
+                              const Epilogue& epilogue = {})
+{
+    const size_t m = x.shape()[0];
+    const size_t k = x.shape()[1];
+    const size_t n = transposed ? w.shape()[0] : w.shape()[1];
+    const bool bfloat16 = w.dataType() == aix::DataType::kBFloat16;
+
+    const float*    xData = x.value().data<float>();
+    const uint16_t* wData = w.value().data<uint16_t>();
+    auto convertRow = [bfloat16](const uint16_t* src, size_t count, float* dst)
+    {
+        if (bfloat16)
+        {
+            for (size_t i=0; i<count; ++i) dst[i] = bfloat16ToFloat(src[i]);
+        }
+        else
+        {
+            for (size_t i=0; i<count; ++i) dst[i] = halfToFloat(src[i]);
+        }
+    };
+
+    auto result = Workspace::allocate({m, n}, x.device());
+    float* out = result.value().data<float>();
+    if (transposed)
+    {
+        auto loadRow = [&](size_t j, float* buffer)
+        {
+            convertRow(wData + j * k, k, buffer);
+            return static_cast<const float*>(buffer);
+        };
+        transposedMatmul(xData, m, k, n, loadRow, epilogue, out);
+    }
+    else
+    {
+        auto loadTile = [&](size_t d, size_t j0, size_t count, float* buffer)
+        {
+            convertRow(wData + d * n + j0, count, buffer);
+            return static_cast<const float*>(buffer);
+        };
+        tiledMatmul(xData, m, k, n, loadTile, epilogue, out);
+    }
+
+    return result;
+}
+
+// Number of consecutive weights in a row of a quantized matrix that share a scale.
+constexpr size_t kQuantGroupSize = 64;
+
+// Dequantizes a row of a group-wise quantized matrix into out[cols]. INT8 codes use a byte per weight, and INT4 codes
+// are packed two per byte, the low nibble first. Both are signed, and each group has its own scale.
+inline void dequantizeRow(const uint8_t* codes, const float* scales, size_t cols, size_t numBits, float* out)
+{
+    for (size_t g=0; g<cols / kQuantGroupSize; ++g)
+    {
+        const float scale = scales[g];
+        float* o = out + g * kQuantGroupSize;
+        if (numBits == 8)
+        {
+            const auto c = reinterpret_cast<const int8_t*>(codes) + g * kQuantGroupSize;
+            for (size_t j=0; j<kQuantGroupSize; ++j) o[j] = static_cast<float>(c[j]) * scale;
+        }
+        else
+        {
+            const auto c = codes + g * kQuantGroupSize / 2;
+            for (size_t j=0; j<kQuantGroupSize / 2; ++j)
+            {
+                o[2 * j]     = static_cast<float>(static_cast<int8_t>(c[j] << 4) >> 4) * scale;
+                o[2 * j + 1] = static_cast<float>(static_cast<int8_t>(c[j]) >> 4) * scale;
+            }
+        }
+    }
+}
+
+// Computes x·Wᵀ with the epilogue where W{n, k} is a group-wise quantized matrix. ( x{m, k} --> {m, n} )
+// codes are INT8 {n, k} or packed INT4 {n, k/2} and scales are {n, k/kQuantGroupSize}.
+// Each row of W is dequantized once into a small buffer and reused for all rows of x, so the quantized weights are
+// read only once. It keeps the memory traffic of the decode steps at the size of the quantized weights.
+inline aix::Tensor quantizedMatmul(const aix::Tensor& x, const aix::Tensor& codes, const aix::Tensor& scales,
+                                   size_t numBits, const Epilogue& epilogue = {})
+{
+    const size_t m = x.shape()[0];
+    const size_t k = x.shape()[1];
+    const size_t n = codes.shape()[0];
+    const size_t rowBytes = k * numBits / 8;
+    const size_t numGroups = k / kQuantGroupSize;
+
+    const float* xData = x.value().data<float>();
+    const auto*  cData = codes.value().data<uint8_t>();
+    const float* sData = scales.value().data<float>();
+
+    auto loadRow = [&](size_t j, float* buffer)
+    {
+        dequantizeRow(cData + j * rowBytes, sData + j * numGroups, k, numBits, buffer);
+        return static_cast<const float*>(buffer);
+    };
+
+    auto result = Workspace::allocate({m, n}, x.device());
+    transposedMatmul(xData, m, k, n, loadRow, epilogue, result.value().data<float>());
+    return result;
+}
+
+// Returns the dequantized rows of a group-wise quantized matrix W{n, k} selected by the int32 indices.
+// ( indices{len} --> {len, k} )
+inline aix::Tensor quantizedRows(const aix::Tensor& codes, const aix::Tensor& scales, const aix::Tensor& indices,
+                                 size_t numBits)
+{
+    const size_t len = indices.value().size();
+    const size_t k = codes.shape()[1] * 8 / numBits;
+    const size_t rowBytes = codes.shape()[1];
+    const size_t numGroups = k / kQuantGroupSize;
+
+    const auto*  cData = codes.value().data<uint8_t>();
+    const float* sData = scales.value().data<float>();
+    const auto*  iData = indices.value().data<int32_t>();
+
+    auto result = Workspace::allocate({len, k}, codes.device());
+    float* out = result.value().data<float>();
+    for (size_t i=0; i<len; ++i)
+    {
+        auto row = static_cast<size_t>(iData[i]);
+        dequantizeRow(cData + row * rowBytes, sData + row * numGroups, k, numBits, out + i * k);
+    }
+
+    return result;
+}
+
+}   // namespace kernels
@@ -0,0 +1,137 @@
+//
+//  Copyright © 2024-Present, Arkin Terli. All rights reserved.
+//
+//  NOTICE:  All information contained herein is, and remains the property of Arkin Terli.
+//  The intellectual and technical concepts contained herein are proprietary to Arkin Terli
+//  and may be covered by U.S. and Foreign Patents, patents in process, and are protected by
+//  trade secret or copyright law. Dissemination of this information or reproduction of this
+//  material is strictly forbidden unless prior written permission is obtained from Arkin Terli.
+
+#pragma once
+
+// Project includes
+#include "Checkpoint.hpp"
+#include "Profiler.hpp"
+#include "ThreadPool.hpp"
+// External includes
+#include <aix.hpp>
+// System includes
+#include <algorithm>
+#include <cstdint>
+#include <future>
+#include <limits>
+#include <stdexcept>
+#include <string>
+#include <utility>
+#include <vector>
+
+
+// LayerStreamer streams the weights of the layers that are not resident on the device from the mapped pages of an
+// indexed checkpoint. The streamed layers share a few slot blocks on the device. While a layer runs, the weights of the
+// next streamed layer are copied into another slot on a background thread (double buffering), so the copies overlap
+// the computation. The layers are streamed in a cycle, so the last layer of a step prefetches the first one of the
+// next step.
+// NOTE: The weights are written into the device buffers on the host, so the devices must keep their buffers
+//       accessible by the host, like the KV cache flushes.
+class LayerStreamer
+{
+public:
+    // Constructor. layerParams[i] are the parameters of the slot slots[i] of the i-th streamed layer. They are named
+    // by the layer, i.e. "h3/attn/c_attn/w", to find their payloads in the checkpoint.
+    LayerStreamer(const std::string& filename,
+                  const std::vector<std::vector<std::pair<std::string, aix::Tensor>>>& layerParams,
+                  std::vector<size_t> slots, aix::Device* device)
+        : m_checkpoint{filename}, m_layerSlots{std::move(slots)}, m_device{device}
+    {
+        if (layerParams.empty() || layerParams.size() != m_layerSlots.size())
+        {
+            throw std::invalid_argument("Each streamed layer must have a slot.");
+        }
+
+        for (const auto& params : layerParams)
+        {
+            auto& copies = m_layerCopies.emplace_back();
+            for (auto [name, param] : params)
+            {
+                copies.emplace_back(detail::indexedWeightRecord(m_checkpoint, name, param));
+            }
+        }
+
+        size_t numSlots = 0;
+        for (auto slot : m_layerSlots) numSlots = std::max(numSlots, slot + 1);
+        m_slotLayers.resize(numSlots, kNone);
+
+        // The first streamed layer is copied while the rest of the model is prepared.
+        prefetch(0);
+    }
+
+    // Destructor. Waits for the pending copy, since it writes into the slot buffers.
+    ~LayerStreamer()
+    {
+        if (m_pending.valid()) m_pending.wait();
+    }
+
+    LayerStreamer(const LayerStreamer&) = delete;
+    LayerStreamer& operator=(const LayerStreamer&) = delete;
+
+    // Waits until the weights of the i-th streamed layer are in its slot before the layer runs. The next streamed
+    // layer is prefetched into its slot if the slot is not the slot of this layer.
+    void acquire(size_t i)
+    {
+        if (m_pending.valid())
+        {
+            // The wait is the part of the copy that the computation did not hide.
+            ProfileScope scope("stall", "offload");
+            m_pending.get();
+        }
+        if (m_slotLayers[m_layerSlots[i]] != i)
+        {
+            prefetch(i);
+            m_pending.get();
+        }
+
+        auto next = (i + 1) % m_layerSlots.size();
+        if (m_layerSlots[next] != m_layerSlots[i]) prefetch(next);
+    }
+
+    // Prefetches the next streamed layer after the i-th streamed layer is queued on the device, if both use the same
+    // slot. This happens only if the number of streamed layers is odd, at the end of a step.
+    void release(size_t i)
+    {
+        auto next = (i + 1) % m_layerSlots.size();
+        if (m_layerSlots[next] == m_layerSlots[i]) prefetch(next);
+    }
+
+    size_t numLayers() const        { return m_layerSlots.size(); }
+
+private:
+    static constexpr size_t kNone = std::numeric_limits<size_t>::max();
+
+    // Starts copying the weights of the i-th streamed layer into its slot, unless they are already there.
+    void prefetch(size_t i)
+    {
+        auto slot = m_layerSlots[i];
+        if (m_slotLayers[slot] == i) return;
+        if (m_pending.valid()) m_pending.get();
+
+        // The previous layer of the slot must not be in use by the device while its buffers are overwritten.
+        synchronizeDevice(m_device);
+        m_slotLayers[slot] = i;
+        m_pending = m_thread.submit([this, i]()
+        {
+            ProfileScope scope("prefetch", "offload");
+            for (const auto& record : m_layerCopies[i])
+            {
+                detail::convertWeights(record.payload, record.numBytes, record.conversion, record.dest);
+            }
+        });
+    }
+
+    IndexedCheckpoint  m_checkpoint;
+    std::vector<std::vector<detail::WeightRecord>>  m_layerCopies;
+    std::vector<size_t>  m_layerSlots;          // Slot of each streamed layer.
+    std::vector<size_t>  m_slotLayers;          // Streamed layer in each slot, or kNone.
+    aix::Device*  m_device{nullptr};
+    ThreadPool  m_thread{1};
+    std::future<void>  m_pending;               // Copy in flight.
+};
@@ -0,0 +1,113 @@
+//
+//  Copyright © 2024-Present, Arkin Terli. All rights reserved.
+//
+//  NOTICE:  All information contained herein is, and remains the property of Arkin Terli.
+//  The intellectual and technical concepts contained herein are proprietary to Arkin Terli
+//  and may be covered by U.S. and Foreign Patents, patents in process, and are protected by
+//  trade secret or copyright law. Dissemination of this information or reproduction of this
+//  material is strictly forbidden unless prior written permission is obtained from Arkin Terli.
+
+#pragma once
+
+// Project includes
+// External includes
+// System includes
+#include <cstdint>
+#include <ios>
+#include <string>
+#include <utility>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+
+// MappedFile maps a whole file into memory as read-only. The pages are loaded on demand by the OS.
+class MappedFile
+{
+public:
+    // Constructor.
+    MappedFile() = default;
+
+    // Constructor.
+    explicit MappedFile(const std::string& filename)
+    {
+        m_fd = ::open(filename.c_str(), O_RDONLY);
+        if (m_fd < 0)
+        {
+            throw std::ios_base::failure("Failed to open file: " + filename);
+        }
+
+        struct stat st{};
+        if (::fstat(m_fd, &st) != 0)
+        {
+            close();
+            throw std::ios_base::failure("Failed to get the size of the file: " + filename);
+        }
+        m_size = static_cast<size_t>(st.st_size);
+
+        if (m_size > 0)
+        {
+            auto addr = ::mmap(nullptr, m_size, PROT_READ, MAP_PRIVATE, m_fd, 0);
+            if (addr == MAP_FAILED)
+            {
+                close();
+                throw std::ios_base::failure("Failed to map file: " + filename);
+            }
+            m_data = static_cast<const uint8_t*>(addr);
+            // The file is read once from the beginning to the end.
+            ::madvise(const_cast<uint8_t*>(m_data), m_size, MADV_SEQUENTIAL);
+        }
+    }
+
+    // Destructor.
+    ~MappedFile()
+    {
+        close();
+    }
+
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+
+    MappedFile(MappedFile&& other) noexcept
+    {
+        *this = std::move(other);
+    }
+
+    MappedFile& operator=(MappedFile&& other) noexcept
+    {
+        if (this != &other)
+        {
+            close();
+            m_fd   = std::exchange(other.m_fd, -1);
+            m_data = std::exchange(other.m_data, nullptr);
+            m_size = std::exchange(other.m_size, 0);
+        }
+        return *this;
+    }
+
+    // Starts reading the pages of a range of the mapping in the background, so the later accesses do not fault.
+    static void willNeed(const uint8_t* data, size_t numBytes)
+    {
+        static const auto pageSize = static_cast<uintptr_t>(::sysconf(_SC_PAGESIZE));
+        auto first = reinterpret_cast<uintptr_t>(data) & ~(pageSize - 1);
+        ::madvise(reinterpret_cast<void*>(first), reinterpret_cast<uintptr_t>(data) + numBytes - first, MADV_WILLNEED);
+    }
+
+    const uint8_t* data() const     { return m_data; }
+    size_t size() const             { return m_size; }
+
+private:
+    void close()
+    {
+        if (m_data) ::munmap(const_cast<uint8_t*>(m_data), m_size);
+        if (m_fd >= 0) ::close(m_fd);
+        m_data = nullptr;
+        m_size = 0;
+        m_fd = -1;
+    }
+
+    int  m_fd{-1};
+    const uint8_t*  m_data{nullptr};
+    size_t  m_size{0};
+};
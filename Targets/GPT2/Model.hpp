@@ -10,9 +10,245 @@
 #pragma once
 
 // Project includes
+#include "Kernels.hpp"
+#include "KVCache.hpp"
+#include "LayerStreamer.hpp"
+#include "Profiler.hpp"
+#include "Sampler.hpp"
+#include "ThreadPool.hpp"
+#include "Workspace.hpp"
 // External includes
 #include <aix.hpp>
 // System includes
+#include <algorithm>
+#include <cstring>
+#include <functional>
+#include <future>
+#include <limits>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <utility>
+#include <vector>
+
+
+// Parameter initialization.
+enum class ParamInit
+{
+    kRandom,        // Random trainable parameters.
+    kNone,          // Uninitialized inference parameters that will be loaded from a checkpoint.
+};
+
+// Creates a parameter. The inference parameters do not require gradients, so no operation on them records the
+// autograd graph or keeps its inputs alive for a backward pass. The intermediates of the forward passes are freed as
+// soon as they are no longer used.
+inline aix::Tensor createParameter(const aix::Shape& shape, ParamInit init,
+                                   aix::DataType dataType=aix::DataType::kFloat32)
+{
+    if (init == ParamInit::kNone) return aix::Tensor(shape, aix::dtype(dataType).requireGrad(false));
+    auto param = aix::randn(shape, aix::requireGrad(true));
+    return dataType == aix::DataType::kFloat32 ? param : param.to(dataType);
+}
+
+// Parameters with their hierarchical names, which are the same as the variable names in the OpenAI GPT2 checkpoints.
+// i.e. "h0/attn/c_attn/w". The names do not depend on the module registration order.
+using NamedParameters = std::vector<std::pair<std::string, aix::Tensor>>;
+
+// Storage format of the Linear weights and the tied token embeddings. The activations, the biases and the layer
+// normalization parameters are float32 in all formats.
+enum class WeightFormat
+{
+    kFloat32,
+    kFloat16,
+    kBFloat16,
+    kInt8,      // Group-wise INT8 codes with float32 scales.
+    kInt4,      // Group-wise INT4 codes, packed two per byte, with float32 scales.
+};
+
+inline bool isQuantized(WeightFormat format)
+{
+    return format == WeightFormat::kInt8 || format == WeightFormat::kInt4;
+}
+
+// Returns the data type of the weights in a non-quantized format.
+inline aix::DataType weightDataType(WeightFormat format)
+{
+    if (format == WeightFormat::kFloat16)  return aix::DataType::kFloat16;
+    if (format == WeightFormat::kBFloat16) return aix::DataType::kBFloat16;
+    return aix::DataType::kFloat32;
+}
+
+// Returns x·W for W{k, n}, or x·Wᵀ for W{n, k} if transposed. ( x{m, k} --> {m, n} )
+// The CPU kernels multiply the weights of any precision by the float32 activations with float32 accumulation. The
+// other devices multiply the activations converted to the weight type, and convert the results back to float32.
+inline aix::Tensor weightMatmul(const aix::Tensor& x, const aix::Tensor& w, bool transposed)
+{
+    if (x.device()->type() == aix::DeviceType::kCPU)
+    {
+        if (w.dataType() != aix::DataType::kFloat32) return kernels::halfMatmul(x, w, transposed);
+        return transposed ? kernels::matmulTransposed(x, w) : kernels::matmul(x, w);
+    }
+    if (w.dataType() == aix::DataType::kFloat32) return x.matmul(transposed ? w.transpose(0, 1) : w);
+    return x.to(w.dataType()).matmul(transposed ? w.transpose(0, 1) : w).to(aix::DataType::kFloat32);
+}
+
+// Returns GeLU(x) with the formula of the fused CPU kernels, kernels::gelu(), so all devices produce the same logits.
+inline aix::Tensor geluActivation(const aix::Tensor& x)
+{
+    auto inner = (x + x * x * x * kernels::kGeLUCubicCoeff) * kernels::kGeLUSqrt2OverPi;
+    return x * 0.5f * (inner.tanh() + 1.0f);
+}
+
+// Returns a copy of the float32 tensor on the device. The tensor is copied through the host memory like the KV cache
+// flushes, so the devices must keep their buffers accessible by the host.
+inline aix::Tensor transferTo(const aix::Tensor& x, aix::Device* device)
+{
+    synchronizeDevice(x.device());
+    ProfileScope scope("transfer", "sync");
+    return aix::Tensor(x.value().data<float>(), x.value().size(), aix::DataType::kFloat32, x.shape(),
+                       aix::dtype(aix::DataType::kFloat32).device(device));
+}
+
+// Sums the partial outputs of the tensor-parallel devices on the device of the first one.
+inline aix::Tensor sumPartials(const std::vector<aix::Tensor>& partials)
+{
+    auto sum = partials[0];
+    for (size_t i=1; i<partials.size(); ++i)
+    {
+        sum = sum + (partials[i].device() == sum.device() ? partials[i] : transferTo(partials[i], sum.device()));
+    }
+    return sum;
+}
+
+// Returns a copy of x on the device of each shard. The shards on the device of x use x itself.
+template<typename Shard>
+inline std::vector<aix::Tensor> scatter(const aix::Tensor& x, const std::vector<Shard>& shards)
+{
+    std::vector<aix::Tensor> inputs;
+    for (const auto& shard : shards)
+    {
+        inputs.emplace_back(shard.device == x.device() ? x : transferTo(x, shard.device));
+    }
+    return inputs;
+}
+
+// Range [begin, end) of the rows or the columns of a matrix.
+using IndexRange = std::pair<size_t, size_t>;
+
+// Splits [0, count) into n consecutive ranges of whole units. The sizes of the ranges differ by one unit at most.
+inline std::vector<IndexRange> splitRange(size_t count, size_t n, size_t unit)
+{
+    auto numUnits = count / unit;
+    if (count % unit != 0 || numUnits < n)
+    {
+        throw std::invalid_argument("Size can not be split into the given number of units.");
+    }
+
+    std::vector<IndexRange> ranges;
+    for (size_t i=0; i<n; ++i)
+    {
+        ranges.emplace_back(i * numUnits / n * unit, (i + 1) * numUnits / n * unit);
+    }
+    return ranges;
+}
+
+// Copies the row ranges and the column ranges of a row-major matrix src{rows, cols} into dst. The selected rows and
+// the selected columns of a row are concatenated in the order of the ranges. The elements are elementSize bytes.
+inline void copyMatrixSlice(const uint8_t* src, size_t cols, size_t elementSize, const std::vector<IndexRange>& rows,
+                            const std::vector<IndexRange>& colRanges, uint8_t* dst)
+{
+    for (auto [r0, r1] : rows)
+    {
+        for (size_t r=r0; r<r1; ++r)
+        {
+            for (auto [c0, c1] : colRanges)
+            {
+                std::memcpy(dst, src + (r * cols + c0) * elementSize, (c1 - c0) * elementSize);
+                dst += (c1 - c0) * elementSize;
+            }
+        }
+    }
+}
+
+
+// QuantizedMatrix stores a {rows, cols} matrix with symmetric group-wise weight-only quantization. Each group of
+// kernels::kQuantGroupSize consecutive weights of a row shares a float32 scale, and the weights are dequantized on the
+// fly by the CPU kernels. The quantized weights are not trainable, and they are always loaded from a quantized
+// checkpoint.
+// NOTE: Only the CPU device has the quantized kernels. Dequantizing the whole matrix on the other devices would move
+//       more bytes than the float32 weights, so the quantized formats are rejected for them.
+class QuantizedMatrix : public aix::nn::Module
+{
+public:
+    // Constructor.
+    QuantizedMatrix() = default;
+
+    // Constructor.
+    QuantizedMatrix(size_t rows, size_t cols, WeightFormat format) : m_numBits{format == WeightFormat::kInt4 ? 4u : 8u}
+    {
+        if (!isQuantized(format) || cols % kernels::kQuantGroupSize != 0)
+        {
+            throw std::invalid_argument("Quantized matrix columns must be multiple of the quantization group size.");
+        }
+
+        // INT4 codes are packed into unsigned bytes to keep them as raw bits.
+        auto codesShape = m_numBits == 8 ? aix::Shape{rows, cols} : aix::Shape{rows, cols / 2};
+        auto codesType  = m_numBits == 8 ? aix::DataType::kInt8 : aix::DataType::kUInt8;
+        m_codes  = aix::Tensor(codesShape, aix::dtype(codesType));
+        m_scales = aix::Tensor(aix::Shape{rows, cols / kernels::kQuantGroupSize}, aix::dtype(aix::DataType::kFloat32));
+
+        registerParameter("q", m_codes);
+        registerParameter("scales", m_scales);
+    }
+
+    // Returns x·Wᵀ with the epilogue. The CPU device only. ( x{seq, cols} --> {seq, rows} )
+    aix::Tensor matmulTransposed(const aix::Tensor& x, const kernels::Epilogue& epilogue) const
+    {
+        return kernels::quantizedMatmul(x, m_codes, m_scales, m_numBits, epilogue);
+    }
+
+    // Returns x·Wᵀ. The CPU device only. ( x{seq, cols} --> {seq, rows} )
+    aix::Tensor matmulTransposed(const aix::Tensor& x) const
+    {
+        return kernels::quantizedMatmul(x, m_codes, m_scales, m_numBits);
+    }
+
+    // Returns the dequantized rows selected by the indices. The CPU device only. ( indices{len} --> {len, cols} )
+    aix::Tensor rows(const aix::Tensor& indices) const
+    {
+        return kernels::quantizedRows(m_codes, m_scales, indices, m_numBits);
+    }
+
+    void namedParameters(const std::string& prefix, NamedParameters& params) const
+    {
+        params.emplace_back(prefix + "_q", m_codes);
+        params.emplace_back(prefix + "_scales", m_scales);
+    }
+
+    // Copies the concatenated row ranges of the columns [cols.first, cols.second) into the matrix of the slice shape.
+    // The columns must be aligned to the quantization groups. The codes and the scales must be accessible by the host.
+    void copySlice(const std::vector<IndexRange>& rows, IndexRange cols, QuantizedMatrix& slice) const
+    {
+        constexpr size_t groupSize = kernels::kQuantGroupSize;
+        if (cols.first % groupSize != 0 || cols.second % groupSize != 0)
+        {
+            throw std::invalid_argument("Quantized matrix slices must be aligned to the quantization groups.");
+        }
+
+        copyMatrixSlice(m_codes.value().data<uint8_t>(), m_codes.shape()[1], 1, rows,
+                        {{cols.first * m_numBits / 8, cols.second * m_numBits / 8}},
+                        slice.m_codes.value().data<uint8_t>());
+        copyMatrixSlice(reinterpret_cast<const uint8_t*>(m_scales.value().data<float>()), m_scales.shape()[1],
+                        sizeof(float), rows, {{cols.first / groupSize, cols.second / groupSize}},
+                        reinterpret_cast<uint8_t*>(slice.m_scales.value().data<float>()));
+    }
+
+private:
+    size_t  m_numBits{8};
+    aix::Tensor  m_codes;
+    aix::Tensor  m_scales;
+};
 
 
 class Linear : public aix::nn::Module
@@ -22,24 +258,122 @@ public:
     Linear() = default;
 
     // Constructor.
-    explicit Linear(size_t numInputs, size_t numOutputs)
+    explicit Linear(size_t numInputs, size_t numOutputs, ParamInit init=ParamInit::kRandom,
+                    WeightFormat format=WeightFormat::kFloat32)
+        : m_numInputs{numInputs}, m_format{format}
     {
-        m_w = aix::randn({numInputs, numOutputs}, aix::requireGrad(true));
-        m_b = aix::randn({1,         numOutputs}, aix::requireGrad(true));
-
-        // Register learnable parameters.
+        m_b = createParameter({1, numOutputs}, init);
         registerParameter("b", m_b);
-        registerParameter("w", m_w);
+
+        if (!isQuantized(format))
+        {
+            m_w = createParameter({numInputs, numOutputs}, init, weightDataType(format));
+            registerParameter("w", m_w);
+        }
+        else
+        {
+            // The quantized weights are stored transposed, so the groups are along the input dimension.
+            m_qw = QuantizedMatrix(numOutputs, numInputs, format);
+            registerModule(m_qw);
+        }
     }
 
     aix::Tensor forward(aix::Tensor x) const override
     {
-        return matmul(x, m_w) + m_b;
+        return forward(x, false, nullptr);
+    }
+
+    // Returns GeLU(x·W + b). The activation is fused into the matmul.
+    aix::Tensor forwardGeLU(const aix::Tensor& x) const
+    {
+        return forward(x, true, nullptr);
+    }
+
+    // Returns residual + x·W + b. The residual connection is fused into the matmul.
+    aix::Tensor forwardResidual(const aix::Tensor& x, const aix::Tensor& residual) const
+    {
+        return forward(x, false, &residual);
+    }
+
+    void namedParameters(const std::string& prefix, NamedParameters& params) const
+    {
+        params.emplace_back(prefix + "/b", m_b);
+        if (!isQuantized(m_format))
+        {
+            params.emplace_back(prefix + "/w", m_w);
+        }
+        else
+        {
+            m_qw.namedParameters(prefix + "/w", params);
+        }
+    }
+
+    // Returns a new Linear on the host with the weights of the inputs [inputs.first, inputs.second) and of the
+    // concatenated output ranges. The bias is zero unless withBias is set, so the partial outputs of the input slices
+    // can be summed. The parameters must be accessible by the host.
+    Linear slice(IndexRange inputs, const std::vector<IndexRange>& outputs, bool withBias) const
+    {
+        size_t numOutputs = 0;
+        for (auto [begin, end] : outputs) numOutputs += end - begin;
+        Linear result(inputs.second - inputs.first, numOutputs, ParamInit::kNone, m_format);
+
+        auto bias = result.m_b.value().data<float>();
+        if (withBias)
+        {
+            copyMatrixSlice(reinterpret_cast<const uint8_t*>(m_b.value().data<float>()), this->numOutputs(),
+                            sizeof(float), {{0, 1}}, outputs, reinterpret_cast<uint8_t*>(bias));
+        }
+        else
+        {
+            std::fill(bias, bias + numOutputs, 0.0f);
+        }
+
+        if (isQuantized(m_format))
+        {
+            m_qw.copySlice(outputs, inputs, result.m_qw);       // The quantized weights are stored transposed.
+        }
+        else if (m_format == WeightFormat::kFloat32)
+        {
+            copyMatrixSlice(reinterpret_cast<const uint8_t*>(m_w.value().data<float>()), this->numOutputs(),
+                            sizeof(float), {inputs}, outputs,
+                            reinterpret_cast<uint8_t*>(result.m_w.value().data<float>()));
+        }
+        else
+        {
+            copyMatrixSlice(reinterpret_cast<const uint8_t*>(m_w.value().data<uint16_t>()), this->numOutputs(),
+                            sizeof(uint16_t), {inputs}, outputs,
+                            reinterpret_cast<uint8_t*>(result.m_w.value().data<uint16_t>()));
+        }
+        return result;
     }
 
+    size_t numInputs() const    { return m_numInputs; }
+    size_t numOutputs() const   { return m_b.shape()[1]; }
+
 private:
+    aix::Tensor forward(const aix::Tensor& x, bool gelu, const aix::Tensor* residual) const
+    {
+        if (x.device()->type() == aix::DeviceType::kCPU)
+        {
+            // The bias, the activation and the residual are applied by the matmul kernels before the outputs are
+            // written, so the outputs are written only once.
+            kernels::Epilogue epilogue{m_b.value().data<float>(), gelu,
+                                       residual ? residual->value().data<float>() : nullptr};
+            if (isQuantized(m_format)) return m_qw.matmulTransposed(x, epilogue);
+            if (m_format == WeightFormat::kFloat32) return kernels::matmul(x, m_w, epilogue);
+            return kernels::halfMatmul(x, m_w, false, epilogue);
+        }
+
+        auto y = (isQuantized(m_format) ? m_qw.matmulTransposed(x) : weightMatmul(x, m_w, false)) + m_b;
+        if (gelu) y = geluActivation(y);
+        return residual ? *residual + y : y;
+    }
+
+    size_t  m_numInputs{0};
+    WeightFormat  m_format{WeightFormat::kFloat32};
     aix::Tensor  m_w;
     aix::Tensor  m_b;
+    QuantizedMatrix  m_qw;      // {numOutputs, numInputs}
 };
 
 
@@ -50,11 +384,12 @@ public:
     LayerNorm() = default;
 
     // Constructor.
-    explicit LayerNorm(size_t gSize, size_t bSize, float eps=1e-5, ssize_t dim=0, bool keepDim=false)
+    explicit LayerNorm(size_t gSize, size_t bSize, float eps=1e-5, ssize_t dim=0, bool keepDim=false,
+                       ParamInit init=ParamInit::kRandom)
         : m_eps{eps}, m_dim{dim}, m_keepDim{keepDim}
     {
-        m_b = aix::randn({bSize}, aix::requireGrad(true));
-        m_g = aix::randn({gSize}, aix::requireGrad(true));
+        m_b = createParameter({bSize}, init);
+        m_g = createParameter({gSize}, init);
 
         registerParameter("b", m_b);
         registerParameter("g", m_g);
@@ -62,13 +397,33 @@ public:
 
     aix::Tensor forward(aix::Tensor x) const override
     {
+        if (useFusedKernel(x))
+        {
+            return kernels::layerNorm(x, m_g, m_b, m_eps, kUnbiased);
+        }
+
         auto mean = x.mean(m_dim, m_keepDim);
-        auto variance = x.var(m_dim, true, m_keepDim);
+        auto variance = x.var(m_dim, kUnbiased, m_keepDim);
         x = (x - mean) / (variance + m_eps).sqrt();
         return m_g * x + m_b;
     }
 
+    void namedParameters(const std::string& prefix, NamedParameters& params) const
+    {
+        params.emplace_back(prefix + "/b", m_b);
+        params.emplace_back(prefix + "/g", m_g);
+    }
+
 private:
+    static constexpr bool kUnbiased = true;
+
+    // The fused CPU kernel normalizes the last dimension.
+    bool useFusedKernel(const aix::Tensor& x) const
+    {
+        auto lastDim = static_cast<ssize_t>(x.shape().size()) - 1;
+        return x.device()->type() == aix::DeviceType::kCPU && m_keepDim && (m_dim == -1 || m_dim == lastDim);
+    }
+
     aix::Tensor  m_b;
     aix::Tensor  m_g;
     float   m_eps{1e-5};
@@ -84,25 +439,52 @@ public:
     Embeddings() = default;
 
     // Constructor.
-    explicit Embeddings(size_t numInputs, size_t numOutputs)
+    explicit Embeddings(size_t numInputs, size_t numOutputs, ParamInit init=ParamInit::kRandom,
+                        WeightFormat format=WeightFormat::kFloat32)
+        : m_format{format}
     {
-        m_w = aix::randn({numInputs, numOutputs}, aix::requireGrad(true));
-
-        registerParameter("w", m_w);
+        if (!isQuantized(format))
+        {
+            m_w = createParameter({numInputs, numOutputs}, init, weightDataType(format));
+            registerParameter("w", m_w);
+        }
+        else
+        {
+            m_qw = QuantizedMatrix(numInputs, numOutputs, format);
+            registerModule(m_qw);
+        }
     }
 
     aix::Tensor forward(aix::Tensor inputTokenIds) const override
     {
+        if (isQuantized(m_format)) return m_qw.rows(inputTokenIds);
+        if (m_format != WeightFormat::kFloat32) return m_w.indexSelect(0, inputTokenIds).to(aix::DataType::kFloat32);
         return m_w.indexSelect(0, inputTokenIds);
     }
 
-    aix::Tensor transpose() const
+    // Projects x onto the embeddings, which is the LM head when the weights are tied. ( x{seq, embd} --> {seq, n} )
+    aix::Tensor project(const aix::Tensor& x) const
     {
-        return m_w.transpose(0, 1);
+        if (isQuantized(m_format)) return m_qw.matmulTransposed(x);
+        return weightMatmul(x, m_w, true);
+    }
+
+    void namedParameters(const std::string& prefix, NamedParameters& params) const
+    {
+        if (!isQuantized(m_format))
+        {
+            params.emplace_back(prefix, m_w);
+        }
+        else
+        {
+            m_qw.namedParameters(prefix, params);
+        }
     }
 
 private:
+    WeightFormat  m_format{WeightFormat::kFloat32};
     aix::Tensor  m_w;
+    QuantizedMatrix  m_qw;
 };
 
 
@@ -113,10 +495,11 @@ public:
     FeedForwardNet() = default;
 
     // Constructor.
-    explicit FeedForwardNet(size_t emdSize)
+    explicit FeedForwardNet(size_t emdSize, ParamInit init=ParamInit::kRandom,
+                            WeightFormat format=WeightFormat::kFloat32)
     {
-        m_fc    = Linear(emdSize, emdSize * 4);
-        m_cProj = Linear(emdSize * 4, emdSize);
+        m_fc    = Linear(emdSize, emdSize * 4, init, format);
+        m_cProj = Linear(emdSize * 4, emdSize, init, format);
 
         registerModule(m_fc);
         registerModule(m_cProj);
@@ -124,15 +507,144 @@ public:
 
     aix::Tensor forward(aix::Tensor x) const override
     {
+        if (!m_shards.empty()) return forwardShards(x, nullptr);
         // Project up.
-        auto a = aix::nn::GeLU().forward(m_fc.forward(x));      // {seq, embd} --> {seq, 4*embd}
+        auto a = m_fc.forwardGeLU(x);           // {seq, embd} --> {seq, 4*embd}
         // Project back down.
-        return m_cProj.forward(a);                              // {seq, 4*embd} --> {seq, embd}
+        return m_cProj.forward(a);              // {seq, 4*embd} --> {seq, embd}
+    }
+
+    // Returns residual + FFN(x). The residual connection is fused into the down projection.
+    aix::Tensor forward(const aix::Tensor& x, const aix::Tensor& residual) const
+    {
+        if (!m_shards.empty()) return forwardShards(x, &residual);
+        return m_cProj.forwardResidual(m_fc.forwardGeLU(x), residual);     // {seq, embd} --> {seq, embd}
+    }
+
+    // Returns the network with the hidden units split across the devices (tensor parallelism). Each device computes
+    // its hidden units and their partial down projection, and the partial outputs are summed on the first device.
+    // The hidden units are split in whole quantization groups, so the quantized weights need no regrouping.
+    FeedForwardNet shard(const std::vector<aix::Device*>& devices) const
+    {
+        auto embdDim = m_fc.numInputs();
+        FeedForwardNet result;
+        auto ranges = splitRange(m_fc.numOutputs(), devices.size(), kernels::kQuantGroupSize);
+        for (size_t i=0; i<devices.size(); ++i)
+        {
+            auto& shard = result.m_shards.emplace_back();
+            shard.fc    = m_fc.slice({0, embdDim}, {ranges[i]}, true);
+            shard.cProj = m_cProj.slice(ranges[i], {{0, embdDim}}, i == 0);     // The bias is added once.
+            shard.fc.to(devices[i]);
+            shard.cProj.to(devices[i]);
+            shard.device = devices[i];
+        }
+        for (auto& shard : result.m_shards)
+        {
+            result.registerModule(shard.fc);
+            result.registerModule(shard.cProj);
+        }
+        return result;
+    }
+
+    void namedParameters(const std::string& prefix, NamedParameters& params) const
+    {
+        m_fc.namedParameters(prefix + "/c_fc", params);
+        m_cProj.namedParameters(prefix + "/c_proj", params);
     }
 
 private:
+    struct Shard
+    {
+        Linear fc;
+        Linear cProj;
+        aix::Device* device{nullptr};
+    };
+
+    // The inputs are copied to all devices before any work is queued, and the partial outputs are read back after
+    // all devices are given their work, so the devices run concurrently.
+    aix::Tensor forwardShards(const aix::Tensor& x, const aix::Tensor* residual) const
+    {
+        auto inputs = scatter(x, m_shards);
+        std::vector<aix::Tensor> partials;
+        for (size_t i=0; i<m_shards.size(); ++i)
+        {
+            auto a = m_shards[i].fc.forwardGeLU(inputs[i]);
+            partials.emplace_back(i == 0 && residual ? m_shards[i].cProj.forwardResidual(a, *residual)
+                                                     : m_shards[i].cProj.forward(a));
+        }
+        return sumPartials(partials);
+    }
+
     Linear  m_fc;
     Linear  m_cProj;
+    std::vector<Shard>  m_shards;       // Hidden units of each device, if the network is sharded.
+};
+
+
+// CausalMaskCache keeps the additive causal masks of the attention path that is composed of AIX operations. A mask only
+// depends on the number of new and past tokens, so all layers of a step share the same mask, and the later steps with
+// the same shapes reuse it. The least recently used masks are dropped.
+class CausalMaskCache
+{
+public:
+    // Returns mask{seq, startPos + seq} that hides the future tokens from the new tokens at [startPos, startPos + seq).
+    // The mask of the stacked heads is block-diagonal, mask{heads*seq, heads*ctx}, and it also hides the keys of the
+    // other heads. The pipeline stages of a sharded model share the cache, so it is thread-safe.
+    aix::Tensor get(size_t seqLen, size_t startPos, aix::Device* device, size_t numHeads = 1)
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        for (auto iter = m_entries.begin(); iter != m_entries.end(); ++iter)
+        {
+            if (iter->seqLen == seqLen && iter->startPos == startPos && iter->device == device &&
+                iter->numHeads == numHeads)
+            {
+                m_entries.splice(m_entries.begin(), m_entries, iter);
+                return m_entries.front().mask;
+            }
+        }
+
+        if (m_entries.size() == kMaxEntries) m_entries.pop_back();
+        auto mask = numHeads == 1 ? causalMask(seqLen, startPos, device)
+                                  : stackedHeadsMask(seqLen, startPos, numHeads, device);
+        m_entries.push_front({seqLen, startPos, numHeads, device, mask});
+        return m_entries.front().mask;
+    }
+
+private:
+    struct Entry
+    {
+        size_t seqLen{0};
+        size_t startPos{0};
+        size_t numHeads{1};
+        aix::Device* device{nullptr};
+        aix::Tensor mask;
+    };
+
+    static aix::Tensor causalMask(size_t seqLen, size_t startPos, aix::Device* device)
+    {
+        return aix::ones({seqLen, startPos + seqLen}, aix::device(device)).triu(startPos + 1) * -1e10;
+    }
+
+    static aix::Tensor stackedHeadsMask(size_t seqLen, size_t startPos, size_t numHeads, aix::Device* device)
+    {
+        auto ctxLen = startPos + seqLen;
+        auto cols = numHeads * ctxLen;
+        std::vector<float> mask(numHeads * seqLen * cols, -1e10f);
+        for (size_t h=0; h<numHeads; ++h)
+        {
+            for (size_t i=0; i<seqLen; ++i)
+            {
+                auto row = mask.begin() + static_cast<ssize_t>((h * seqLen + i) * cols + h * ctxLen);
+                std::fill(row, row + static_cast<ssize_t>(startPos + i + 1), 0.0f);
+            }
+        }
+        return aix::Tensor(mask.data(), mask.size(), aix::DataType::kFloat32, aix::Shape{numHeads * seqLen, cols},
+                           aix::dtype(aix::DataType::kFloat32).device(device));
+    }
+
+    static constexpr size_t kMaxEntries = 16;
+    std::list<Entry>  m_entries;
+    std::mutex  m_mutex;
 };
 
 
@@ -143,15 +655,21 @@ public:
     MultiHeadAttention() = default;
 
     // Constructor.
-    explicit MultiHeadAttention(size_t embdDim, size_t numHeads) : m_embdDim{embdDim}, m_numHeads{numHeads}
+    // The mask cache can be shared by all layers of a model. A new one is created if it is not given.
+    explicit MultiHeadAttention(size_t embdDim, size_t numHeads, ParamInit init=ParamInit::kRandom,
+                                WeightFormat format=WeightFormat::kFloat32,
+                                std::shared_ptr<CausalMaskCache> maskCache=nullptr)
+        : m_embdDim{embdDim}, m_numHeads{numHeads}, m_maskCache{std::move(maskCache)}
     {
+        if (!m_maskCache) m_maskCache = std::make_shared<CausalMaskCache>();
+
         if (embdDim % numHeads != 0)
         {
             throw std::invalid_argument("Embedding size must be multiple of number of heads.");
         }
 
-        m_cAtt  = Linear(embdDim, embdDim * 3);
-        m_cProj = Linear(embdDim, embdDim);
+        m_cAtt  = Linear(embdDim, embdDim * 3, init, format);
+        m_cProj = Linear(embdDim, embdDim, init, format);
 
         registerModule(m_cAtt );
         registerModule(m_cProj);
@@ -159,46 +677,229 @@ public:
 
     aix::Tensor forward(aix::Tensor x) const override
     {
-        // QKV projection.
-        x = m_cAtt.forward(x);                  // {seq, embd} --> {seq, 3*embd}
+        KVBlockPool pool(kvArenas(x.device()), x.shape()[0], 1);
+        KVCache cache(pool);
+        return forward(x, cache, 0);
+    }
+
+    aix::Tensor forward(aix::Tensor x, KVCache& cache, size_t layer) const
+    {
+        return forward(x, {&cache}, {x.shape()[0]}, layer);
+    }
+
+    // Batched forward pass. The inputs x{batch*seq, embd} contain seq rows for each sequence, and the first lengths[i]
+    // rows of the sequence i are valid. The remaining rows are padding. Each sequence has its own cache.
+    // If a residual is given, it is added to the outputs by the out projection.
+    // A sharded attention uses the KV cache layers [layer * numShards, (layer + 1) * numShards), one per device.
+    aix::Tensor forward(aix::Tensor x, const std::vector<KVCache*>& caches, const std::vector<size_t>& lengths,
+                        size_t layer, const aix::Tensor* residual = nullptr) const
+    {
+        if (m_shards.empty())
+        {
+            return attend({m_cAtt, m_cProj, m_embdDim, m_numHeads, x.device()}, x, caches, lengths, layer,
+                          residual);
+        }
+
+        // The devices are given all their work before the partial outputs are read back, so they run concurrently.
+        // The residual is added by the first device, which is the device of x.
+        auto inputs = scatter(x, m_shards);
+        std::vector<aix::Tensor> partials;
+        for (size_t i=0; i<m_shards.size(); ++i)
+        {
+            partials.emplace_back(attend(m_shards[i], inputs[i], caches, lengths, layer * m_shards.size() + i,
+                                         i == 0 ? residual : nullptr));
+        }
+        return sumPartials(partials);
+    }
+
+    // Returns the attention with the heads split across the devices (tensor parallelism). Each device projects the
+    // queries, keys and values of its heads, caches its keys and values, and computes its partial out projection.
+    // The partial outputs are summed on the first device.
+    MultiHeadAttention shard(const std::vector<aix::Device*>& devices) const
+    {
+        MultiHeadAttention result;
+        result.m_embdDim   = m_embdDim;
+        result.m_numHeads  = m_numHeads;
+        result.m_maskCache = m_maskCache;
+
+        auto headDim = m_embdDim / m_numHeads;
+        auto ranges  = splitRange(m_embdDim, devices.size(), headDim);
+        for (size_t i=0; i<devices.size(); ++i)
+        {
+            // The QKV projection outputs the queries, the keys and the values of all heads one after another.
+            auto [begin, end] = ranges[i];
+            std::vector<IndexRange> qkv{{begin, end}, {m_embdDim + begin, m_embdDim + end},
+                                        {2 * m_embdDim + begin, 2 * m_embdDim + end}};
+            auto& shard = result.m_shards.emplace_back();
+            shard.cAtt     = m_cAtt.slice({0, m_embdDim}, qkv, true);
+            shard.cProj    = m_cProj.slice(ranges[i], {{0, m_embdDim}}, i == 0);     // The bias is added once.
+            shard.embdDim  = end - begin;
+            shard.numHeads = shard.embdDim / headDim;
+            shard.device   = devices[i];
+            shard.cAtt.to(devices[i]);
+            shard.cProj.to(devices[i]);
+        }
+        for (auto& shard : result.m_shards)
+        {
+            result.registerModule(shard.cAtt);
+            result.registerModule(shard.cProj);
+        }
+        return result;
+    }
+
+    // Returns the KV cache layers of the attention. There is one for each device of a sharded attention. The layers
+    // of an attention that is not sharded are on the given device.
+    std::vector<KVBlockPool::Arena> kvArenas(aix::Device* device) const
+    {
+        if (m_shards.empty()) return {{m_embdDim, device}};
+        std::vector<KVBlockPool::Arena> arenas;
+        for (const auto& shard : m_shards) arenas.push_back({shard.embdDim, shard.device});
+        return arenas;
+    }
+
+    void namedParameters(const std::string& prefix, NamedParameters& params) const
+    {
+        m_cAtt.namedParameters(prefix + "/c_attn", params);
+        m_cProj.namedParameters(prefix + "/c_proj", params);
+    }
+
+private:
+    // Heads of the attention on a device. An attention that is not sharded is a single part of all heads.
+    struct Shard
+    {
+        Linear cAtt;
+        Linear cProj;
+        size_t embdDim{0};          // Width of the heads of the part.
+        size_t numHeads{0};
+        aix::Device* device{nullptr};
+    };
+
+    aix::Tensor attend(const Shard& part, aix::Tensor x, const std::vector<KVCache*>& caches,
+                       const std::vector<size_t>& lengths, size_t layer, const aix::Tensor* residual) const
+    {
+        auto batchSize = caches.size();
+        auto seqLen    = x.shape()[0] / batchSize;
+        auto embdDim   = part.embdDim;
 
-        // Causal mask to hide future inputs from being attended to. ( mask{seq, seq} )
-        auto causalMask = aix::ones({x.shape()[0], x.shape()[0]}, aix::device(x.device())).triu(1) * -1e10;
+        // QKV projection.
+        x = part.cAtt.forward(x);               // {batch*seq, embd} --> {batch*seq, 3*embd}
 
         // Split into {Q, K, V}
-        auto qkv = x.split(m_embdDim, -1);     // {seq, 3*embd} --> {3, seq, embd}
+        auto qkv = x.split(embdDim, -1);       // {batch*seq, 3*embd} --> {3, batch*seq, embd}
+        if (batchSize == 1 && lengths[0] == seqLen)
+        {
+            x = sequenceAttention(part, qkv[0], qkv[1], qkv[2], *caches[0], layer);
+        }
+        else
+        {
+            // Each sequence attends only to its own tokens, so the attention is computed per sequence.
+            auto qSeqs = qkv[0].split(seqLen, 0);      // {batch*seq, embd} --> {batch, seq, embd}
+            auto kSeqs = qkv[1].split(seqLen, 0);
+            auto vSeqs = qkv[2].split(seqLen, 0);
+
+            std::vector<aix::Tensor> outSeqs;
+            for (size_t i=0; i<batchSize; ++i)
+            {
+                auto length = lengths[i];
+                if (length == seqLen)
+                {
+                    outSeqs.emplace_back(sequenceAttention(part, qSeqs[i], kSeqs[i], vSeqs[i], *caches[i], layer));
+                    continue;
+                }
+
+                // Padding rows are neither cached nor attended to. Their outputs are zeros.
+                outSeqs.emplace_back(sequenceAttention(part, qSeqs[i].split(length, 0)[0],
+                                                       kSeqs[i].split(length, 0)[0], vSeqs[i].split(length, 0)[0],
+                                                       *caches[i], layer));
+                outSeqs.emplace_back(aix::zeros({seqLen - length, embdDim}, aix::device(x.device())));
+            }
+
+            // Merge sequences.
+            x = aix::vstack(outSeqs);       // [batch, seq, embd] --> {batch*seq, embd}
+        }
+
+        // Out projection.
+        if (residual) return part.cProj.forwardResidual(x, *residual);
+        return part.cProj.forward(x);       // {batch*seq, embd} --> {batch*seq, embd}
+    }
+
+    // Computes the attention of a single sequence. q{seq, embd}, k{seq, embd} and v{seq, embd} are of the new tokens.
+    aix::Tensor sequenceAttention(const Shard& part, const aix::Tensor& q, const aix::Tensor& k, const aix::Tensor& v,
+                                  KVCache& cache, size_t layer) const
+    {
+        auto startPos = cache.size();           // Number of past tokens in the cache.
+
+        // Append new keys and values to the cache. The new queries attend to all past and new tokens.
+        cache.append(layer, k, v);
+
+        if (q.device()->type() == aix::DeviceType::kCPU)
+        {
+            // All heads are processed in a single fused pass with an implicit causal mask. The keys and values are
+            // read in place from the blocks of the cache. The CPU device runs eagerly, so the flush does not wait.
+            cache.flush(layer);
+            const auto& pool = cache.pool();
+            return kernels::causalAttention(q, pool.keys(layer), pool.values(layer), cache.blockTable(),
+                                            pool.blockSize(), part.numHeads, startPos);      // {seq, embd}
+        }
+
+        // Keys and values are gathered from the blocks. ( {ctx, embd}, ctx = startPos + seq )
+        return multiHeadAttention(part, q, cache.keys(layer), cache.values(layer), startPos);  // {seq, embd}
+    }
+
+    aix::Tensor multiHeadAttention(const Shard& part, const aix::Tensor& q, const aix::Tensor& k,
+                                   const aix::Tensor& v, size_t startPos) const
+    {
+        auto seqLen = q.shape()[0];
 
         // Split each in qkv into n heads/chucks.
-        auto qHeads = qkv[0].split(m_embdDim / m_numHeads, -1);     // Q --> n heads.
-        auto kHeads = qkv[1].split(m_embdDim / m_numHeads, -1);     // K --> n heads.
-        auto vHeads = qkv[2].split(m_embdDim / m_numHeads, -1);     // V --> n heads.
+        auto headDim = part.embdDim / part.numHeads;
+        auto qHeads = q.split(headDim, -1);     // Q --> n heads.
+        auto kHeads = k.split(headDim, -1);     // K --> n heads.
+        auto vHeads = v.split(headDim, -1);     // V --> n heads.
+
+        // The heads of the small steps, i.e. the decode steps, are stacked along the rows and processed together, so
+        // the step launches a few operations instead of a few per head. The block-diagonal mask keeps each head to its
+        // own keys. The stacked scores are heads times the scores of the heads, so the large steps run per head.
+        auto ctxLen = k.shape()[0];
+        if (part.numHeads > 1 && part.numHeads * part.numHeads * seqLen * ctxLen <= kMaxStackedScores)
+        {
+            auto stackedMask = m_maskCache->get(seqLen, startPos, q.device(), part.numHeads);
+            auto out = attention(aix::vstack(qHeads), aix::vstack(kHeads), aix::vstack(vHeads), &stackedMask);
+            return aix::hstack(out.split(seqLen, 0));      // {heads*seq, embd/heads} --> {seq, embd}
+        }
+
+        // Causal mask to hide future inputs from being attended to. ( mask{seq, ctx} )
+        // A single new token is the last token in the sequence and can attend to all tokens, so it needs no mask.
+        aix::Tensor causalMask;
+        if (seqLen > 1) causalMask = m_maskCache->get(seqLen, startPos, q.device());
 
         // [3, heads, seq, embd/heads] --> [heads, seq, embd/heads]
         std::vector<aix::Tensor> outHeads;
         for (size_t i=0; i<qHeads.size(); ++i)
         {
-            outHeads.emplace_back(attention(qHeads[i], kHeads[i], vHeads[i], causalMask));
+            outHeads.emplace_back(attention(qHeads[i], kHeads[i], vHeads[i], seqLen > 1 ? &causalMask : nullptr));
         }
 
         // Merge heads.
-        x = aix::hstack(outHeads);          // [heads, seq, embd/heads] --> {seq, embd}
-
-        // Out projection.
-        return m_cProj.forward(x);          // {seq, embd} --> {seq, embd}
+        return aix::hstack(outHeads);       // [heads, seq, embd/heads] --> {seq, embd}
     }
 
-private:
     static aix::Tensor attention(const aix::Tensor& q, const aix::Tensor& k, const aix::Tensor& v,
-                                 const aix::Tensor& mask)
+                                 const aix::Tensor* mask)
     {
         auto softmax = aix::nn::Softmax(-1, true);
-        return softmax.forward(q.matmul(k.transpose(0, 1)) / std::sqrt(q.shape().back()) + mask).matmul(v);
+        auto scores = q.matmul(k.transpose(0, 1)) / std::sqrt(q.shape().back());
+        return softmax.forward(mask ? scores + *mask : scores).matmul(v);
     }
 
+    static constexpr size_t kMaxStackedScores = 1 << 20;     // Scores of the stacked heads, 4 MB.
+
     size_t  m_embdDim{0};
     size_t  m_numHeads{0};
     Linear  m_cAtt;
     Linear  m_cProj;
+    std::vector<Shard>  m_shards;       // Heads of each device, if the attention is sharded.
+    std::shared_ptr<CausalMaskCache>  m_maskCache;
 };
 
 
@@ -209,12 +910,13 @@ public:
     TransformerBlock() = default;
 
     // Constructor.
-    TransformerBlock(size_t embdDim, size_t numHeads)
+    TransformerBlock(size_t embdDim, size_t numHeads, ParamInit init=ParamInit::kRandom,
+                     WeightFormat format=WeightFormat::kFloat32, std::shared_ptr<CausalMaskCache> maskCache=nullptr)
     {
-        m_mha = MultiHeadAttention(embdDim, numHeads);
-        m_ln1 = LayerNorm(embdDim, embdDim, 1e-5, -1, true);
-        m_ln2 = LayerNorm(embdDim, embdDim, 1e-5, -1, true);
-        m_ffn = FeedForwardNet(embdDim);
+        m_mha = MultiHeadAttention(embdDim, numHeads, init, format, std::move(maskCache));
+        m_ln1 = LayerNorm(embdDim, embdDim, 1e-5, -1, true, init);
+        m_ln2 = LayerNorm(embdDim, embdDim, 1e-5, -1, true, init);
+        m_ffn = FeedForwardNet(embdDim, init, format);
 
         registerModule(m_mha);
         registerModule(m_ln1);
@@ -224,13 +926,70 @@ public:
 
     aix::Tensor forward(aix::Tensor x) const override
     {
-        // Multi-head causal self-attention.
-        x = x + m_mha.forward(m_ln1.forward(x));        // {seq, embd} --> {seq, embd}
+        KVBlockPool pool(kvArenas(x.device()), x.shape()[0], 1);
+        KVCache cache(pool);
+        return forward(x, cache, 0);
+    }
+
+    aix::Tensor forward(aix::Tensor x, KVCache& cache, size_t layer) const
+    {
+        return forward(x, {&cache}, {x.shape()[0]}, layer);
+    }
+
+    aix::Tensor forward(aix::Tensor x, const std::vector<KVCache*>& caches, const std::vector<size_t>& lengths,
+                        size_t layer) const
+    {
+        // Each part is a profiling scope of the layer. The scopes are no-ops unless the profiler is enabled.
+        auto device = x.device();
+        auto layerNorm = [&](const LayerNorm& ln, const char* name, const aix::Tensor& input)
+        {
+            ProfileScope scope(name, "module", device, static_cast<int32_t>(layer));
+            return scope.output(ln.forward(input));
+        };
+
+        // Multi-head causal self-attention. The residual connections are added by the output projections.
+        auto h = layerNorm(m_ln1, "ln_1", x);
+        {
+            ProfileScope scope("attn", "module", device, static_cast<int32_t>(layer));
+            x = scope.output(m_mha.forward(h, caches, lengths, layer, &x));   // {batch*seq, embd} --> {batch*seq, embd}
+        }
 
         // Position-wise feed-forward network.
-        return x + m_ffn.forward(m_ln2.forward(x));     // {seq, embd} --> {seq, embd}
+        h = layerNorm(m_ln2, "ln_2", x);
+        ProfileScope scope("ffn", "module", device, static_cast<int32_t>(layer));
+        return scope.output(m_ffn.forward(h, x));       // {batch*seq, embd} --> {batch*seq, embd}
     }
 
+    void namedParameters(const std::string& prefix, NamedParameters& params) const
+    {
+        m_mha.namedParameters(prefix + "/attn", params);
+        m_ln1.namedParameters(prefix + "/ln_1", params);
+        m_ln2.namedParameters(prefix + "/ln_2", params);
+        m_ffn.namedParameters(prefix + "/mlp", params);
+    }
+
+    // Returns the block with its attention heads and feed-forward hidden units split across the devices. The layer
+    // normalizations and the residual stream are on the first device.
+    TransformerBlock shard(const std::vector<aix::Device*>& devices) const
+    {
+        TransformerBlock result;
+        result.m_mha = m_mha.shard(devices);
+        result.m_ln1 = m_ln1;
+        result.m_ln2 = m_ln2;
+        result.m_ffn = m_ffn.shard(devices);
+        result.m_ln1.to(devices[0]);
+        result.m_ln2.to(devices[0]);
+
+        result.registerModule(result.m_mha);
+        result.registerModule(result.m_ln1);
+        result.registerModule(result.m_ln2);
+        result.registerModule(result.m_ffn);
+        return result;
+    }
+
+    // Returns the KV cache layers of the block on the given device, or on the devices of a sharded block.
+    std::vector<KVBlockPool::Arena> kvArenas(aix::Device* device) const     { return m_mha.kvArenas(device); }
+
 private:
     MultiHeadAttention  m_mha;
     LayerNorm m_ln1;
@@ -246,47 +1005,582 @@ public:
     GPT2() = default;
 
     // Constructor.
-    explicit GPT2(size_t vocabSize, size_t ctxSize, size_t embdDim, size_t numHeads, size_t numLayers)
-        : m_numLayers{numLayers}
+    // Only numResidentLayers transformer blocks are allocated if it is less than the number of layers. Zero allocates
+    // all. The weights of the other layers are streamed into two of the resident blocks from a checkpoint, see
+    // streamLayers().
+    explicit GPT2(size_t vocabSize, size_t ctxSize, size_t embdDim, size_t numHeads, size_t numLayers,
+                  ParamInit init=ParamInit::kRandom, WeightFormat format=WeightFormat::kFloat32,
+                  size_t numResidentLayers=0)
+        : m_ctxSize{ctxSize}, m_embdDim{embdDim}, m_numLayers{numLayers}, m_stageLayers{0, numLayers}
     {
         // The architecture uses only the decoder stack of the original transformer model.
-        m_wte = Embeddings(vocabSize, embdDim);
-        m_wpe = Embeddings(ctxSize, embdDim);
-        m_layerNorm = LayerNorm(embdDim, embdDim, 1e-5, -1, true);
+        // The token embeddings use the format of the Linear weights since they are also the LM head weights. The
+        // positional embeddings are small and stay in float32.
+        m_wte = Embeddings(vocabSize, embdDim, init, format);
+        m_wpe = Embeddings(ctxSize, embdDim, init);
+        m_layerNorm = LayerNorm(embdDim, embdDim, 1e-5, -1, true, init);
+
+        // The streamed layers need two slots for the double buffering. The pinned layers are spread evenly, so the
+        // copy of a streamed layer overlaps the pinned layers before the next streamed layer as well.
+        auto numPinned = numLayers;
+        if (numResidentLayers != 0 && numResidentLayers < numLayers)
+        {
+            if (numResidentLayers < kNumStreamSlots)
+            {
+                throw std::invalid_argument("Number of resident layers must be at least two to stream the others.");
+            }
+            numPinned = numResidentLayers - kNumStreamSlots;
+        }
 
+        // All layers share the causal masks of a step.
+        auto maskCache = std::make_shared<CausalMaskCache>();
+        size_t numStreamed = 0;
         for (size_t i=0; i<numLayers; ++i)
         {
-            m_transformerBlocks.emplace_back(embdDim, numHeads);
-            registerModule(m_transformerBlocks.back());
+            if ((i + 1) * numPinned / numLayers > i * numPinned / numLayers)
+            {
+                m_layerBlocks.emplace_back(m_transformerBlocks.size());
+                m_streamIndices.emplace_back(kNotStreamed);
+                m_transformerBlocks.emplace_back(embdDim, numHeads, init, format, maskCache);
+                continue;
+            }
+            m_layerBlocks.emplace_back(numPinned + numStreamed % kNumStreamSlots);
+            m_streamIndices.emplace_back(numStreamed++);
         }
+        for (size_t i=0; i<std::min(numStreamed, kNumStreamSlots); ++i)
+        {
+            m_transformerBlocks.emplace_back(embdDim, numHeads, init, format, maskCache);
+        }
+        for (auto& block : m_transformerBlocks) registerModule(block);
 
         registerModule(m_layerNorm);
         registerModule(m_wpe);
         registerModule(m_wte);
     }
 
+    // Returns the model with its layers split across the devices. The devices are divided into consecutive groups of
+    // tensorParallel devices, and each group is a pipeline stage of consecutive layers. The layers of a stage have
+    // their attention heads and feed-forward hidden units split across the devices of the group. The embeddings, the
+    // final layer normalization and the LM head are on the first device, which is the device of the inputs.
+    // A batch is split into micro-batches that flow through the stages concurrently. Zero uses a micro-batch for
+    // each stage.
+    // NOTE: The weights of the given model are copied to the devices through the host memory, so they must be ready.
+    static std::unique_ptr<GPT2> shard(std::unique_ptr<GPT2> model, const std::vector<aix::Device*>& devices,
+                                       size_t tensorParallel=1, size_t numMicroBatches=0)
+    {
+        if (model->numStreamedLayers() != 0)
+        {
+            throw std::invalid_argument("Model with streamed layers can not be sharded.");
+        }
+        if (tensorParallel == 0 || devices.empty() || devices.size() % tensorParallel != 0)
+        {
+            throw std::invalid_argument("Number of devices must be a multiple of the tensor-parallel size.");
+        }
+        auto numStages = devices.size() / tensorParallel;
+        if (numStages > model->m_numLayers)
+        {
+            throw std::invalid_argument("Number of pipeline stages can not be greater than the number of layers.");
+        }
+
+        auto result = std::make_unique<GPT2>();
+        result->m_ctxSize          = model->m_ctxSize;
+        result->m_embdDim          = model->m_embdDim;
+        result->m_numLayers        = model->m_numLayers;
+        result->m_prefillChunkSize = model->m_prefillChunkSize;
+        result->m_tensorParallel   = tensorParallel;
+        result->m_numMicroBatches  = numMicroBatches == 0 ? numStages : numMicroBatches;
+        result->m_wte       = std::move(model->m_wte);
+        result->m_wpe       = std::move(model->m_wpe);
+        result->m_layerNorm = std::move(model->m_layerNorm);
+        result->m_wte.to(devices[0]);
+        result->m_wpe.to(devices[0]);
+        result->m_layerNorm.to(devices[0]);
+
+        // The layers are split evenly. The first stages have one more layer if they can not be split evenly.
+        result->m_stageLayers = {0};
+        result->m_stageDevices.clear();
+        for (const auto& [begin, end] : splitRange(model->m_numLayers, numStages, 1))
+        {
+            std::vector<aix::Device*> group(devices.begin() + static_cast<ssize_t>(result->m_stageDevices.size() *
+                                                                                   tensorParallel),
+                                            devices.begin() + static_cast<ssize_t>((result->m_stageDevices.size() + 1) *
+                                                                                   tensorParallel));
+            for (size_t i=begin; i<end; ++i)
+            {
+                auto& block = model->m_transformerBlocks[i];
+                if (tensorParallel == 1)
+                {
+                    block.to(group[0]);
+                    result->m_transformerBlocks.emplace_back(std::move(block));
+                }
+                else
+                {
+                    result->m_transformerBlocks.emplace_back(block.shard(group));
+                }
+                result->m_layerBlocks.emplace_back(i);
+                result->m_streamIndices.emplace_back(kNotStreamed);
+            }
+            result->m_stageLayers.emplace_back(end);
+            result->m_stageDevices.emplace_back(group[0]);
+        }
+
+        for (auto& block : result->m_transformerBlocks) result->registerModule(block);
+        result->registerModule(result->m_layerNorm);
+        result->registerModule(result->m_wpe);
+        result->registerModule(result->m_wte);
+
+        // Each stage runs its micro-batches in order on its own thread, with its own workspace.
+        result->m_workspaces.resize(numStages);
+        if (numStages > 1)
+        {
+            for (size_t i=0; i<numStages; ++i) result->m_stageThreads.emplace_back(std::make_unique<ThreadPool>(1));
+        }
+        return result;
+    }
+
+    // Returns a KV block pool for the layers of the model. The layers of a sharded model are on their own devices,
+    // otherwise they are on the given device.
+    KVBlockPool createKVPool(size_t blockSize, size_t numBlocks, aix::Device* device) const
+    {
+        std::vector<KVBlockPool::Arena> arenas;
+        for (size_t s=0; s<m_stageDevices.size(); ++s)
+        {
+            auto stageDevice = m_stageDevices[s] ? m_stageDevices[s] : device;
+            for (size_t i=m_stageLayers[s]; i<m_stageLayers[s + 1]; ++i)
+            {
+                auto layerArenas = m_transformerBlocks[m_layerBlocks[i]].kvArenas(stageDevice);
+                arenas.insert(arenas.end(), layerArenas.begin(), layerArenas.end());
+            }
+        }
+        return {arenas, blockSize, numBlocks};
+    }
+
     aix::Tensor forward(aix::Tensor inputs) const override
     {
-        // Text and positional embeddings.
-        auto range = aix::arange(0, inputs.shape()[0], 1, aix::dtype(aix::DataType::kInt32).device(inputs.device()));
-        auto x = m_wte.forward(inputs) + m_wpe.forward(range);
+        auto pool = createKVPool(inputs.shape()[0], 1, inputs.device());
+        KVCache cache(pool);
+        return forward(inputs, 0, cache);
+    }
 
-        // Transformer decoder stack.
+    // Incremental forward pass. Processes only the new tokens starting at the position startPos in the sequence,
+    // and attends over the keys and values of the past tokens stored in the cache.
+    aix::Tensor forward(const aix::Tensor& newTokens, size_t startPos, KVCache& cache) const
+    {
+        if (startPos != cache.size())
+        {
+            throw std::invalid_argument("Start position must be equal to the number of cached tokens.");
+        }
+
+        auto seqLen = newTokens.shape()[0];
+        auto logits = forward(newTokens.reshape({1, seqLen}), {seqLen}, {&cache});
+        return logits.reshape({seqLen, logits.shape().back()});      // {1, seq, vocab} --> {seq, vocab}
+    }
+
+    // Batched incremental forward pass. newTokens{batch, seq} contains the new tokens of each sequence, padded to the
+    // same length. The first lengths[i] tokens of the sequence i are valid, and they are appended to the sequence's
+    // own cache. Returns logits{batch, seq, vocab}, where the logits of the padding tokens are undefined.
+    aix::Tensor forward(const aix::Tensor& newTokens, const std::vector<size_t>& lengths,
+                        const std::vector<KVCache*>& caches) const
+    {
+        auto x = decode(newTokens, lengths, caches);
+        auto logits = projectToVocab(x);      // {batch*seq, vocab}
+        return logits.reshape({newTokens.shape()[0], newTokens.shape()[1], logits.shape().back()});
+    }
+
+    // Incremental forward pass that returns only the logits{numRows, vocab} of the last numRows new tokens.
+    aix::Tensor forwardLast(const aix::Tensor& newTokens, size_t startPos, KVCache& cache, size_t numRows=1) const
+    {
+        if (startPos != cache.size())
+        {
+            throw std::invalid_argument("Start position must be equal to the number of cached tokens.");
+        }
+
+        auto seqLen = newTokens.shape()[0];
+        if (numRows == 0 || numRows > seqLen)
+        {
+            throw std::invalid_argument("Number of logits rows must be between one and the input length.");
+        }
+
+        auto x = decode(newTokens.reshape({1, seqLen}), {seqLen}, {&cache});
+        if (numRows < seqLen)
+        {
+            std::vector<int32_t> lastRows(numRows);
+            for (size_t i=0; i<numRows; ++i) lastRows[i] = static_cast<int32_t>(seqLen - numRows + i);
+            auto indices = aix::Tensor(lastRows.data(), lastRows.size(), aix::DataType::kInt32,
+                                       aix::Shape{lastRows.size()},
+                                       aix::dtype(aix::DataType::kInt32).device(newTokens.device()));
+            x = x.indexSelect(0, indices);      // {seq, embd} --> {numRows, embd}
+        }
+        return projectToVocab(x);
+    }
+
+    // Batched incremental forward pass that returns only the logits{batch, vocab} of the last valid token of each
+    // sequence. The LM head is the largest matmul of a decode step, so the other rows are not projected.
+    aix::Tensor forwardLast(const aix::Tensor& newTokens, const std::vector<size_t>& lengths,
+                            const std::vector<KVCache*>& caches) const
+    {
+        std::vector<size_t> sequences(newTokens.shape()[0]);
+        for (size_t i=0; i<sequences.size(); ++i) sequences[i] = i;
+        return forwardLast(newTokens, lengths, caches, sequences);
+    }
+
+    // Batched incremental forward pass that returns the logits{sequences, vocab} of the last valid token of the given
+    // sequences only. The other sequences, i.e. the prompt chunks, only append their tokens to their caches. If no
+    // sequence is given, the LM head is skipped, and an empty tensor is returned.
+    aix::Tensor forwardLast(const aix::Tensor& newTokens, const std::vector<size_t>& lengths,
+                            const std::vector<KVCache*>& caches, const std::vector<size_t>& sequences) const
+    {
+        auto x = decode(newTokens, lengths, caches);
+        if (sequences.empty()) return {};
+
+        auto batchSize = newTokens.shape()[0];
+        auto seqLen    = newTokens.shape()[1];
+        if (seqLen > 1 || sequences.size() < batchSize)
+        {
+            std::vector<int32_t> lastRows(sequences.size());
+            for (size_t i=0; i<sequences.size(); ++i)
+            {
+                lastRows[i] = static_cast<int32_t>(sequences[i] * seqLen + lengths[sequences[i]] - 1);
+            }
+            auto indices = aix::Tensor(lastRows.data(), lastRows.size(), aix::DataType::kInt32,
+                                       aix::Shape{lastRows.size()},
+                                       aix::dtype(aix::DataType::kInt32).device(newTokens.device()));
+            x = x.indexSelect(0, indices);      // {batch*seq, embd} --> {sequences, embd}
+        }
+        return projectToVocab(x);
+    }
+
+    // Returns the parameters to load from a weights file. The streamed layers are loaded when they run.
+    NamedParameters namedParameters() const
+    {
+        NamedParameters params;
         for (size_t i=0; i<m_numLayers; ++i)
         {
-            x = m_transformerBlocks[i].forward(x);
+            if (m_streamIndices[i] != kNotStreamed) continue;
+            m_transformerBlocks[m_layerBlocks[i]].namedParameters("h" + std::to_string(i), params);
         }
+        m_layerNorm.namedParameters("ln_f", params);
+        m_wpe.namedParameters("wpe", params);
+        m_wte.namedParameters("wte", params);
+        return params;
+    }
 
-        // Projection to vocabulary. The final layer normalization is specific to the GPT2 architecture.
-        // It is not present in the original GPT and Transformer papers.
-        // NOTE: Softmax is not applied at the end, so the outputs will be logits instead of probabilities.
-        return m_layerNorm.forward(x).matmul(m_wte.transpose());
+    // Processes the tokens that are not in the cache yet, except the last one, in chunks of the prefill chunk size.
+    // The next step processes only the last token, and predicts the next token from its logits.
+    void prefill(const std::vector<ssize_t>& tokenIds, KVCache& cache) const
+    {
+        while (cache.size() + 1 < tokenIds.size())
+        {
+            auto numTokens = std::min(m_prefillChunkSize, tokenIds.size() - 1 - cache.size());
+            auto chunk = aix::Tensor(tokenIds.data() + cache.size(), numTokens, aix::DataType::kInt64,
+                                     aix::Shape{1, numTokens},
+                                     aix::dtype(aix::DataType::kInt32).device(cache.pool().device()));
+            decode(chunk, {numTokens}, {&cache});
+        }
+    }
+
+    // Generates up to maxNewTokens tokens after the prompt, and returns the generated tokens. The prompt is prefilled
+    // in chunks, and then only the last token is processed in each step, using the KV cache. The generation stops at
+    // the context size. onToken is called with the new tokens in order once they are read back, so it should hand
+    // them off instead of blocking the decode loop.
+    // The greedy decoding keeps the selected tokens on the device and feeds them as the inputs of the next steps, so
+    // the steps are queued without waiting for the host. The token ids are read back every kReadbackInterval steps.
+    // NOTE: The model must be created with the inference parameters, ParamInit::kNone, to run without autograd.
+    std::vector<ssize_t> generate(const std::vector<ssize_t>& promptTokenIds, size_t maxNewTokens,
+                                  std::unique_ptr<aix::Device>& device, const SamplingConfig& sampling = {},
+                                  const std::function<void(ssize_t)>& onToken = nullptr) const
+    {
+        if (promptTokenIds.empty())
+        {
+            throw std::invalid_argument("Prompt cannot be empty.");
+        }
+
+        // A single sequence needs enough blocks for the full context.
+        constexpr size_t kvBlockSize = 16;
+        auto kvPool = createKVPool(kvBlockSize, (m_ctxSize + kvBlockSize - 1) / kvBlockSize, device.get());
+        KVCache kvCache(kvPool);
+        Sampler sampler(sampling);
+
+        // The repetition penalty applies to the prompt and the generated tokens.
+        auto history = promptTokenIds;
+        std::vector<ssize_t> generatedTokenIds;
+        std::vector<aix::Tensor> pendingTokens;         // Selected on the device, but not read back yet.
+        auto readBack = [&]()
+        {
+            // Synchronize to read data on the CPU. The cache is flushed while the device is idle.
+            synchronizeDevice(device.get());
+            kvCache.flush();
+            for (const auto& token : pendingTokens)
+            {
+                ssize_t tokenId = token.value().item<int32_t>();        // Argmax return type is int32_t.
+                history.emplace_back(tokenId);
+                generatedTokenIds.emplace_back(tokenId);
+                if (onToken) onToken(tokenId);
+            }
+            pendingTokens.clear();
+        };
+
+        // Prefill the prompt, and convert its last token ID into a tensor.
+        if (promptTokenIds.size() >= m_ctxSize) return {};
+        prefill(promptTokenIds, kvCache);
+        auto inputs = aix::Tensor(&promptTokenIds.back(), 1, aix::DataType::kInt64, aix::Shape{1},
+                                  aix::dtype(aix::DataType::kInt32)).to(device);
+        size_t numGenerated = 0;
+        while (numGenerated < maxNewTokens && kvCache.size() + inputs.shape()[0] < m_ctxSize)
+        {
+            // Predict the next token (either a word or a sub-word).
+            auto logits = forwardLast(inputs, kvCache.size(), kvCache);
+            ++numGenerated;
+            if (sampler.onDevice())
+            {
+                // Greedy sampling. Selecting the highest prob token. It is the input of the next step.
+                inputs = aix::argmax(logits[0]).reshape({1});
+                pendingTokens.emplace_back(inputs);
+                if (pendingTokens.size() == kReadbackInterval) readBack();
+                continue;
+            }
+
+            ssize_t nextTokenId = sampler.sample(logits, {&history}, device.get())[0];
+            kvCache.flush();        // The sampling read the logits back, so the device is idle.
+            history.emplace_back(nextTokenId);
+            generatedTokenIds.emplace_back(nextTokenId);
+            if (onToken) onToken(nextTokenId);
+
+            inputs = aix::Tensor(&nextTokenId, 1, aix::DataType::kInt64, aix::Shape{1},
+                                 aix::dtype(aix::DataType::kInt32)).to(device);
+        }
+        readBack();
+        return generatedTokenIds;
+    }
+
+    // Starts streaming the weights of the layers that are not resident from an indexed checkpoint. Each streamed layer
+    // is copied into its slot just before it runs, while the previous layer computes. The model must be on its
+    // device, since the weights are copied into the device buffers of the slots.
+    void streamLayers(const std::string& checkpointFile)
+    {
+        std::vector<NamedParameters> layerParams;
+        std::vector<size_t> slots;
+        for (size_t i=0; i<m_numLayers; ++i)
+        {
+            if (m_streamIndices[i] == kNotStreamed) continue;
+            m_transformerBlocks[m_layerBlocks[i]].namedParameters("h" + std::to_string(i), layerParams.emplace_back());
+            slots.emplace_back(m_streamIndices[i] % kNumStreamSlots);
+        }
+        if (layerParams.empty()) return;
+
+        m_streamer.reset();         // The pending copy of a previous streamer must finish first.
+        m_streamer = std::make_unique<LayerStreamer>(checkpointFile, layerParams, std::move(slots),
+                                                     layerParams.front().front().second.device());
+    }
+
+    // Returns the number of bytes of the weights of a transformer block.
+    static size_t blockBytes(size_t embdDim, size_t numHeads, WeightFormat format)
+    {
+        size_t numBytes = 0;
+        TransformerBlock block(embdDim, numHeads, ParamInit::kNone, format);
+        for (const auto& [name, param] : block.parameters()) numBytes += ProfileScope::tensorBytes(param);
+        return numBytes;
+    }
+
+    // Sets the maximum number of tokens of a sequence processed in a prefill step. The long prompts are processed
+    // in chunks against the growing KV cache, so the attention scores and the activations of a step are bounded.
+    void setPrefillChunkSize(size_t chunkSize)
+    {
+        if (chunkSize == 0)
+        {
+            throw std::invalid_argument("Prefill chunk size must be greater than zero.");
+        }
+        m_prefillChunkSize = chunkSize;
+    }
+
+    size_t prefillChunkSize() const     { return m_prefillChunkSize; }
+    size_t ctxSize() const      { return m_ctxSize; }
+    size_t embdDim() const      { return m_embdDim; }
+    size_t numLayers() const    { return m_numLayers; }
+    size_t numStreamedLayers() const
+    {
+        return static_cast<size_t>(std::count_if(m_streamIndices.begin(), m_streamIndices.end(),
+                                                  [](size_t index) { return index != kNotStreamed; }));
     }
 
 private:
+    static constexpr size_t kReadbackInterval = 8;
+    static constexpr size_t kNumStreamSlots = 2;
+    static constexpr size_t kNotStreamed = std::numeric_limits<size_t>::max();
+
+    // Runs the decoder stack, and appends the keys and values of the new tokens to the caches.
+    // Returns the hidden states{batch*seq, embd}.
+    aix::Tensor decode(const aix::Tensor& newTokens, const std::vector<size_t>& lengths,
+                       const std::vector<KVCache*>& caches) const
+    {
+        if (newTokens.shape().size() != 2)
+        {
+            throw std::invalid_argument("Input tokens must have {batch, seq} shape.");
+        }
+
+        auto batchSize = newTokens.shape()[0];
+        auto seqLen    = newTokens.shape()[1];
+        if (lengths.size() != batchSize || caches.size() != batchSize)
+        {
+            throw std::invalid_argument("Number of sequence lengths and caches must be equal to the batch size.");
+        }
+
+        // Position of each token in its own sequence. Padding tokens use the position zero.
+        std::vector<int32_t> positions(batchSize * seqLen, 0);
+        for (size_t i=0; i<batchSize; ++i)
+        {
+            if (lengths[i] == 0 || lengths[i] > seqLen)
+            {
+                throw std::invalid_argument("Sequence length must be between one and the input length.");
+            }
+            if (caches[i]->numLayers() != m_numLayers * m_tensorParallel)
+            {
+                throw std::invalid_argument("KV cache must have the same number of layers as the model.");
+            }
+            for (size_t j=0; j<lengths[i]; ++j)
+            {
+                positions[i * seqLen + j] = static_cast<int32_t>(caches[i]->size() + j);
+            }
+        }
+
+        // Text and positional embeddings.
+        auto range = aix::Tensor(positions.data(), positions.size(), aix::DataType::kInt32,
+                                 aix::Shape{positions.size()},
+                                 aix::dtype(aix::DataType::kInt32).device(newTokens.device()));
+        aix::Tensor x;
+        {
+            ProfileScope scope("embeddings", "module", newTokens.device());
+            x = scope.output(m_wte.forward(newTokens.reshape({batchSize * seqLen})) + m_wpe.forward(range));
+        }
+
+        // Transformer decoder stack.
+        if (m_stageThreads.empty() || batchSize == 1)
+        {
+            for (size_t s=0; s<m_stageDevices.size(); ++s)
+            {
+                if (m_stageDevices[s] && x.device() != m_stageDevices[s]) x = transferTo(x, m_stageDevices[s]);
+                x = runStage(s, x, caches, lengths);       // {batch*seq, embd}
+            }
+            if (x.device() != newTokens.device()) x = transferTo(x, newTokens.device());
+        }
+        else
+        {
+            x = runPipeline(x, caches, lengths, seqLen);
+        }
+
+        // All layers cached the keys and values of the new tokens.
+        for (size_t i=0; i<batchSize; ++i)
+        {
+            caches[i]->advance(lengths[i]);
+        }
+
+        return x;
+    }
+
+    // Runs the layers of a pipeline stage. The intermediates of each layer are allocated from a workspace frame of
+    // the stage that is reused two layers later and in the next steps.
+    aix::Tensor runStage(size_t stage, aix::Tensor x, const std::vector<KVCache*>& caches,
+                         const std::vector<size_t>& lengths) const
+    {
+        for (size_t i=m_stageLayers[stage]; i<m_stageLayers[stage + 1]; ++i)
+        {
+            // The layers of a tensor-parallel block use consecutive cache layers, one for each device.
+            // The weights of a streamed layer must be in its slot before it runs.
+            Workspace::FrameScope frame(m_workspaces[stage], i);
+            auto streamIndex = m_streamIndices[i];
+            if (streamIndex != kNotStreamed)
+            {
+                if (!m_streamer)
+                {
+                    throw std::logic_error("Streamed layers need a checkpoint to stream from.");
+                }
+                m_streamer->acquire(streamIndex);
+            }
+            x = m_transformerBlocks[m_layerBlocks[i]].forward(x, caches, lengths, i);       // {batch*seq, embd}
+            if (streamIndex != kNotStreamed) m_streamer->release(streamIndex);
+        }
+        return x;
+    }
+
+    // Runs the stages on a batch split into micro-batches. A stage processes a micro-batch once the previous stage
+    // finished it, so the stages work on different micro-batches at the same time. The outputs of a stage are copied
+    // to the next stage, since the workspace frames of the stage are reused by its next micro-batch.
+    aix::Tensor runPipeline(const aix::Tensor& x, const std::vector<KVCache*>& caches,
+                            const std::vector<size_t>& lengths, size_t seqLen) const
+    {
+        auto batchSize = caches.size();
+        auto numMicroBatches = std::min(m_numMicroBatches, batchSize);
+        auto microBatches = splitRange(batchSize, numMicroBatches, 1);
+
+        // The blocks of all layers are allocated before the stages append to the caches concurrently.
+        for (size_t i=0; i<batchSize; ++i) caches[i]->reserve(caches[i]->size() + lengths[i]);
+
+        auto inputDevice = x.device();
+        std::vector<std::shared_future<aix::Tensor>> outputs;
+        for (const auto& [begin, end] : microBatches)
+        {
+            std::vector<KVCache*> mbCaches(caches.begin() + static_cast<ssize_t>(begin),
+                                           caches.begin() + static_cast<ssize_t>(end));
+            std::vector<size_t> mbLengths(lengths.begin() + static_cast<ssize_t>(begin),
+                                          lengths.begin() + static_cast<ssize_t>(end));
+
+            // Rows of the micro-batch. ( {mb*seq, embd} )
+            std::vector<int32_t> rows((end - begin) * seqLen);
+            for (size_t i=0; i<rows.size(); ++i) rows[i] = static_cast<int32_t>(begin * seqLen + i);
+            auto indices = aix::Tensor(rows.data(), rows.size(), aix::DataType::kInt32, aix::Shape{rows.size()},
+                                       aix::dtype(aix::DataType::kInt32).device(inputDevice));
+            auto input = x.indexSelect(0, indices);
+            if (inputDevice != m_stageDevices[0]) input = transferTo(input, m_stageDevices[0]);
+
+            // Each stage waits for the output of the previous stage. The first stage starts with the inputs.
+            std::shared_future<aix::Tensor> output;
+            for (size_t s=0; s<m_stageDevices.size(); ++s)
+            {
+                auto next = s + 1 < m_stageDevices.size() ? m_stageDevices[s + 1] : inputDevice;
+                output = m_stageThreads[s]->submit([this, s, input, output, next, mbCaches, mbLengths]()
+                {
+                    return transferTo(runStage(s, output.valid() ? output.get() : input, mbCaches, mbLengths), next);
+                }).share();
+            }
+            outputs.emplace_back(output);
+        }
+
+        // Merge micro-batches.
+        std::vector<aix::Tensor> results;
+        for (auto& output : outputs) results.emplace_back(output.get());
+        return aix::vstack(results);          // [mb, mb*seq, embd] --> {batch*seq, embd}
+    }
+
+    // Projection to vocabulary. The final layer normalization is specific to the GPT2 architecture.
+    // It is not present in the original GPT and Transformer papers.
+    // NOTE: Softmax is not applied at the end, so the outputs will be logits instead of probabilities.
+    aix::Tensor projectToVocab(const aix::Tensor& x) const
+    {
+        aix::Tensor h;
+        {
+            ProfileScope scope("ln_f", "module", x.device());
+            h = scope.output(m_layerNorm.forward(x));
+        }
+        ProfileScope scope("lm_head", "module", x.device());
+        return scope.output(m_wte.project(h));       // {rows, embd} --> {rows, vocab}
+    }
+
+    size_t      m_ctxSize{0};
+    size_t      m_embdDim{0};
     size_t      m_numLayers{0};
+    size_t      m_prefillChunkSize{256};
+    size_t      m_tensorParallel{1};
+    size_t      m_numMicroBatches{1};
+    std::vector<size_t>  m_stageLayers{0, 0};           // Layers [m_stageLayers[s], m_stageLayers[s + 1]) of stages.
+    std::vector<aix::Device*>  m_stageDevices{nullptr}; // First device of each stage. Null if the model is not sharded.
+    // Workspace of each stage. Shared by the forward passes, so they must not run concurrently.
+    mutable std::vector<Workspace>  m_workspaces = std::vector<Workspace>(1);
+    std::vector<std::unique_ptr<ThreadPool>>  m_stageThreads;     // Thread of each stage, if there are many stages.
     Embeddings  m_wpe;
     Embeddings  m_wte;
     LayerNorm   m_layerNorm;
-    std::vector<TransformerBlock>  m_transformerBlocks;
+    std::vector<TransformerBlock>  m_transformerBlocks;     // Pinned layers followed by the stream slots.
+    std::vector<size_t>  m_layerBlocks;         // Block of each layer. The streamed layers use their slots.
+    std::vector<size_t>  m_streamIndices;       // Order of each streamed layer, or kNotStreamed.
+    std::unique_ptr<LayerStreamer>  m_streamer;         // Destroyed first, since it writes into the slots.
 };
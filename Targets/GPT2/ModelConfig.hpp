@@ -0,0 +1,58 @@
+//
+//  Copyright © 2024-Present, Arkin Terli. All rights reserved.
+//
+//  NOTICE:  All information contained herein is, and remains the property of Arkin Terli.
+//  The intellectual and technical concepts contained herein are proprietary to Arkin Terli
+//  and may be covered by U.S. and Foreign Patents, patents in process, and are protected by
+//  trade secret or copyright law. Dissemination of this information or reproduction of this
+//  material is strictly forbidden unless prior written permission is obtained from Arkin Terli.
+
+#pragma once
+
+// Project includes
+// External includes
+// System includes
+#include <stdexcept>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+
+enum class ModelConfigType : size_t
+{
+    OPENAI_124M  = 0,
+    OPENAI_355M  = 1,
+    OPENAI_774M  = 2,
+    OPENAI_1558M = 3,
+};
+
+inline ModelConfigType parseModelType(const std::string& type)
+{
+    if (type == "124M")         return ModelConfigType::OPENAI_124M;
+    else if (type == "355M")    return ModelConfigType::OPENAI_355M;
+    else if (type == "774M")    return ModelConfigType::OPENAI_774M;
+    else if (type == "1558M")   return ModelConfigType::OPENAI_1558M;
+    throw std::invalid_argument("Unknown model type: " + type);
+}
+
+// GPT2 model parameters.
+// nVocab : Number of tokens in our vocabulary.
+// nCtx   : Maximum possible token sequence length for the input.
+// nEmbd  : Embedding dimension (determines the "width" of the network).
+// nHeads : Number of attention heads (embedding dimension must be divisible by heads).
+// nLayers: Number of layers (determines the "depth" of the network).
+inline const std::vector<std::unordered_map<std::string, size_t>>  modelParams
+{
+    { {"nVocab", 50257}, {"nCtx", 1024}, {"nEmbd",  768}, {"nHeads", 12}, {"nLayers", 12}, },   // 124M
+    { {"nVocab", 50257}, {"nCtx", 1024}, {"nEmbd", 1024}, {"nHeads", 16}, {"nLayers", 24}, },   // 355M
+    { {"nVocab", 50257}, {"nCtx", 1024}, {"nEmbd", 1280}, {"nHeads", 20}, {"nLayers", 36}, },   // 774M
+    { {"nVocab", 50257}, {"nCtx", 1024}, {"nEmbd", 1600}, {"nHeads", 25}, {"nLayers", 48}, },   // 1558M
+};
+
+inline const std::vector<std::string> modelWeightsFilenames =
+{
+    "Resources/GPT2/oaiWeights124M.bin",   // 124M parameters.
+    "Resources/GPT2/oaiWeights355M.bin",   // 355M parameters.
+    "Resources/GPT2/oaiWeights774M.bin",   // 774M parameters.
+    "Resources/GPT2/oaiWeights1558M.bin",  // 1558M parameters.
+};
@@ -0,0 +1,210 @@
+//
+//  Copyright © 2024-Present, Arkin Terli. All rights reserved.
+//
+//  NOTICE:  All information contained herein is, and remains the property of Arkin Terli.
+//  The intellectual and technical concepts contained herein are proprietary to Arkin Terli
+//  and may be covered by U.S. and Foreign Patents, patents in process, and are protected by
+//  trade secret or copyright law. Dissemination of this information or reproduction of this
+//  material is strictly forbidden unless prior written permission is obtained from Arkin Terli.
+
+#pragma once
+
+// Project includes
+#include "KVCache.hpp"
+// External includes
+// System includes
+#include <algorithm>
+#include <cstdint>
+#include <memory>
+#include <set>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+
+// PrefixCache keeps the KV blocks of the processed prompts, so a new sequence that starts with the same tokens only
+// prefills its unique suffix. It is a radix tree where each node is a full KV block, and the children of a node are
+// keyed by the hash of their block tokens. A path from the root is a token prefix of blockSize * depth tokens.
+// The cache holds a reference to each of its blocks. The least recently used leaves are evicted when the pool needs
+// free blocks, unless a running sequence still uses their blocks. The leaves are kept in the order of their last use,
+// so an eviction does not scan the tree.
+class PrefixCache
+{
+public:
+    // Constructor.
+    explicit PrefixCache(KVBlockPool& pool) : m_pool{pool}
+    {
+    }
+
+    // Destructor.
+    ~PrefixCache()
+    {
+        clear();
+    }
+
+    PrefixCache(const PrefixCache&) = delete;
+    PrefixCache& operator=(const PrefixCache&) = delete;
+
+    // Returns the cached blocks of the longest prefix of the tokens. At least one token is left out of the prefix,
+    // since the last token must be processed to predict the next one.
+    std::vector<size_t> match(const std::vector<ssize_t>& tokenIds)
+    {
+        std::vector<size_t> blocks;
+        auto blockSize = m_pool.blockSize();
+        auto numBlocks = tokenIds.empty() ? 0 : (tokenIds.size() - 1) / blockSize;
+        auto node = &m_root;
+        for (size_t i=0; i<numBlocks; ++i)
+        {
+            node = node->find(tokenIds.begin() + static_cast<ssize_t>(i * blockSize), blockSize);
+            if (!node) break;
+            touch(node);
+            blocks.emplace_back(node->block);
+        }
+        return blocks;
+    }
+
+    // Adds the full blocks of the cached tokens. The tokens are all tokens in the cache.
+    void insert(const std::vector<ssize_t>& tokenIds, const KVCache& cache)
+    {
+        auto blockSize = m_pool.blockSize();
+        auto numBlocks = std::min(tokenIds.size(), cache.size()) / blockSize;
+        auto node = &m_root;
+        for (size_t i=0; i<numBlocks; ++i)
+        {
+            auto first = tokenIds.begin() + static_cast<ssize_t>(i * blockSize);
+            auto child = node->find(first, blockSize);
+            if (!child)
+            {
+                // The node is no longer a leaf after the new child.
+                if (node != &m_root && node->children.empty()) m_leaves.erase({node->lastUse, node});
+                auto block = cache.blockTable()[i];
+                m_pool.retain(block);
+                child = node->add(std::vector<ssize_t>(first, first + static_cast<ssize_t>(blockSize)), block);
+                ++m_numBlocks;
+            }
+            touch(child);
+            node = child;
+        }
+    }
+
+    // Evicts the least recently used blocks that are not used by any sequence, until the pool has the given number
+    // of free blocks. Returns false if there are not enough blocks to evict. The leaves that are skipped are the ones
+    // of the running sequences, which is at most one per sequence.
+    bool evict(size_t numFreeBlocks)
+    {
+        auto it = m_leaves.begin();
+        while (m_pool.numFreeBlocks() < numFreeBlocks)
+        {
+            while (it != m_leaves.end() && m_pool.refCount(it->second->block) != 1) ++it;
+            if (it == m_leaves.end()) return false;
+
+            // The parent becomes a leaf if this was its last child. It is ordered by its own last use, which may be
+            // before the skipped leaves, so the scan restarts.
+            auto lru = it->second;
+            auto parent = lru->parent;
+            m_leaves.erase(it);
+            m_pool.release(lru->block);
+            parent->remove(lru);
+            --m_numBlocks;
+            if (parent != &m_root && parent->children.empty())
+            {
+                m_leaves.emplace(parent->lastUse, parent);
+                it = m_leaves.begin();
+            }
+        }
+        return true;
+    }
+
+    // Releases all cached blocks.
+    void clear()
+    {
+        releaseAll(m_root);
+        m_root.children.clear();
+        m_leaves.clear();
+        m_numBlocks = 0;
+    }
+
+    // Returns the number of cached blocks.
+    size_t numBlocks() const    { return m_numBlocks; }
+
+private:
+    struct Node
+    {
+        std::vector<ssize_t> tokenIds;
+        size_t block{0};
+        uint64_t lastUse{0};
+        Node* parent{nullptr};
+        std::unordered_multimap<uint64_t, std::unique_ptr<Node>> children;
+
+        // Returns the child of the given block tokens. The tokens are compared, since the hashes may collide.
+        template<typename It>
+        Node* find(It first, size_t count)
+        {
+            auto range = children.equal_range(hashTokens(first, count));
+            for (auto it=range.first; it!=range.second; ++it)
+            {
+                auto& child = it->second;
+                if (std::equal(first, first + static_cast<ssize_t>(count), child->tokenIds.begin())) return child.get();
+            }
+            return nullptr;
+        }
+
+        Node* add(std::vector<ssize_t> blockTokenIds, size_t kvBlock)
+        {
+            auto node = std::make_unique<Node>();
+            auto hash = hashTokens(blockTokenIds.begin(), blockTokenIds.size());
+            node->tokenIds = std::move(blockTokenIds);
+            node->block = kvBlock;
+            node->parent = this;
+            return children.emplace(hash, std::move(node))->second.get();
+        }
+
+        void remove(const Node* child)
+        {
+            for (auto it=children.begin(); it!=children.end(); ++it)
+            {
+                if (it->second.get() == child)
+                {
+                    children.erase(it);
+                    return;
+                }
+            }
+        }
+    };
+
+    // FNV-1a hash of the block tokens.
+    template<typename It>
+    static uint64_t hashTokens(It first, size_t count)
+    {
+        uint64_t hash = 14695981039346656037ull;
+        for (size_t i=0; i<count; ++i, ++first)
+        {
+            hash = (hash ^ static_cast<uint64_t>(*first)) * 1099511628211ull;
+        }
+        return hash;
+    }
+
+    // Marks a node as used now, and moves it to the end of the leaves if it is a leaf.
+    void touch(Node* node)
+    {
+        bool leaf = node->children.empty();
+        if (leaf) m_leaves.erase({node->lastUse, node});
+        node->lastUse = ++m_clock;
+        if (leaf) m_leaves.emplace(node->lastUse, node);
+    }
+
+    void releaseAll(Node& node)
+    {
+        for (auto& [hash, child] : node.children)
+        {
+            releaseAll(*child);
+            m_pool.release(child->block);
+        }
+    }
+
+    KVBlockPool&  m_pool;
+    Node  m_root;
+    std::set<std::pair<uint64_t, Node*>>  m_leaves;     // Leaves in the order of their last use.
+    size_t  m_numBlocks{0};
+    uint64_t  m_clock{0};
+};
@@ -0,0 +1,271 @@
+//
+//  Copyright © 2024-Present, Arkin Terli. All rights reserved.
+//
+//  NOTICE:  All information contained herein is, and remains the property of Arkin Terli.
+//  The intellectual and technical concepts contained herein are proprietary to Arkin Terli
+//  and may be covered by U.S. and Foreign Patents, patents in process, and are protected by
+//  trade secret or copyright law. Dissemination of this information or reproduction of this
+//  material is strictly forbidden unless prior written permission is obtained from Arkin Terli.
+
+#pragma once
+
+// Project includes
+// External includes
+#include <aix.hpp>
+// System includes
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <fstream>
+#include <iomanip>
+#include <map>
+#include <mutex>
+#include <ostream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+
+// Profiler records the timed scopes of the forward passes, the device synchronizations and the tokenization. It is
+// disabled by default, and a disabled scope costs a single relaxed atomic load. When it is enabled, the module scopes
+// synchronize the device at their ends, so the time of a scope includes the device work it queued.
+// The allocated bytes of a scope are the bytes of the tensors it produced and of the workspace tensors it allocated.
+class Profiler
+{
+public:
+    struct Event
+    {
+        const char* name;
+        const char* category;
+        int64_t  startNs;
+        int64_t  durationNs;
+        uint32_t threadId;
+        int32_t  layer;             // Transformer layer, or -1.
+        size_t   bytes;
+    };
+
+    static Profiler& instance()
+    {
+        static Profiler profiler;
+        return profiler;
+    }
+
+    // Enables the profiling. It should be enabled before the profiled threads start.
+    static void enable()                    { s_enabled.store(true, std::memory_order_relaxed); }
+    static bool enabled()                   { return s_enabled.load(std::memory_order_relaxed); }
+
+    // Adds the bytes of a tensor allocated on this thread to the open scopes.
+    static void addAllocation(size_t bytes)         { if (enabled()) s_allocatedBytes += bytes; }
+    static size_t allocatedBytes()                  { return s_allocatedBytes; }
+
+    // Returns the nanoseconds since the profiler was created.
+    int64_t now() const
+    {
+        return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - m_start).count();
+    }
+
+    void record(const Event& event)
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_events.emplace_back(event);
+    }
+
+    // Returns a small id of the calling thread for the trace.
+    static uint32_t threadId()
+    {
+        static std::atomic<uint32_t> nextId{0};
+        static thread_local uint32_t id = nextId++;
+        return id;
+    }
+
+    // Writes a table of the total, self and mean times, and the allocated bytes of each scope name. The self time
+    // excludes the nested scopes, so the self times add up to the profiled time.
+    void writeSummary(std::ostream& out) const
+    {
+        struct Summary
+        {
+            size_t calls{0};
+            int64_t totalNs{0};
+            int64_t selfNs{0};
+            size_t bytes{0};
+        };
+
+        auto events = sortedEvents();
+        std::vector<int64_t> selfNs(events.size());
+        std::vector<size_t> open;           // Indices of the enclosing events of the same thread.
+        for (size_t i=0; i<events.size(); ++i)
+        {
+            const auto& event = events[i];
+            while (!open.empty() && (events[open.back()].threadId != event.threadId ||
+                                     end(events[open.back()]) <= event.startNs))
+            {
+                open.pop_back();
+            }
+            selfNs[i] = event.durationNs;
+            if (!open.empty()) selfNs[open.back()] -= event.durationNs;
+            open.emplace_back(i);
+        }
+
+        std::map<std::string, Summary> summaries;
+        int64_t profiledNs = 0;
+        for (size_t i=0; i<events.size(); ++i)
+        {
+            auto& summary = summaries[std::string(events[i].category) + "/" + events[i].name];
+            summary.calls++;
+            summary.totalNs += events[i].durationNs;
+            summary.selfNs  += selfNs[i];
+            summary.bytes   += events[i].bytes;
+            profiledNs += selfNs[i];
+        }
+
+        std::vector<std::pair<std::string, Summary>> rows(summaries.begin(), summaries.end());
+        std::sort(rows.begin(), rows.end(), [](const auto& a, const auto& b)
+        {
+            return a.second.selfNs > b.second.selfNs;
+        });
+
+        out << std::left << std::setw(28) << "Scope" << std::right << std::setw(10) << "Calls" << std::setw(12)
+            << "Total ms" << std::setw(12) << "Self ms" << std::setw(8) << "Self%" << std::setw(12) << "Mean us"
+            << std::setw(12) << "Alloc MB" << std::endl;
+        out << std::fixed << std::setprecision(3);
+        for (const auto& [name, summary] : rows)
+        {
+            out << std::left << std::setw(28) << name << std::right << std::setw(10) << summary.calls
+                << std::setw(12) << summary.totalNs / 1e6 << std::setw(12) << summary.selfNs / 1e6
+                << std::setw(8) << std::setprecision(1) << (profiledNs ? 100.0 * summary.selfNs / profiledNs : 0.0)
+                << std::setprecision(3) << std::setw(12) << summary.totalNs / 1e3 / summary.calls
+                << std::setw(12) << summary.bytes / 1e6 << std::endl;
+        }
+        out << std::defaultfloat;
+    }
+
+    // Writes the events in the Chrome trace event format, which chrome://tracing and Perfetto can open.
+    void writeChromeTrace(const std::string& filename) const
+    {
+        std::ofstream out(filename);
+        if (!out)
+        {
+            throw std::ios_base::failure("Failed to open the trace file: " + filename);
+        }
+
+        out << "{\"traceEvents\": [";
+        out << std::fixed << std::setprecision(3);
+        bool first = true;
+        for (const auto& event : sortedEvents())
+        {
+            out << (first ? "\n" : ",\n") << "{\"name\": \"" << event.name << "\", \"cat\": \"" << event.category
+                << "\", \"ph\": \"X\", \"ts\": " << event.startNs / 1e3 << ", \"dur\": " << event.durationNs / 1e3
+                << ", \"pid\": 0, \"tid\": " << event.threadId << ", \"args\": {\"bytes\": " << event.bytes;
+            if (event.layer >= 0) out << ", \"layer\": " << event.layer;
+            out << "}}";
+            first = false;
+        }
+        out << "\n]}\n";
+    }
+
+private:
+    Profiler() : m_start{std::chrono::steady_clock::now()}
+    {
+    }
+
+    static int64_t end(const Event& event)      { return event.startNs + event.durationNs; }
+
+    // Returns the events of each thread in the start order. An enclosing scope is ordered before its nested scopes.
+    std::vector<Event> sortedEvents() const
+    {
+        std::vector<Event> events;
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            events = m_events;
+        }
+        std::sort(events.begin(), events.end(), [](const Event& a, const Event& b)
+        {
+            if (a.threadId != b.threadId) return a.threadId < b.threadId;
+            if (a.startNs != b.startNs) return a.startNs < b.startNs;
+            return a.durationNs > b.durationNs;
+        });
+        return events;
+    }
+
+    std::chrono::steady_clock::time_point  m_start;
+    mutable std::mutex  m_mutex;
+    std::vector<Event>  m_events;
+    static inline std::atomic<bool>  s_enabled{false};
+    static inline thread_local size_t  s_allocatedBytes{0};
+};
+
+
+// ProfileScope records the time of a scope if the profiler is enabled. The scopes of the device work are given the
+// device, which is synchronized when the scope ends.
+class ProfileScope
+{
+public:
+    // Constructor.
+    explicit ProfileScope(const char* name, const char* category = "module", aix::Device* device = nullptr,
+                          int32_t layer = -1)
+        : m_active{Profiler::enabled()}
+    {
+        if (!m_active) return;
+        m_name = name;
+        m_category = category;
+        m_device = device;
+        m_layer = layer;
+        m_startBytes = Profiler::allocatedBytes();
+        m_startNs = Profiler::instance().now();
+    }
+
+    // Destructor.
+    ~ProfileScope()
+    {
+        if (!m_active) return;
+        if (m_device) m_device->synchronize();
+        auto& profiler = Profiler::instance();
+        profiler.record({m_name, m_category, m_startNs, profiler.now() - m_startNs, Profiler::threadId(), m_layer,
+                         Profiler::allocatedBytes() - m_startBytes});
+    }
+
+    ProfileScope(const ProfileScope&) = delete;
+    ProfileScope& operator=(const ProfileScope&) = delete;
+
+    // Adds the bytes of a tensor produced by the scope, and returns the tensor.
+    const aix::Tensor& output(const aix::Tensor& tensor)
+    {
+        if (m_active) Profiler::addAllocation(tensorBytes(tensor));
+        return tensor;
+    }
+
+    static size_t tensorBytes(const aix::Tensor& tensor)
+    {
+        size_t elementSize = 4;
+        switch (tensor.dataType())
+        {
+            case aix::DataType::kFloat16:
+            case aix::DataType::kBFloat16:  elementSize = 2;  break;
+            case aix::DataType::kInt64:     elementSize = 8;  break;
+            case aix::DataType::kInt8:
+            case aix::DataType::kUInt8:     elementSize = 1;  break;
+            default:                        break;
+        }
+        size_t numElements = 1;
+        for (auto dim : tensor.shape()) numElements *= dim;
+        return numElements * elementSize;
+    }
+
+private:
+    bool  m_active{false};
+    const char*  m_name{nullptr};
+    const char*  m_category{nullptr};
+    aix::Device*  m_device{nullptr};
+    int32_t  m_layer{-1};
+    size_t  m_startBytes{0};
+    int64_t  m_startNs{0};
+};
+
+
+// Synchronizes the device, and records the time of the synchronization.
+inline void synchronizeDevice(aix::Device* device)
+{
+    ProfileScope scope("synchronize", "sync");
+    device->synchronize();
+}
@@ -0,0 +1,228 @@
+//
+//  Copyright © 2024-Present, Arkin Terli. All rights reserved.
+//
+//  NOTICE:  All information contained herein is, and remains the property of Arkin Terli.
+//  The intellectual and technical concepts contained herein are proprietary to Arkin Terli
+//  and may be covered by U.S. and Foreign Patents, patents in process, and are protected by
+//  trade secret or copyright law. Dissemination of this information or reproduction of this
+//  material is strictly forbidden unless prior written permission is obtained from Arkin Terli.
+
+#pragma once
+
+// Project includes
+#include "Profiler.hpp"
+// External includes
+#include <aix.hpp>
+// System includes
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <numeric>
+#include <random>
+#include <stdexcept>
+#include <vector>
+
+
+struct SamplingConfig
+{
+    float temperature{0};               // Zero: greedy decoding, the highest logit is selected.
+    size_t topK{0};                     // Only the top k tokens are sampled. Zero: all tokens.
+    float topP{1};                      // Only the smallest set of tokens with the total probability p is sampled.
+    float repetitionPenalty{1};         // The logits of the prompt and generated tokens are penalized. One: none.
+    uint64_t seed{0};                   // Seed of the random numbers. Zero: a random seed.
+};
+
+
+// Sampler selects the next token of each sequence from the logits of its last token.
+// The greedy decoding without a repetition penalty runs argmax on the device, so only the selected token ids are read
+// back. Otherwise, the logits are read in place after the synchronization, since the device memory is shared with the
+// host on Apple Silicon. The top-k tokens are selected with a partial selection, and only the candidates are sorted
+// for top-p, so a step does not sort the whole vocabulary.
+class Sampler
+{
+public:
+    // Constructor.
+    explicit Sampler(const SamplingConfig& config = {}) : m_config{config}
+    {
+        if (config.temperature < 0 || config.topP <= 0 || config.topP > 1 || config.repetitionPenalty <= 0)
+        {
+            throw std::invalid_argument("Invalid sampling parameters.");
+        }
+        m_rng.seed(config.seed != 0 ? config.seed : std::random_device{}());
+    }
+
+    // Selects a token for each row of logits{batch, vocab}. histories[i] are the tokens of the sequence i that are
+    // penalized by the repetition penalty. Synchronizes the device.
+    std::vector<ssize_t> sample(const aix::Tensor& logits, const std::vector<const std::vector<ssize_t>*>& histories,
+                                aix::Device* device)
+    {
+        auto batchSize = logits.shape()[0];
+        if (histories.size() != batchSize)
+        {
+            throw std::invalid_argument("Number of histories must be equal to the batch size.");
+        }
+
+        std::vector<ssize_t> tokenIds(batchSize);
+        if (onDevice())
+        {
+            std::vector<aix::Tensor> tokenTensors;
+            for (size_t i=0; i<batchSize; ++i)
+            {
+                tokenTensors.emplace_back(aix::argmax(logits[static_cast<ssize_t>(i)]));
+            }
+
+            // Synchronize to read data on the CPU.
+            synchronizeDevice(device);
+            for (size_t i=0; i<batchSize; ++i)
+            {
+                tokenIds[i] = tokenTensors[i].value().item<int32_t>();      // Argmax return type is int32_t.
+            }
+            return tokenIds;
+        }
+
+        synchronizeDevice(device);
+        auto vocabSize = logits.shape()[1];
+        const auto* data = logits.value().data<float>();
+        for (size_t i=0; i<batchSize; ++i)
+        {
+            tokenIds[i] = sample(data + i * vocabSize, vocabSize, *histories[i]);
+        }
+        return tokenIds;
+    }
+
+    // Selects a token from a row of logits on the host.
+    ssize_t sample(const float* logits, size_t vocabSize, const std::vector<ssize_t>& history)
+    {
+        applyPenalty(logits, vocabSize, history);
+        if (m_config.temperature == 0)
+        {
+            return std::max_element(m_scores.begin(), m_scores.end()) - m_scores.begin();
+        }
+
+        auto total = selectCandidates();
+        return m_candidates[drawIndex(m_probs, total)];
+    }
+
+    // Returns the normalized probabilities{vocab} that sample() selects the tokens with. The greedy decoding selects
+    // the highest logit with the probability one.
+    void probabilities(const float* logits, size_t vocabSize, const std::vector<ssize_t>& history,
+                       std::vector<float>& probs)
+    {
+        applyPenalty(logits, vocabSize, history);
+        probs.assign(vocabSize, 0);
+        if (m_config.temperature == 0)
+        {
+            probs[std::max_element(m_scores.begin(), m_scores.end()) - m_scores.begin()] = 1;
+            return;
+        }
+
+        auto total = selectCandidates();
+        for (size_t i=0; i<m_candidates.size(); ++i)
+        {
+            probs[m_candidates[i]] = static_cast<float>(m_probs[i] / total);
+        }
+    }
+
+    // Draws an index from the non-negative weights that do not need to be normalized.
+    template<typename T>
+    size_t draw(const std::vector<T>& weights)
+    {
+        return drawIndex(weights, std::accumulate(weights.begin(), weights.end(), 0.0));
+    }
+
+    // Returns a uniform random number in [0, 1).
+    double uniform()
+    {
+        return std::uniform_real_distribution<double>(0, 1)(m_rng);
+    }
+
+    // Returns true if the selection does not need the logits on the host.
+    bool onDevice() const
+    {
+        return m_config.temperature == 0 && m_config.repetitionPenalty == 1;
+    }
+
+    const SamplingConfig& config() const    { return m_config; }
+
+private:
+    // Copies the logits into the scores. The repetition penalty is applied once for each distinct token.
+    // ( CTRL, Keskar et al., 2019 )
+    void applyPenalty(const float* logits, size_t vocabSize, const std::vector<ssize_t>& history)
+    {
+        m_scores.assign(logits, logits + vocabSize);
+        if (m_config.repetitionPenalty == 1) return;
+
+        m_penalized.assign(vocabSize, false);
+        for (auto tokenId : history)
+        {
+            if (tokenId < 0 || static_cast<size_t>(tokenId) >= vocabSize || m_penalized[tokenId]) continue;
+            m_penalized[tokenId] = true;
+            auto& score = m_scores[tokenId];
+            score = score > 0 ? score / m_config.repetitionPenalty : score * m_config.repetitionPenalty;
+        }
+    }
+
+    // Selects the top-k and top-p candidates of the scores, and computes their unnormalized probabilities with the
+    // temperature. Returns the total probability of the candidates.
+    double selectCandidates()
+    {
+        auto vocabSize = m_scores.size();
+        auto byScore = [this](int32_t a, int32_t b) { return m_scores[a] > m_scores[b]; };
+        m_candidates.resize(vocabSize);
+        std::iota(m_candidates.begin(), m_candidates.end(), 0);
+        if (m_config.topK > 0 && m_config.topK < vocabSize)
+        {
+            std::nth_element(m_candidates.begin(), m_candidates.begin() + m_config.topK, m_candidates.end(), byScore);
+            m_candidates.resize(m_config.topK);
+        }
+
+        // Softmax with temperature over the candidates. The probabilities are not normalized.
+        auto maxScore = m_scores[*std::min_element(m_candidates.begin(), m_candidates.end(), byScore)];  // First.
+        m_probs.resize(m_candidates.size());
+        for (size_t i=0; i<m_candidates.size(); ++i)
+        {
+            m_probs[i] = std::exp((m_scores[m_candidates[i]] - maxScore) / m_config.temperature);
+        }
+        double total = std::accumulate(m_probs.begin(), m_probs.end(), 0.0);
+        if (m_config.topP == 1) return total;
+
+        // Nucleus sampling keeps the most probable candidates until their total probability reaches top-p.
+        std::vector<size_t> order(m_candidates.size());
+        std::iota(order.begin(), order.end(), 0);
+        std::sort(order.begin(), order.end(), [this](size_t a, size_t b) { return m_probs[a] > m_probs[b]; });
+
+        std::vector<int32_t> candidates;
+        std::vector<double> probs;
+        double nucleus = 0;
+        for (auto i : order)
+        {
+            candidates.emplace_back(m_candidates[i]);
+            probs.emplace_back(m_probs[i]);
+            nucleus += m_probs[i];
+            if (nucleus >= m_config.topP * total) break;
+        }
+        m_candidates = std::move(candidates);
+        m_probs = std::move(probs);
+        return nucleus;
+    }
+
+    template<typename T>
+    size_t drawIndex(const std::vector<T>& weights, double total)
+    {
+        auto threshold = std::uniform_real_distribution<double>(0, total)(m_rng);
+        double cumulative = 0;
+        for (size_t i=0; i<weights.size(); ++i)
+        {
+            cumulative += weights[i];
+            if (threshold < cumulative) return i;
+        }
+        return weights.size() - 1;
+    }
+
+    SamplingConfig  m_config;
+    std::mt19937_64  m_rng;
+    std::vector<float>  m_scores;
+    std::vector<bool>  m_penalized;
+    std::vector<int32_t>  m_candidates;
+    std::vector<double>  m_probs;
+};
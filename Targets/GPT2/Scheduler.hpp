@@ -0,0 +1,363 @@
+//
+//  Copyright © 2024-Present, Arkin Terli. All rights reserved.
+//
+//  NOTICE:  All information contained herein is, and remains the property of Arkin Terli.
+//  The intellectual and technical concepts contained herein are proprietary to Arkin Terli
+//  and may be covered by U.S. and Foreign Patents, patents in process, and are protected by
+//  trade secret or copyright law. Dissemination of this information or reproduction of this
+//  material is strictly forbidden unless prior written permission is obtained from Arkin Terli.
+
+#pragma once
+
+// Project includes
+#include "KVCache.hpp"
+#include "Model.hpp"
+#include "PrefixCache.hpp"
+#include "Sampler.hpp"
+// External includes
+#include <aix.hpp>
+// System includes
+#include <algorithm>
+#include <deque>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+
+struct GenerationRequest
+{
+    std::string id;
+    std::vector<ssize_t> promptTokenIds;
+    size_t maxNewTokens{0};
+};
+
+struct GenerationResult
+{
+    std::string id;
+    std::vector<ssize_t> tokenIds;      // Generated tokens only, the prompt is not included.
+    std::string finishReason;           // "length": max new tokens, context or KV cache full. "stop": end-of-text.
+};
+
+struct SchedulerConfig
+{
+    size_t maxBatchSize{8};             // Maximum number of sequences in a running batch.
+    size_t maxBatchTokens{2048};        // Maximum number of tokens, including padding, processed in a single step.
+    size_t ctxSize{1024};               // Maximum sequence length of the model.
+    size_t kvBlockSize{16};             // Number of tokens in a KV cache block.
+    size_t numKVBlocks{0};              // Number of KV cache blocks. Zero: full context size for all slots.
+    ssize_t endOfTextTokenId{50256};    // Generation of a sequence stops after this token.
+    SamplingConfig sampling;            // Selection of the next tokens. The default is greedy decoding.
+    bool prefixCaching{true};           // Reuses the KV blocks of the prompt prefixes of the earlier requests.
+};
+
+
+// Scheduler implements continuous batching. The running batch has a fixed number of slots, and each slot owns the
+// KV cache of its sequence. New requests are admitted into free slots as soon as earlier sequences finish and the KV
+// block pool has enough free blocks for their prompts. Each step runs either a prefill batch of the newly admitted
+// prompts or a decode batch of the running sequences. If the running sequences run out of KV blocks, the most
+// recently admitted one is preempted and recomputed later.
+// The full KV blocks of the prefilled prompts are kept in a prefix cache, so a new request that starts with the same
+// tokens, i.e. a common system prompt, only prefills its unique suffix. The unused cached blocks are evicted before
+// any sequence is preempted.
+// The long prompts are prefilled in chunks of the model's prefill chunk size, and the prefill steps alternate with
+// the decode steps, so a long prompt does not stall the running sequences.
+class Scheduler
+{
+public:
+    // Constructor.
+    Scheduler(const GPT2& model, std::unique_ptr<aix::Device>& device, const SchedulerConfig& config)
+        : m_model{model}, m_device{device}, m_config{config},
+          m_pool{model.createKVPool(config.kvBlockSize, numKVBlocks(config), device.get())},
+          m_prefixCache{m_pool},
+          m_slots(config.maxBatchSize), m_sampler{config.sampling}
+    {
+        if (config.maxBatchSize == 0 || config.maxBatchTokens == 0)
+        {
+            throw std::invalid_argument("Scheduler batch size and token budget must be greater than zero.");
+        }
+    }
+
+    // Queues a request. It will be admitted into the running batch when a slot is available.
+    void submit(GenerationRequest request)
+    {
+        if (request.promptTokenIds.empty())
+        {
+            throw std::invalid_argument("Prompt of the request " + request.id + " is empty.");
+        }
+        if (request.promptTokenIds.size() >= m_config.ctxSize)
+        {
+            throw std::invalid_argument("Prompt of the request " + request.id + " exceeds the context size.");
+        }
+        if (m_pool.blocksFor(request.promptTokenIds.size() + 1) > m_pool.numBlocks())
+        {
+            throw std::invalid_argument("Prompt of the request " + request.id + " exceeds the KV cache size.");
+        }
+        if (request.maxNewTokens == 0) request.maxNewTokens = m_config.ctxSize;
+
+        auto sequence = std::make_unique<Sequence>();
+        sequence->newTokenIds = request.promptTokenIds;
+        sequence->request = std::move(request);
+        m_waiting.emplace_back(std::move(sequence));
+    }
+
+    // Returns true if there is no waiting or running request.
+    bool idle() const
+    {
+        auto isUsed = [](const auto& slot) { return slot != nullptr; };
+        return m_waiting.empty() && std::none_of(m_slots.begin(), m_slots.end(), isUsed);
+    }
+
+    // Runs a single scheduling step and returns the requests that finished in this step.
+    std::vector<GenerationResult> step()
+    {
+        admit();
+
+        // Prefill is preferred to let the new requests join the decode batch as early as possible, but a prefill step
+        // is followed by a decode step if there are running sequences.
+        std::vector<size_t> batch;
+        if (!m_lastStepPrefill) batch = selectPrefillBatch();
+        if (batch.empty())
+        {
+            reserveDecodeBlocks();
+            batch = selectDecodeBatch();
+        }
+        if (batch.empty()) batch = selectPrefillBatch();
+        if (batch.empty()) return {};
+
+        m_lastStepPrefill = !m_slots[batch.front()]->prefilled;
+        return run(batch);
+    }
+
+private:
+    struct Sequence
+    {
+        GenerationRequest request;
+        KVCache cache;
+        std::vector<ssize_t> newTokenIds;       // Tokens that will be processed in the next step.
+        std::vector<ssize_t> generatedTokenIds;
+        size_t admissionOrder{0};
+        bool prefilled{false};
+    };
+
+    static size_t numKVBlocks(const SchedulerConfig& config)
+    {
+        if (config.numKVBlocks > 0) return config.numKVBlocks;
+        return config.maxBatchSize * ((config.ctxSize + config.kvBlockSize - 1) / config.kvBlockSize);
+    }
+
+    // Returns the number of new tokens of a sequence processed in the next step.
+    size_t chunkLength(const Sequence& seq) const
+    {
+        return std::min({seq.newTokenIds.size(), m_model.prefillChunkSize(), m_config.maxBatchTokens});
+    }
+
+    // Returns the number of new blocks a sequence needs to process its new tokens.
+    size_t blocksNeeded(const Sequence& seq) const
+    {
+        auto required = m_pool.blocksFor(seq.cache.size() + seq.newTokenIds.size());
+        return required > seq.cache.blockTable().size() ? required - seq.cache.blockTable().size() : 0;
+    }
+
+    // Moves waiting requests into free slots as long as the free blocks are sufficient for the next step of all
+    // admitted sequences. The blocks of the whole prompt are allocated on admission, so the decode steps between its
+    // prefill chunks can not take them.
+    void admit()
+    {
+        size_t reserved = 0;
+        for (const auto& slot : m_slots)
+        {
+            if (slot) reserved += blocksNeeded(*slot);
+        }
+
+        for (auto& slot : m_slots)
+        {
+            if (m_waiting.empty()) break;
+            if (slot) continue;
+
+            // The cached prefix blocks are attached first, so they are not evicted for the new blocks.
+            auto& seq = m_waiting.front();
+            KVCache cache(m_pool);
+            if (m_config.prefixCaching) cache.attachPrefix(m_prefixCache.match(seq->newTokenIds));
+            auto needed = m_pool.blocksFor(seq->newTokenIds.size()) - cache.blockTable().size();
+            if (reserved + needed > m_pool.numFreeBlocks() && !m_prefixCache.evict(reserved + needed)) break;
+            cache.reserve(seq->newTokenIds.size());
+
+            // Only the tokens after the prefix are prefilled.
+            seq->newTokenIds.erase(seq->newTokenIds.begin(), seq->newTokenIds.begin() + cache.size());
+            seq->cache = std::move(cache);
+            seq->admissionOrder = m_numAdmissions++;
+            slot = std::move(seq);
+            m_waiting.pop_front();
+        }
+    }
+
+    // Allocates the blocks for the next decode step. Preempts the most recently admitted sequences if the pool runs
+    // out of blocks. A preempted sequence returns its blocks, and it is recomputed from its prompt and generated tokens
+    // when it is admitted again. The only sequence in the slots is never preempted. Its next step fits into the pool,
+    // since a sequence finishes when its next token does not.
+    void reserveDecodeBlocks()
+    {
+        while (true)
+        {
+            size_t needed = 0;
+            size_t numUsed = 0;
+            Sequence* latest = nullptr;
+            size_t latestSlot = 0;
+            for (size_t i=0; i<m_slots.size(); ++i)
+            {
+                if (!m_slots[i]) continue;
+                numUsed++;
+                if (m_slots[i]->prefilled) needed += blocksNeeded(*m_slots[i]);
+                if (!latest || m_slots[i]->admissionOrder > latest->admissionOrder)
+                {
+                    latest = m_slots[i].get();
+                    latestSlot = i;
+                }
+            }
+            if (needed <= m_pool.numFreeBlocks() || m_prefixCache.evict(needed) || numUsed <= 1) break;
+
+            auto& seq = m_slots[latestSlot];
+            seq->cache.clear();
+            seq->prefilled = false;
+            seq->newTokenIds = seq->request.promptTokenIds;
+            seq->newTokenIds.insert(seq->newTokenIds.end(), seq->generatedTokenIds.begin(),
+                                    seq->generatedTokenIds.end());
+            m_waiting.emplace_front(std::move(seq));
+        }
+    }
+
+    // Selects the sequences to prefill within the token budget. The prompt chunks are padded to the longest one.
+    std::vector<size_t> selectPrefillBatch() const
+    {
+        std::vector<size_t> batch;
+        size_t maxLen = 0;
+        for (size_t i=0; i<m_slots.size(); ++i)
+        {
+            if (!m_slots[i] || m_slots[i]->prefilled) continue;
+            auto len = std::max(maxLen, chunkLength(*m_slots[i]));
+            if (!batch.empty() && len * (batch.size() + 1) > m_config.maxBatchTokens) continue;
+            maxLen = len;
+            batch.emplace_back(i);
+        }
+        return batch;
+    }
+
+    // Selects the running sequences to decode within the token budget. Each sequence processes a single token.
+    std::vector<size_t> selectDecodeBatch() const
+    {
+        std::vector<size_t> batch;
+        for (size_t i=0; i<m_slots.size() && batch.size() < m_config.maxBatchTokens; ++i)
+        {
+            if (m_slots[i] && m_slots[i]->prefilled) batch.emplace_back(i);
+        }
+        return batch;
+    }
+
+    std::vector<GenerationResult> run(const std::vector<size_t>& batch)
+    {
+        // Padding tokens are ignored by the model. Any valid token id can be used.
+        constexpr ssize_t padTokenId = 0;
+
+        std::vector<size_t> lengths;
+        for (auto i : batch) lengths.emplace_back(chunkLength(*m_slots[i]));
+        auto seqLen = *std::max_element(lengths.begin(), lengths.end());
+
+        std::vector<ssize_t> batchTokenIds(batch.size() * seqLen, padTokenId);
+        std::vector<KVCache*> caches;
+        for (size_t b=0; b<batch.size(); ++b)
+        {
+            auto first = m_slots[batch[b]]->newTokenIds.begin();
+            std::copy(first, first + static_cast<ssize_t>(lengths[b]),
+                      batchTokenIds.begin() + static_cast<ssize_t>(b * seqLen));
+            caches.emplace_back(&m_slots[batch[b]]->cache);
+        }
+
+        auto inputs = aix::Tensor(batchTokenIds.data(), batchTokenIds.size(), aix::DataType::kInt64,
+                                  aix::Shape{batch.size(), seqLen}, aix::dtype(aix::DataType::kInt32)).to(m_device);
+
+        // Only the sequences that finish their prompts or decode predict their next tokens. The prompt chunks run
+        // through the decoder stack only, without the LM head and the sampling.
+        std::vector<size_t> predicted;
+        for (size_t b=0; b<batch.size(); ++b)
+        {
+            if (lengths[b] == m_slots[batch[b]]->newTokenIds.size()) predicted.emplace_back(b);
+        }
+
+        // The repetition penalty applies to the prompt and the generated tokens.
+        std::vector<std::vector<ssize_t>> histories(predicted.size());
+        std::vector<const std::vector<ssize_t>*> historyPtrs;
+        for (size_t p=0; p<predicted.size(); ++p)
+        {
+            const auto& seq = *m_slots[batch[predicted[p]]];
+            if (m_config.sampling.repetitionPenalty != 1)
+            {
+                histories[p] = seq.request.promptTokenIds;
+                histories[p].insert(histories[p].end(), seq.generatedTokenIds.begin(), seq.generatedTokenIds.end());
+            }
+            historyPtrs.emplace_back(&histories[p]);
+        }
+
+        // Predict the next token of each sequence from the logits of its last valid token.
+        auto logits = m_model.forwardLast(inputs, lengths, caches, predicted);      // {predicted, vocab}
+        std::vector<ssize_t> nextTokenIds(batch.size());
+        if (!predicted.empty())
+        {
+            auto sampled = m_sampler.sample(logits, historyPtrs, m_device.get());
+            for (size_t p=0; p<predicted.size(); ++p) nextTokenIds[predicted[p]] = sampled[p];
+        }
+
+        // The sampled tokens are read back, so the caches are flushed without waiting for the device. The blocks of
+        // a prompt must be written before they are shared by the prefix cache.
+        for (auto cache : caches) cache->flush();
+
+        std::vector<GenerationResult> results;
+        for (size_t b=0; b<batch.size(); ++b)
+        {
+            auto& slot = m_slots[batch[b]];
+            if (lengths[b] < slot->newTokenIds.size())
+            {
+                // A prompt chunk. The next token is predicted after the last chunk.
+                auto& tokenIds = slot->newTokenIds;
+                tokenIds.erase(tokenIds.begin(), tokenIds.begin() + static_cast<ssize_t>(lengths[b]));
+                continue;
+            }
+
+            auto nextTokenId = nextTokenIds[b];
+            if (!slot->prefilled && m_config.prefixCaching)
+            {
+                // The cache of a prefilled sequence has all its prompt and generated tokens.
+                auto tokenIds = slot->request.promptTokenIds;
+                tokenIds.insert(tokenIds.end(), slot->generatedTokenIds.begin(), slot->generatedTokenIds.end());
+                m_prefixCache.insert(tokenIds, slot->cache);
+            }
+            slot->prefilled = true;
+            slot->generatedTokenIds.emplace_back(nextTokenId);
+            slot->newTokenIds = {nextTokenId};
+
+            // The sequence also finishes if its next token does not fit into the whole pool, since it could never
+            // be admitted again after a preemption.
+            bool stop   = nextTokenId == m_config.endOfTextTokenId;
+            bool length = slot->generatedTokenIds.size() >= slot->request.maxNewTokens ||
+                          slot->cache.size() + 1 >= m_config.ctxSize ||
+                          m_pool.blocksFor(slot->cache.size() + 1) > m_pool.numBlocks();
+            if (stop || length)
+            {
+                results.push_back({slot->request.id, std::move(slot->generatedTokenIds), stop ? "stop" : "length"});
+                slot.reset();       // The slot is free for the next waiting request.
+            }
+        }
+        return results;
+    }
+
+    const GPT2&  m_model;
+    std::unique_ptr<aix::Device>&  m_device;
+    SchedulerConfig  m_config;
+    KVBlockPool  m_pool;
+    PrefixCache  m_prefixCache;
+    std::deque<std::unique_ptr<Sequence>>  m_waiting;
+    std::vector<std::unique_ptr<Sequence>>  m_slots;
+    size_t  m_numAdmissions{0};
+    bool  m_lastStepPrefill{false};
+    Sampler  m_sampler;
+};
@@ -0,0 +1,299 @@
+//
+//  Copyright © 2024-Present, Arkin Terli. All rights reserved.
+//
+//  NOTICE:  All information contained herein is, and remains the property of Arkin Terli.
+//  The intellectual and technical concepts contained herein are proprietary to Arkin Terli
+//  and may be covered by U.S. and Foreign Patents, patents in process, and are protected by
+//  trade secret or copyright law. Dissemination of this information or reproduction of this
+//  material is strictly forbidden unless prior written permission is obtained from Arkin Terli.
+
+#pragma once
+
+// Project includes
+#include "BPE.hpp"
+#include "Scheduler.hpp"
+// External includes
+// System includes
+#include <cctype>
+#include <condition_variable>
+#include <cstdio>
+#include <deque>
+#include <iostream>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <unordered_map>
+
+
+// JsonObject parses and formats flat JSON objects with string and number values, which is sufficient for the
+// JSON lines protocol of the server.
+class JsonObject
+{
+public:
+    static JsonObject parse(const std::string& text)
+    {
+        JsonObject obj;
+        size_t i = 0;
+        skipSpaces(text, i);
+        expect(text, i, '{');
+        skipSpaces(text, i);
+        if (i < text.size() && text[i] == '}') return obj;
+
+        while (true)
+        {
+            skipSpaces(text, i);
+            auto key = parseString(text, i);
+            skipSpaces(text, i);
+            expect(text, i, ':');
+            skipSpaces(text, i);
+            obj.m_values[key] = i < text.size() && text[i] == '"' ? parseString(text, i) : parseNumber(text, i);
+            skipSpaces(text, i);
+            if (i < text.size() && text[i] == ',') { ++i; continue; }
+            expect(text, i, '}');
+            break;
+        }
+        return obj;
+    }
+
+    bool contains(const std::string& key) const     { return m_values.contains(key); }
+
+    std::string getString(const std::string& key, const std::string& defaultValue = "") const
+    {
+        auto iter = m_values.find(key);
+        return iter != m_values.end() ? iter->second : defaultValue;
+    }
+
+    size_t getUInt(const std::string& key, size_t defaultValue = 0) const
+    {
+        auto iter = m_values.find(key);
+        return iter != m_values.end() ? std::stoul(iter->second) : defaultValue;
+    }
+
+    static std::string quote(const std::string& str)
+    {
+        std::string out = "\"";
+        for (char c : str)
+        {
+            switch (c)
+            {
+                case '"':  out += "\\\""; break;
+                case '\\': out += "\\\\"; break;
+                case '\n': out += "\\n";  break;
+                case '\r': out += "\\r";  break;
+                case '\t': out += "\\t";  break;
+                default:
+                    if (static_cast<unsigned char>(c) < 0x20)
+                    {
+                        char buffer[8];
+                        std::snprintf(buffer, sizeof(buffer), "\\u%04x", static_cast<unsigned>(c));
+                        out += buffer;
+                    }
+                    else
+                    {
+                        out.push_back(c);
+                    }
+            }
+        }
+        return out + "\"";
+    }
+
+private:
+    static void skipSpaces(const std::string& text, size_t& i)
+    {
+        while (i < text.size() && std::isspace(static_cast<unsigned char>(text[i]))) ++i;
+    }
+
+    static void expect(const std::string& text, size_t& i, char c)
+    {
+        if (i >= text.size() || text[i] != c)
+        {
+            throw std::invalid_argument(std::string("Invalid JSON. Expected '") + c + "'.");
+        }
+        ++i;
+    }
+
+    static std::string parseNumber(const std::string& text, size_t& i)
+    {
+        auto start = i;
+        while (i < text.size() && (std::isdigit(static_cast<unsigned char>(text[i])) || text[i] == '-' ||
+                                   text[i] == '+' || text[i] == '.' || text[i] == 'e' || text[i] == 'E')) ++i;
+        if (start == i) throw std::invalid_argument("Invalid JSON. Only string and number values are supported.");
+        return text.substr(start, i - start);
+    }
+
+    static std::string parseString(const std::string& text, size_t& i)
+    {
+        expect(text, i, '"');
+        std::string str;
+        while (i < text.size() && text[i] != '"')
+        {
+            char c = text[i++];
+            if (c != '\\')
+            {
+                str.push_back(c);
+                continue;
+            }
+            if (i >= text.size()) break;
+            c = text[i++];
+            switch (c)
+            {
+                case 'n': str.push_back('\n'); break;
+                case 'r': str.push_back('\r'); break;
+                case 't': str.push_back('\t'); break;
+                case 'b': str.push_back('\b'); break;
+                case 'f': str.push_back('\f'); break;
+                case 'u': appendUTF8(parseCodePoint(text, i), str); break;
+                default:  str.push_back(c); break;      // Quotation mark, reverse solidus and solidus.
+            }
+        }
+        expect(text, i, '"');
+        return str;
+    }
+
+    static uint32_t parseHex4(const std::string& text, size_t& i)
+    {
+        if (i + 4 > text.size()) throw std::invalid_argument("Invalid JSON unicode escape.");
+        auto value = static_cast<uint32_t>(std::stoul(text.substr(i, 4), nullptr, 16));
+        i += 4;
+        return value;
+    }
+
+    static uint32_t parseCodePoint(const std::string& text, size_t& i)
+    {
+        auto cp = parseHex4(text, i);
+        // Surrogate pairs encode the code points above the basic multilingual plane.
+        if (cp >= 0xd800 && cp <= 0xdbff && text.compare(i, 2, "\\u") == 0)
+        {
+            i += 2;
+            auto low = parseHex4(text, i);
+            cp = 0x10000 + ((cp - 0xd800) << 10) + (low - 0xdc00);
+        }
+        return cp;
+    }
+
+    static void appendUTF8(uint32_t cp, std::string& str)
+    {
+        if (cp <= 0x7f)
+        {
+            str.push_back(static_cast<char>(cp));
+        }
+        else if (cp <= 0x7ff)
+        {
+            str.push_back(static_cast<char>(0xc0 | (cp >> 6)));
+            str.push_back(static_cast<char>(0x80 | (cp & 0x3f)));
+        }
+        else if (cp <= 0xffff)
+        {
+            str.push_back(static_cast<char>(0xe0 | (cp >> 12)));
+            str.push_back(static_cast<char>(0x80 | ((cp >> 6) & 0x3f)));
+            str.push_back(static_cast<char>(0x80 | (cp & 0x3f)));
+        }
+        else
+        {
+            str.push_back(static_cast<char>(0xf0 | (cp >> 18)));
+            str.push_back(static_cast<char>(0x80 | ((cp >> 12) & 0x3f)));
+            str.push_back(static_cast<char>(0x80 | ((cp >> 6) & 0x3f)));
+            str.push_back(static_cast<char>(0x80 | (cp & 0x3f)));
+        }
+    }
+
+    std::unordered_map<std::string, std::string>  m_values;
+};
+
+
+// Server reads requests as JSON lines from stdin and writes a JSON line response to stdout for each finished one.
+// Request:  {"id": "1", "prompt": "Hello", "max_tokens": 32}
+// Response: {"id": "1", "text": "...", "tokens": 32, "finish_reason": "length"}
+// Errors:   {"id": "1", "error": "..."}
+// Requests are read on a separate thread, so they can join the running batch while the others are decoding.
+class Server
+{
+public:
+    // Constructor.
+    Server(Scheduler& scheduler, BPE& bpe) : m_scheduler{scheduler}, m_bpe{bpe}
+    {
+    }
+
+    // Serves requests until stdin is closed and all requests are finished.
+    void run()
+    {
+        std::thread reader([this]() { readRequests(); });
+
+        while (true)
+        {
+            std::deque<std::string> lines;
+            bool inputClosed = false;
+            {
+                std::unique_lock<std::mutex> lock(m_mutex);
+                // Wait for new requests only if there is nothing to compute.
+                m_cv.wait(lock, [&]() { return !m_lines.empty() || m_inputClosed || !m_scheduler.idle(); });
+                lines.swap(m_lines);
+                inputClosed = m_inputClosed;
+            }
+
+            for (const auto& line : lines)
+            {
+                submit(line);
+            }
+
+            if (m_scheduler.idle())
+            {
+                if (inputClosed) break;
+                continue;
+            }
+
+            for (const auto& result : m_scheduler.step())
+            {
+                std::cout << "{\"id\": " << JsonObject::quote(result.id)
+                          << ", \"text\": " << JsonObject::quote(m_bpe.decode(result.tokenIds))
+                          << ", \"tokens\": " << result.tokenIds.size()
+                          << ", \"finish_reason\": " << JsonObject::quote(result.finishReason) << "}" << std::endl;
+            }
+        }
+
+        reader.join();
+    }
+
+private:
+    void readRequests()
+    {
+        std::string line;
+        while (std::getline(std::cin, line))
+        {
+            if (line.empty()) continue;
+            std::lock_guard<std::mutex> lock(m_mutex);
+            m_lines.emplace_back(line);
+            m_cv.notify_one();
+        }
+
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_inputClosed = true;
+        m_cv.notify_one();
+    }
+
+    void submit(const std::string& line)
+    {
+        std::string id;
+        try
+        {
+            auto request = JsonObject::parse(line);
+            id = request.getString("id", std::to_string(m_numRequests));
+            m_scheduler.submit({id, m_bpe.encode(request.getString("prompt")), request.getUInt("max_tokens")});
+        }
+        catch (std::exception& e)
+        {
+            std::cout << "{\"id\": " << JsonObject::quote(id) << ", \"error\": " << JsonObject::quote(e.what()) << "}"
+                      << std::endl;
+        }
+        ++m_numRequests;
+    }
+
+    Scheduler&  m_scheduler;
+    BPE&        m_bpe;
+    size_t      m_numRequests{0};
+    std::mutex  m_mutex;
+    std::condition_variable   m_cv;
+    std::deque<std::string>   m_lines;
+    bool        m_inputClosed{false};
+};
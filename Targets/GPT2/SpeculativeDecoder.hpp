@@ -0,0 +1,180 @@
+//
+//  Copyright © 2024-Present, Arkin Terli. All rights reserved.
+//
+//  NOTICE:  All information contained herein is, and remains the property of Arkin Terli.
+//  The intellectual and technical concepts contained herein are proprietary to Arkin Terli
+//  and may be covered by U.S. and Foreign Patents, patents in process, and are protected by
+//  trade secret or copyright law. Dissemination of this information or reproduction of this
+//  material is strictly forbidden unless prior written permission is obtained from Arkin Terli.
+
+#pragma once
+
+// Project includes
+#include "KVCache.hpp"
+#include "Model.hpp"
+#include "Profiler.hpp"
+#include "Sampler.hpp"
+// External includes
+#include <aix.hpp>
+// System includes
+#include <algorithm>
+#include <functional>
+#include <memory>
+#include <stdexcept>
+#include <vector>
+
+
+struct SpeculativeStats
+{
+    size_t numSteps{0};                 // Number of the target model forward passes.
+    size_t numDraftTokens{0};
+    size_t numAcceptedTokens{0};
+};
+
+
+// SpeculativeDecoder generates with a large target model and a small draft model that share the same vocabulary.
+// In each step, the draft model proposes k tokens one by one, and the target model verifies all of them in a single
+// forward pass. A draft token d is accepted with the probability min(1, p(d) / q(d)), where p and q are the target
+// and draft distributions. The first rejected token is replaced by a token drawn from max(0, p - q), and if all draft
+// tokens are accepted, a bonus token is drawn from the last target distribution. The generated tokens have the same
+// distribution as sampling the target model alone, and the greedy decoding generates exactly the same tokens, since
+// both distributions are one-hot. ( Leviathan et al., 2023 and Chen et al., 2023 )
+// The rejected tokens are removed from both KV caches.
+class SpeculativeDecoder
+{
+public:
+    // Constructor.
+    SpeculativeDecoder(const GPT2& target, const GPT2& draft, size_t numDraftTokens)
+        : m_target{target}, m_draft{draft}, m_numDraftTokens{numDraftTokens}
+    {
+        if (numDraftTokens == 0)
+        {
+            throw std::invalid_argument("Number of draft tokens must be greater than zero.");
+        }
+        if (draft.ctxSize() < target.ctxSize())
+        {
+            throw std::invalid_argument("Draft model context size must not be less than the target model's.");
+        }
+    }
+
+    // Generates up to maxNewTokens tokens after the prompt, and returns the generated tokens. The generation stops at
+    // the context size of the target model. onToken is called with each new token as soon as it is accepted.
+    std::vector<ssize_t> generate(const std::vector<ssize_t>& promptTokenIds, size_t maxNewTokens,
+                                  std::unique_ptr<aix::Device>& device, const SamplingConfig& sampling = {},
+                                  const std::function<void(ssize_t)>& onToken = nullptr)
+    {
+        if (promptTokenIds.empty())
+        {
+            throw std::invalid_argument("Prompt cannot be empty.");
+        }
+
+        // Each model has its own cache. A single sequence needs enough blocks for the full context.
+        constexpr size_t kvBlockSize = 16;
+        auto ctxSize = m_target.ctxSize();
+        auto numBlocks = (ctxSize + kvBlockSize - 1) / kvBlockSize;
+        auto targetPool = m_target.createKVPool(kvBlockSize, numBlocks, device.get());
+        auto draftPool  = m_draft.createKVPool(kvBlockSize, numBlocks, device.get());
+        KVCache targetCache(targetPool);
+        KVCache draftCache(draftPool);
+        Sampler sampler(sampling);
+        m_stats = {};
+
+        // All prompt and accepted tokens. Each model processes the tokens that are not in its cache yet.
+        auto tokenIds = promptTokenIds;
+        std::vector<ssize_t> generatedTokenIds;
+        std::vector<std::vector<float>> draftProbs(m_numDraftTokens);
+        std::vector<float> targetProbs;
+        if (tokenIds.size() < ctxSize)
+        {
+            m_target.prefill(tokenIds, targetCache);
+            m_draft.prefill(tokenIds, draftCache);
+        }
+        while (generatedTokenIds.size() < maxNewTokens && tokenIds.size() < ctxSize)
+        {
+            // A step generates at most numDrafts + 1 tokens, which must fit into the limits.
+            auto numDrafts = std::min({m_numDraftTokens, ctxSize - tokenIds.size() - 1,
+                                       maxNewTokens - generatedTokenIds.size() - 1});
+
+            // The draft model proposes the tokens one by one. The repetition penalty also applies to the drafts.
+            auto history = tokenIds;
+            for (size_t i=0; i<numDrafts; ++i)
+            {
+                auto logits = forwardLast(m_draft, history, draftCache, 1, device);
+                synchronizeDevice(device.get());
+                sampler.probabilities(logits.value().data<float>(), logits.shape()[1], history, draftProbs[i]);
+                history.emplace_back(static_cast<ssize_t>(sampler.draw(draftProbs[i])));
+            }
+
+            // The target model verifies all drafts at once. The row i is the distribution of the token after the
+            // draft i, and the first row is the distribution of the first draft.
+            auto logits = forwardLast(m_target, history, targetCache, numDrafts + 1, device);
+            synchronizeDevice(device.get());
+            auto vocabSize = logits.shape()[1];
+            const auto* targetLogits = logits.value().data<float>();
+            m_stats.numSteps++;
+            m_stats.numDraftTokens += numDrafts;
+
+            size_t numAccepted = 0;
+            ssize_t nextTokenId = -1;
+            for (size_t i=0; i<=numDrafts; ++i)
+            {
+                auto prefix = std::vector<ssize_t>(history.begin(), history.begin() + tokenIds.size() + i);
+                sampler.probabilities(targetLogits + i * vocabSize, vocabSize, prefix, targetProbs);
+                if (i == numDrafts)
+                {
+                    nextTokenId = sampler.draw(targetProbs);        // Bonus token: all drafts are accepted.
+                    break;
+                }
+
+                auto draftTokenId = history[tokenIds.size() + i];
+                const auto& q = draftProbs[i];
+                if (sampler.uniform() * q[draftTokenId] < targetProbs[draftTokenId])
+                {
+                    ++numAccepted;
+                    continue;
+                }
+
+                // Rejected. The replacement is drawn from the residual distribution.
+                std::vector<float> residual(vocabSize);
+                for (size_t j=0; j<vocabSize; ++j) residual[j] = std::max(0.0f, targetProbs[j] - q[j]);
+                bool empty = std::all_of(residual.begin(), residual.end(), [](float p) { return p == 0; });
+                nextTokenId = sampler.draw(empty ? targetProbs : residual);
+                break;
+            }
+            m_stats.numAcceptedTokens += numAccepted;
+
+            // Keep the accepted drafts, and remove the rejected ones from the caches. The new token is processed in
+            // the next step.
+            history.resize(tokenIds.size() + numAccepted);
+            history.emplace_back(nextTokenId);
+            for (auto i=tokenIds.size(); i<history.size(); ++i)
+            {
+                generatedTokenIds.emplace_back(history[i]);
+                if (onToken) onToken(history[i]);
+            }
+            tokenIds = std::move(history);
+            targetCache.truncate(tokenIds.size() - 1);
+            draftCache.truncate(tokenIds.size() - 1);
+        }
+        return generatedTokenIds;
+    }
+
+    // Returns the statistics of the last generation.
+    const SpeculativeStats& stats() const   { return m_stats; }
+
+private:
+    // Processes the tokens that are not in the cache yet, and returns the logits of the last numRows tokens.
+    static aix::Tensor forwardLast(const GPT2& model, const std::vector<ssize_t>& tokenIds, KVCache& cache,
+                                   size_t numRows, std::unique_ptr<aix::Device>& device)
+    {
+        auto numNewTokens = tokenIds.size() - cache.size();
+        auto inputs = aix::Tensor(tokenIds.data() + cache.size(), numNewTokens, aix::DataType::kInt64,
+                                  aix::Shape{numNewTokens}, aix::dtype(aix::DataType::kInt32)).to(device);
+        return model.forwardLast(inputs, cache.size(), cache, numRows);
+    }
+
+    const GPT2&  m_target;
+    const GPT2&  m_draft;
+    size_t  m_numDraftTokens{0};
+    SpeculativeStats  m_stats;
+};
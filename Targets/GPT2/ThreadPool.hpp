@@ -0,0 +1,93 @@
+//
+//  Copyright © 2024-Present, Arkin Terli. All rights reserved.
+//
+//  NOTICE:  All information contained herein is, and remains the property of Arkin Terli.
+//  The intellectual and technical concepts contained herein are proprietary to Arkin Terli
+//  and may be covered by U.S. and Foreign Patents, patents in process, and are protected by
+//  trade secret or copyright law. Dissemination of this information or reproduction of this
+//  material is strictly forbidden unless prior written permission is obtained from Arkin Terli.
+
+#pragma once
+
+// Project includes
+// External includes
+// System includes
+#include <algorithm>
+#include <condition_variable>
+#include <functional>
+#include <future>
+#include <mutex>
+#include <queue>
+#include <thread>
+#include <utility>
+#include <vector>
+
+
+// ThreadPool runs the submitted tasks on a fixed number of worker threads in the submission order.
+class ThreadPool
+{
+public:
+    // Constructor. Zero threads uses the number of hardware threads.
+    explicit ThreadPool(size_t numThreads = 0)
+    {
+        if (numThreads == 0) numThreads = std::max(1u, std::thread::hardware_concurrency());
+        for (size_t i=0; i<numThreads; ++i)
+        {
+            m_workers.emplace_back([this] { workerLoop(); });
+        }
+    }
+
+    // Destructor. Waits for all submitted tasks to finish.
+    ~ThreadPool()
+    {
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            m_stop = true;
+        }
+        m_condition.notify_all();
+        for (auto& worker : m_workers) worker.join();
+    }
+
+    ThreadPool(const ThreadPool&) = delete;
+    ThreadPool& operator=(const ThreadPool&) = delete;
+
+    // Queues a task. The returned future provides the result, or rethrows the exception thrown by the task.
+    template<typename F>
+    auto submit(F&& task) -> std::future<decltype(task())>
+    {
+        using ReturnType = decltype(task());
+        auto packagedTask = std::make_shared<std::packaged_task<ReturnType()>>(std::forward<F>(task));
+        auto future = packagedTask->get_future();
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            m_tasks.emplace([packagedTask] { (*packagedTask)(); });
+        }
+        m_condition.notify_one();
+        return future;
+    }
+
+    size_t size() const     { return m_workers.size(); }
+
+private:
+    void workerLoop()
+    {
+        while (true)
+        {
+            std::function<void()> task;
+            {
+                std::unique_lock<std::mutex> lock(m_mutex);
+                m_condition.wait(lock, [this] { return m_stop || !m_tasks.empty(); });
+                if (m_stop && m_tasks.empty()) return;
+                task = std::move(m_tasks.front());
+                m_tasks.pop();
+            }
+            task();
+        }
+    }
+
+    std::vector<std::thread>  m_workers;
+    std::queue<std::function<void()>>  m_tasks;
+    std::mutex  m_mutex;
+    std::condition_variable  m_condition;
+    bool  m_stop{false};
+};
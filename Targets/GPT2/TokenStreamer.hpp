@@ -0,0 +1,80 @@
+//
+//  Copyright © 2024-Present, Arkin Terli. All rights reserved.
+//
+//  NOTICE:  All information contained herein is, and remains the property of Arkin Terli.
+//  The intellectual and technical concepts contained herein are proprietary to Arkin Terli
+//  and may be covered by U.S. and Foreign Patents, patents in process, and are protected by
+//  trade secret or copyright law. Dissemination of this information or reproduction of this
+//  material is strictly forbidden unless prior written permission is obtained from Arkin Terli.
+
+#pragma once
+
+// Project includes
+// External includes
+// System includes
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <queue>
+#include <thread>
+#include <utility>
+
+
+// TokenStreamer hands the generated tokens to a consumer on its own thread, so the decode loop does not wait for the
+// detokenization and the output stream.
+class TokenStreamer
+{
+public:
+    // Constructor.
+    explicit TokenStreamer(std::function<void(ssize_t)> consumer) : m_consumer{std::move(consumer)}
+    {
+        m_thread = std::thread([this] { consumerLoop(); });
+    }
+
+    // Destructor. Waits until all pushed tokens are consumed.
+    ~TokenStreamer()
+    {
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            m_stop = true;
+        }
+        m_condition.notify_one();
+        m_thread.join();
+    }
+
+    TokenStreamer(const TokenStreamer&) = delete;
+    TokenStreamer& operator=(const TokenStreamer&) = delete;
+
+    void push(ssize_t tokenId)
+    {
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            m_tokenIds.emplace(tokenId);
+        }
+        m_condition.notify_one();
+    }
+
+private:
+    void consumerLoop()
+    {
+        while (true)
+        {
+            ssize_t tokenId;
+            {
+                std::unique_lock<std::mutex> lock(m_mutex);
+                m_condition.wait(lock, [this] { return m_stop || !m_tokenIds.empty(); });
+                if (m_tokenIds.empty()) return;
+                tokenId = m_tokenIds.front();
+                m_tokenIds.pop();
+            }
+            m_consumer(tokenId);
+        }
+    }
+
+    std::function<void(ssize_t)>  m_consumer;
+    std::queue<ssize_t>  m_tokenIds;
+    std::mutex  m_mutex;
+    std::condition_variable  m_condition;
+    bool  m_stop{false};
+    std::thread  m_thread;
+};
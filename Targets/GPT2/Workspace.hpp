@@ -0,0 +1,106 @@
+//
+//  Copyright © 2024-Present, Arkin Terli. All rights reserved.
+//
+//  NOTICE:  All information contained herein is, and remains the property of Arkin Terli.
+//  The intellectual and technical concepts contained herein are proprietary to Arkin Terli
+//  and may be covered by U.S. and Foreign Patents, patents in process, and are protected by
+//  trade secret or copyright law. Dissemination of this information or reproduction of this
+//  material is strictly forbidden unless prior written permission is obtained from Arkin Terli.
+
+#pragma once
+
+// Project includes
+#include "Profiler.hpp"
+// External includes
+#include <aix.hpp>
+// System includes
+#include <array>
+#include <vector>
+
+
+// Workspace is an arena of the intermediate tensors created by the fused kernels in a forward pass. The intermediates
+// of a transformer layer are dead once the next layer produced its output, so two frames are used alternately by the
+// layers: the layer i allocates from the frame (i % 2), and the frame is rewound when the layer i + 2 starts.
+// The layers request the same sequence of shapes in every step, so the tensors of the previous step are reused in
+// place, and a decode step makes no allocation once the shapes are seen. A slot is reallocated only if its shape
+// changes, i.e. a prefill with a new length.
+// NOTE: The kernels that allocate from the workspace must run eagerly on the host, since the buffers are rewritten by
+//       the later layers. The tensors that outlive a step, i.e. the logits, must be allocated outside the frames.
+class Workspace
+{
+    struct Frame;
+
+public:
+    static constexpr size_t kNumFrames = 2;
+
+    // Makes a frame of the workspace current on this thread, and rewinds the frame. The previous frame is restored
+    // when the scope ends.
+    class FrameScope
+    {
+    public:
+        FrameScope(Workspace& workspace, size_t frame) : m_previous{s_current}
+        {
+            s_current = &workspace.m_frames[frame % kNumFrames];
+            s_current->cursor = 0;
+        }
+
+        ~FrameScope()
+        {
+            s_current = m_previous;
+        }
+
+        FrameScope(const FrameScope&) = delete;
+        FrameScope& operator=(const FrameScope&) = delete;
+
+    private:
+        Frame*  m_previous{nullptr};
+    };
+
+    // Returns an uninitialized float32 tensor from the current frame of this thread, or a new tensor if there is no
+    // current frame.
+    static aix::Tensor allocate(const aix::Shape& shape, aix::Device* device)
+    {
+        if (!s_current)
+        {
+            return newTensor(shape, device);
+        }
+
+        auto& frame = *s_current;
+        if (frame.cursor == frame.slots.size())
+        {
+            frame.slots.emplace_back(newTensor(shape, device));
+        }
+        else if (frame.slots[frame.cursor].shape() != shape || frame.slots[frame.cursor].device() != device)
+        {
+            frame.slots[frame.cursor] = newTensor(shape, device);
+        }
+        return frame.slots[frame.cursor++];
+    }
+
+    // Releases all tensors of the workspace.
+    void clear()
+    {
+        for (auto& frame : m_frames)
+        {
+            frame.slots.clear();
+            frame.cursor = 0;
+        }
+    }
+
+private:
+    static aix::Tensor newTensor(const aix::Shape& shape, aix::Device* device)
+    {
+        aix::Tensor tensor(shape, aix::device(device));
+        if (Profiler::enabled()) Profiler::addAllocation(ProfileScope::tensorBytes(tensor));
+        return tensor;
+    }
+
+    struct Frame
+    {
+        std::vector<aix::Tensor> slots;
+        size_t cursor{0};
+    };
+
+    std::array<Frame, kNumFrames>  m_frames;
+    static inline thread_local Frame*  s_current{nullptr};
+};
@@ -9,31 +9,54 @@
 
 // Project includes
 #include "BPE.hpp"
+#include "Checkpoint.hpp"
+#include "KVCache.hpp"
 #include "Model.hpp"
+#include "ModelConfig.hpp"
+#include "Profiler.hpp"
+#include "Sampler.hpp"
+#include "Scheduler.hpp"
+#include "Server.hpp"
+#include "SpeculativeDecoder.hpp"
+#include "TokenStreamer.hpp"
 // External includes
 #include <aix.hpp>
 #include <aixDevices.hpp>
 #include <docopt/docopt.h>
 // System includes
+#include <algorithm>
 #include <exception>
 #include <filesystem>
+#include <fstream>
+#include <iomanip>
 #include <iostream>
 #include <string>
+#include <system_error>
 #include <unordered_map>
 
 
-enum class ModelConfigType : size_t
-{
-    OPENAI_124M  = 0,
-    OPENAI_355M  = 1,
-    OPENAI_774M  = 2,
-    OPENAI_1558M = 3,
-};
-
 struct CmdLineOptions
 {
     std::string prompt;
+    std::string promptsFile;
+    std::string profileFile;
+    bool serve{false};
+    size_t maxBatchSize{8};
+    size_t maxBatchTokens{2048};
+    size_t numKVBlocks{0};
+    size_t prefillChunkSize{256};
+    size_t numLoadThreads{0};
+    size_t numThreads{0};
+    size_t numStages{1};
+    size_t tensorParallel{1};
+    size_t numMicroBatches{0};
+    size_t offloadBudget{0};
+    SamplingConfig sampling;
+    WeightFormat weightFormat{WeightFormat::kFloat32};
     ModelConfigType modelType{ModelConfigType::OPENAI_124M};
+    bool speculative{false};
+    ModelConfigType draftModelType{ModelConfigType::OPENAI_124M};
+    size_t numDraftTokens{4};
     aix::DeviceType deviceType{aix::DeviceType::kCPU};
 };
 
@@ -44,16 +67,55 @@ CmdLineOptions processCommandLineArguments(int argc, const char* argv[])
     GPT2 - Copyright (c) 2024-Present, Arkin Terli. All rights reserved.
 
     Usage:
-        GPT2 --prompt=<text> --model=<type> --device=<type>
+        GPT2 --prompt=<text> --model=<type> --device=<type> [options]
+        GPT2 --prompts-file=<file> --model=<type> --device=<type> [options]
+        GPT2 --serve --model=<type> --device=<type> [options]
 
     Example:
         GPT2 --prompt="What do you know about artificial intelligence?" --model=124M --device=MCS
+        echo '{"id": "1", "prompt": "Hello", "max_tokens": 32}' | GPT2 --serve --model=124M --device=MCS
 
     Options:
-        --prompt=<text>     Your prompt to the GPT2.
-        --model=<type>      Model type to use. Options: [124M | 355M | 774M | 1558M]
-        --device=<type>     Device type to use. Options: [CPU | MCS]
-                            MCS: Metal Compute Shaders for Apple Silicon.
+        --prompt=<text>         Your prompt to the GPT2.
+        --prompts-file=<file>   Text file with one prompt per line. The prompts are processed in batches.
+        --serve                 Serve requests as JSON lines from stdin, and write responses as JSON lines to stdout.
+                                Request:  {"id": "1", "prompt": "Hello", "max_tokens": 32}
+                                Response: {"id": "1", "text": "...", "tokens": 32, "finish_reason": "length"}
+        --max-batch=<n>         Maximum number of sequences in a running batch. [default: 8]
+        --max-batch-tokens=<n>  Maximum number of tokens processed in a single step. [default: 2048]
+        --kv-blocks=<n>         Number of 16-token KV cache blocks shared by all sequences.
+                                Zero reserves the full context size for each sequence in the batch. [default: 0]
+        --prefill-chunk=<n>     Maximum number of prompt tokens of a sequence processed in a single step. [default: 256]
+        --load-threads=<n>      Number of threads to read the model weights. Zero uses all hardware threads.
+                                [default: 0]
+        --quant=<type>          Weight quantization. Options: [none | int8 | int4] [default: none]
+                                The quantized weights are created by Resources/quantizeWeights.py. CPU device only.
+        --dtype=<type>          Data type of the weights if they are not quantized. Options: [f32 | f16 | bf16]
+                                The activations, layer normalizations and softmax are always computed in f32.
+                                [default: f32]
+        --temperature=<t>       Sampling temperature. Zero selects the most probable token. [default: 0]
+        --top-k=<n>             Number of the most probable tokens to sample from. Zero: all tokens. [default: 0]
+        --top-p=<p>             Nucleus sampling. Smallest set of tokens with the total probability p. [default: 1]
+        --repetition-penalty=<r>
+                                Penalty of the prompt and generated tokens. One: no penalty. [default: 1]
+        --seed=<n>              Seed of the sampling. Zero uses a random seed. [default: 0]
+        --model=<type>          Model type to use. Options: [124M | 355M | 774M | 1558M]
+        --draft-model=<type>    Smaller model to draft the tokens for the speculative decoding of the prompt.
+                                Options: [124M | 355M | 774M | 1558M]
+        --draft-tokens=<n>      Number of tokens the draft model proposes in each step. [default: 4]
+        --device=<type>         Device type to use. Options: [CPU | MCS]
+                                MCS: Metal Compute Shaders for Apple Silicon.
+        --threads=<n>           Number of threads of the CPU device. Zero uses all hardware threads. [default: 0]
+        --pipeline-stages=<n>   Number of devices to split the layers into consecutive stages. [default: 1]
+        --tensor-parallel=<n>   Number of devices to split the heads and hidden units of each stage. [default: 1]
+        --micro-batches=<n>     Number of micro-batches of a batch in the pipeline stages. Zero uses a micro-batch
+                                for each stage. [default: 0]
+        --offload-budget=<mb>   Device memory in MB for the transformer block weights. The blocks that do not fit are
+                                streamed from the indexed checkpoint just before they run. Zero keeps all blocks on
+                                the device. [default: 0]
+        --profile=<file>        Profile the modules, the device synchronizations and the tokenization. A summary table
+                                is written to stderr, and a Chrome trace JSON to the file. The modules wait for the
+                                device, so their times include the device work.
     )";
 
     std::map <std::string, docopt::value>  args;
@@ -67,21 +129,87 @@ CmdLineOptions processCommandLineArguments(int argc, const char* argv[])
         // Parse cmd-line parameters.
         args = docopt::docopt(USAGE, {argv + 1, argv + argc}, false, "GPT2 0.0.0");
 
-        options.prompt  = args["--prompt"].asString();
+        if (args["--prompt"])       options.prompt      = args["--prompt"].asString();
+        if (args["--prompts-file"]) options.promptsFile = args["--prompts-file"].asString();
+        if (args["--profile"])      options.profileFile = args["--profile"].asString();
+        options.serve = args["--serve"].asBool();
+        options.maxBatchSize   = args["--max-batch"].asLong();
+        options.maxBatchTokens = args["--max-batch-tokens"].asLong();
+        options.numKVBlocks    = args["--kv-blocks"].asLong();
+        options.prefillChunkSize = args["--prefill-chunk"].asLong();
+        options.numLoadThreads = args["--load-threads"].asLong();
+        options.numThreads     = args["--threads"].asLong();
+        options.numStages      = args["--pipeline-stages"].asLong();
+        options.tensorParallel = args["--tensor-parallel"].asLong();
+        options.numMicroBatches = args["--micro-batches"].asLong();
+        options.offloadBudget  = args["--offload-budget"].asLong();
+        options.sampling.temperature       = std::stof(args["--temperature"].asString());
+        options.sampling.topK              = args["--top-k"].asLong();
+        options.sampling.topP              = std::stof(args["--top-p"].asString());
+        options.sampling.repetitionPenalty = std::stof(args["--repetition-penalty"].asString());
+        options.sampling.seed              = std::stoull(args["--seed"].asString());
+        options.numDraftTokens = args["--draft-tokens"].asLong();
         auto modelType  = args["--model"].asString();
         auto deviceType = args["--device"].asString();
-
-        if (options.prompt.empty()) throw std::invalid_argument("Prompt cannot be empty.");
-
-        if (modelType == "124M")        options.modelType = ModelConfigType::OPENAI_124M;
-        else if (modelType == "355M")   options.modelType = ModelConfigType::OPENAI_355M;
-        else if (modelType == "774M")   options.modelType = ModelConfigType::OPENAI_774M;
-        else if (modelType == "1558M")  options.modelType = ModelConfigType::OPENAI_1558M;
-        else throw std::invalid_argument("Unknown model type: " + modelType);
+        auto quantType  = args["--quant"].asString();
+        auto dataType   = args["--dtype"].asString();
+
+        if (options.prompt.empty() && options.promptsFile.empty() && !options.serve)
+        {
+            throw std::invalid_argument("Prompt cannot be empty.");
+        }
+        if (options.prefillChunkSize == 0)
+        {
+            throw std::invalid_argument("Prefill chunk size must be greater than zero.");
+        }
+        if (options.numStages == 0 || options.tensorParallel == 0)
+        {
+            throw std::invalid_argument("Number of pipeline stages and tensor-parallel devices must be greater than "
+                                        "zero.");
+        }
+        if (options.offloadBudget != 0 && options.numStages * options.tensorParallel > 1)
+        {
+            throw std::invalid_argument("Weight offloading can not be used with a sharded model.");
+        }
+
+        options.modelType = parseModelType(modelType);
+
+        if (args["--draft-model"])
+        {
+            if (options.prompt.empty())
+            {
+                throw std::invalid_argument("Speculative decoding is only supported with a single prompt.");
+            }
+            if (options.numDraftTokens == 0)
+            {
+                throw std::invalid_argument("Number of draft tokens must be greater than zero.");
+            }
+            options.speculative    = true;
+            options.draftModelType = parseModelType(args["--draft-model"].asString());
+        }
 
         if (deviceType == "CPU")        options.deviceType = aix::DeviceType::kCPU;
         else if (deviceType == "MCS")   options.deviceType = aix::DeviceType::kGPU_METAL;
         else throw std::invalid_argument("Unknown device type: " + deviceType);
+
+        if (quantType == "none")        options.weightFormat = WeightFormat::kFloat32;
+        else if (quantType == "int8")   options.weightFormat = WeightFormat::kInt8;
+        else if (quantType == "int4")   options.weightFormat = WeightFormat::kInt4;
+        else throw std::invalid_argument("Unknown quantization type: " + quantType);
+
+        if (dataType != "f32" && quantType != "none")
+        {
+            throw std::invalid_argument("Quantized weights can not be used with a data type.");
+        }
+        if (isQuantized(options.weightFormat) && options.deviceType != aix::DeviceType::kCPU)
+        {
+            throw std::invalid_argument("Quantized weights are only supported on the CPU device.");
+        }
+        if (dataType == "f16")          options.weightFormat = WeightFormat::kFloat16;
+        else if (dataType == "bf16")    options.weightFormat = WeightFormat::kBFloat16;
+        else if (dataType != "f32")     throw std::invalid_argument("Unknown data type: " + dataType);
+
+        Sampler{options.sampling};      // Validates the sampling parameters.
     }
     catch (std::exception& e)
     {
@@ -102,105 +230,328 @@ void validateFileExistence(const std::string& filePath)
 }
 
 
-int main(int argc, const char* argv[])
+std::vector<std::string> loadPrompts(const std::string& filename)
 {
-    // NOTE: All the configuration is prepared here instead of using a separate config file to reduce noise
-    //       only for the example purpose.
+    std::ifstream ins(filename);
+    std::vector<std::string> prompts;
+    std::string line;
+    while (std::getline(ins, line))
+    {
+        if (!line.empty()) prompts.emplace_back(line);
+    }
+
+    if (prompts.empty())
+    {
+        std::cerr << "Prompts file is empty: " + filename << std::endl;
+        exit(-1);
+    }
+    return prompts;
+}
+
+
+void processPrompt(const GPT2& model, const GPT2* draftModel, BPE& bpe, std::unique_ptr<aix::Device>& device,
+                   const std::string& prompt, const SamplingConfig& sampling, size_t numDraftTokens)
+{
+    std::cout << "Prompt: " << prompt << std::endl;
+
+    std::vector<ssize_t> promptTokenIds;
+    {
+        ProfileScope scope("encode", "tokenizer");
+        promptTokenIds = bpe.encode(prompt);
+    }
+    std::unique_ptr<SpeculativeDecoder> decoder;
+    if (draftModel) decoder = std::make_unique<SpeculativeDecoder>(model, *draftModel, numDraftTokens);
+
+    StreamDecoder detokenizer(bpe);
+    {
+        // The new tokens are decoded and printed on a separate thread, so the device does not wait for the output.
+        // The streamer prints all tokens before it is destroyed. Only the complete UTF-8 characters are printed.
+        TokenStreamer streamer([&detokenizer](ssize_t tokenId)
+        {
+            std::string_view text;
+            {
+                ProfileScope scope("decode", "tokenizer");
+                text = detokenizer.decode(tokenId);
+            }
+            std::cout << text << std::flush;
+        });
+        auto printToken = [&streamer](ssize_t tokenId) { streamer.push(tokenId); };
+
+        // The GPT-2 model was not trained with start-of-sentence (SOS) or end-of-sentence (EOS) tokens. Therefore, we
+        // can't determine when to stop generating the next token. Thus, we generate until the context is full.
+        if (decoder)
+        {
+            decoder->generate(promptTokenIds, model.ctxSize(), device, sampling, printToken);
+        }
+        else
+        {
+            model.generate(promptTokenIds, model.ctxSize(), device, sampling, printToken);
+        }
+    }
+    std::cout << detokenizer.flush() << std::flush;
+
+    if (decoder)
+    {
+        const auto& stats = decoder->stats();
+        std::cerr << std::endl << "Accepted " << stats.numAcceptedTokens << " of " << stats.numDraftTokens
+                  << " draft tokens in " << stats.numSteps << " steps." << std::endl;
+    }
+}
+
+
+void processPrompts(const GPT2& model, BPE& bpe, std::unique_ptr<aix::Device>& device,
+                    const std::vector<std::string>& prompts, const SchedulerConfig& config)
+{
+    // Prompts are scheduled with continuous batching. A new prompt joins the batch as soon as a sequence finishes.
+    // The prompts that do not fit are skipped, and their outputs are left empty.
+    Scheduler scheduler(model, device, config);
+    for (size_t i=0; i<prompts.size(); ++i)
+    {
+        ProfileScope scope("encode", "tokenizer");
+        try
+        {
+            scheduler.submit({std::to_string(i), bpe.encode(prompts[i]), 0});
+        }
+        catch (const std::invalid_argument& e)
+        {
+            std::cerr << "Skipping the prompt " << i << ": " << e.what() << std::endl;
+        }
+    }
+
+    std::vector<std::string> outputs(prompts.size());
+    while (!scheduler.idle())
+    {
+        for (const auto& result : scheduler.step())
+        {
+            ProfileScope scope("decode", "tokenizer");
+            outputs[std::stoul(result.id)] = bpe.decode(result.tokenIds);
+        }
+    }
+
+    for (size_t i=0; i<prompts.size(); ++i)
+    {
+        std::cout << "Prompt: " << prompts[i] << std::endl << outputs[i] << std::endl << std::endl;
+    }
+}
+
+
+// Returns the weights file of a model. The indexed checkpoint is used if the OpenAI weights file is converted by
+// Resources/convertWeights.py. The quantized weights are only available in the indexed checkpoints.
+std::string findWeightsFile(const std::string& modelFile, WeightFormat weightFormat)
+{
+    auto indexedFile = std::filesystem::path(modelFile).replace_extension(".ckpt").string();
+    if (isQuantized(weightFormat))
+    {
+        auto suffix = weightFormat == WeightFormat::kInt8 ? "-int8.ckpt" : "-int4.ckpt";
+        indexedFile = std::filesystem::path(modelFile).replace_extension().string() + suffix;
+        validateFileExistence(indexedFile);
+    }
+    if (std::filesystem::exists(indexedFile)) return indexedFile;
+    validateFileExistence(modelFile);
+    return modelFile;
+}
+
+
+// Loads the tokenizer from its binary image, which is mapped without parsing the text files. The image is created from
+// the text files on the first run, and again whenever the text files are newer than the image.
+BPE loadTokenizer(const std::string& mergesFile, const std::string& vocabsFile, const std::string& imageFile)
+{
+    std::error_code ec;
+    auto imageTime = std::filesystem::last_write_time(imageFile, ec);
+    if (!ec && imageTime >= std::filesystem::last_write_time(mergesFile) &&
+        imageTime >= std::filesystem::last_write_time(vocabsFile))
+    {
+        try
+        {
+            return BPE(imageFile);
+        }
+        catch (const std::exception& e)
+        {
+            std::cerr << "Rebuilding the tokenizer image. " << e.what() << std::endl;
+        }
+    }
+
+    BPE bpe(mergesFile, vocabsFile);
+    try
+    {
+        bpe.saveImage(imageFile);
+    }
+    catch (const std::exception& e)
+    {
+        // The tokenizer still works without the image, e.g. on a read-only installation.
+        std::cerr << "Failed to save the tokenizer image. " << e.what() << std::endl;
+    }
+    return bpe;
+}
+
+
+// Creates a GPT2 model on the device, and loads its weights. If the transformer blocks do not fit into the offload
+// budget, only the blocks within the budget are loaded, and the others are streamed when they run.
+std::unique_ptr<GPT2> loadModel(const std::unordered_map<std::string, size_t>& hParams, const std::string& weightsFile,
+                                WeightFormat weightFormat, std::unique_ptr<aix::Device>& device, size_t numLoadThreads,
+                                size_t offloadBudget = 0)
+{
+    // The parameters are left uninitialized since they are loaded from the weights file.
 
-    // GPT2 model parameters.
-    // nVocab : Number of tokens in our vocabulary.
-    // nCtx   : Maximum possible token sequence length for the input.
-    // nEmbd  : Embedding dimension (determines the "width" of the network).
-    // nHeads : Number of attention heads (embedding dimension must be divisible by heads).
-    // nLayers: Number of layers (determines the "depth" of the network).
-    std::vector<std::unordered_map<std::string, size_t>>  modelParams
+    // The streamed blocks are found by their names, so they need an indexed checkpoint.
+    size_t numResidentLayers = 0;
+    if (offloadBudget != 0)
     {
-        { {"nVocab", 50257}, {"nCtx", 1024}, {"nEmbd",  768}, {"nHeads", 12}, {"nLayers", 12}, },   // 124M
-        { {"nVocab", 50257}, {"nCtx", 1024}, {"nEmbd", 1024}, {"nHeads", 16}, {"nLayers", 24}, },   // 355M
-        { {"nVocab", 50257}, {"nCtx", 1024}, {"nEmbd", 1280}, {"nHeads", 20}, {"nLayers", 36}, },   // 774M
-        { {"nVocab", 50257}, {"nCtx", 1024}, {"nEmbd", 1600}, {"nHeads", 25}, {"nLayers", 48}, },   // 1558M
-    };
+        if (!IndexedCheckpoint::isIndexedCheckpoint(weightsFile))
+        {
+            std::cerr << "Weight offloading needs an indexed checkpoint. See Resources/convertWeights.py" << std::endl;
+            exit(-1);
+        }
+        auto blockBytes = GPT2::blockBytes(hParams.at("nEmbd"), hParams.at("nHeads"), weightFormat);
+        numResidentLayers = offloadBudget * 1000000 / blockBytes;
+        if (numResidentLayers < 2)
+        {
+            std::cerr << "Offload budget must hold at least two transformer blocks of " << blockBytes / 1000000
+                      << " MB." << std::endl;
+            exit(-1);
+        }
+    }
 
-    std::vector<std::string> modelWeightsFilenames =
+    auto model = std::make_unique<GPT2>(hParams.at("nVocab"), hParams.at("nCtx"), hParams.at("nEmbd"),
+                                        hParams.at("nHeads"), hParams.at("nLayers"), ParamInit::kNone, weightFormat,
+                                        numResidentLayers);
+    model->to(device);
+
+    // Load the GPT2 model weights published by OpenAI into the device buffers. The parameters are copied from the
+    // mapped file in parallel. The timings are written to stderr, so they do not mix with the server responses.
+    auto loadStats = loadWeightsParallel(model->namedParameters(), weightsFile, numLoadThreads);
+    std::cerr << std::fixed << std::setprecision(3)
+              << "Weights loaded in " << loadStats.totalSeconds << "s (index: " << loadStats.indexSeconds
+              << "s, read: " << loadStats.readSeconds << "s";
+    // The read time of a small checkpoint can be below the timer resolution.
+    if (loadStats.readSeconds > 0) std::cerr << " at " << loadStats.numBytes / loadStats.readSeconds / 1e9 << " GB/s";
+    std::cerr << ")" << std::defaultfloat << std::endl;
+    if (model->numStreamedLayers() != 0)
     {
-        "Resources/GPT2/oaiWeights124M.bin",   // 124M parameters.
-        "Resources/GPT2/oaiWeights355M.bin",   // 355M parameters.
-        "Resources/GPT2/oaiWeights774M.bin",   // 774M parameters.
-        "Resources/GPT2/oaiWeights1558M.bin",  // 1558M parameters.
-    };
+        model->streamLayers(weightsFile);
+        std::cerr << "Streaming " << model->numStreamedLayers() << " of " << model->numLayers()
+                  << " transformer blocks from the checkpoint." << std::endl;
+    }
+    return model;
+}
+
+
+int main(int argc, const char* argv[])
+{
+    // NOTE: All the configuration is prepared here instead of using a separate config file to reduce noise
+    //       only for the example purpose.
 
     // Get command-line options.
     auto cmdLineOptions = processCommandLineArguments(argc, argv);
+    if (!cmdLineOptions.profileFile.empty())
+    {
+        Profiler::enable();
+    }
 
     // Configurations.
     auto modelType    = static_cast<size_t>(cmdLineOptions.modelType);
     auto hParams      = modelParams[modelType];
     auto modelFile    = modelWeightsFilenames[modelType];
+    auto weightFormat = cmdLineOptions.weightFormat;
     auto bpeMergeFile = "Resources/GPT2/oaiBPEMergeRules.txt";
     auto bpeVocabFile = "Resources/GPT2/oaiBPEVocabs.txt";
+    auto bpeImageFile = "Resources/GPT2/oaiBPE.bin";
     auto deviceType   = cmdLineOptions.deviceType;
 
-    std::string prompt = cmdLineOptions.prompt;
-
     // Check if all the necessary files do exist.
     validateFileExistence(bpeMergeFile);
     validateFileExistence(bpeVocabFile);
-    validateFileExistence(modelFile);
+    auto weightsFile = findWeightsFile(modelFile, weightFormat);
+    auto draftModelType = static_cast<size_t>(cmdLineOptions.draftModelType);
+    std::string draftWeightsFile;
+    if (cmdLineOptions.speculative)
+    {
+        draftWeightsFile = findWeightsFile(modelWeightsFilenames[draftModelType], weightFormat);
+    }
+    if (!cmdLineOptions.promptsFile.empty()) validateFileExistence(cmdLineOptions.promptsFile);
 
     // -----------------------------------------------------------
     // Create a model, and process the prompt.
     // -----------------------------------------------------------
 
     // Create a BPE, Byte-Pair-Encoding tokenizer.
-    BPE bpe(bpeMergeFile, bpeVocabFile);
+    auto bpe = loadTokenizer(bpeMergeFile, bpeVocabFile, bpeImageFile);
 
-    // Create a device that uses Apple Metal for GPU computations.
-    auto device = aix::createDevice(deviceType);
-    if (!device)
+    // Create the devices, i.e. Apple Metal for GPU computations. A sharded model has a device for each tensor-parallel
+    // part of each pipeline stage. The first device runs the embeddings, the LM head and the sampling.
+    std::vector<std::unique_ptr<aix::Device>> devices;
+    for (size_t i=0; i<cmdLineOptions.numStages * cmdLineOptions.tensorParallel; ++i)
     {
-        std::cerr << "Device type is not supported." << std::endl;
-        exit(-1);
+        devices.emplace_back(aix::createDevice(deviceType));
+        if (!devices.back())
+        {
+            std::cerr << "Device type is not supported." << std::endl;
+            exit(-1);
+        }
     }
-
-    // Create a GPT2 model.
-    auto model = GPT2(hParams["nVocab"], hParams["nCtx"], hParams["nEmbd"], hParams["nHeads"], hParams["nLayers"]);
-
-    // Load the GPT2 model weights published by OpenAI.
-    aix::load(model, modelFile);
-
-    model.to(device);
-
-    std::cout << "Prompt: " << prompt << std::endl;
-
-    // Create the initial token ids for the prompt.
-    auto inputTokenIds = bpe.encode(prompt);
-
-    // Auto-regressive decoding loop: generate/predict the next token and append it to the initial tokens to predict
-    // the following token.
-    for (size_t i=0; i<hParams["nCtx"]; ++i)
+    auto& device = devices.front();
+    if (device->type() == aix::DeviceType::kCPU)
     {
-        // The GPT-2 model was not trained with start-of-sentence (SOS) or end-of-sentence (EOS) tokens.
-        // Therefore, we can't determine when to stop generating the next token. Thus, we generate a specific number
-        // of tokens, ensuring it does not exceed the context length.
-        if (inputTokenIds.size() >= hParams["nCtx"]) break;
-
-        // Convert the token IDs into a tensor.
-        auto inputs = aix::Tensor(inputTokenIds.data(), inputTokenIds.size(), aix::DataType::kInt64,
-                                  aix::Shape{inputTokenIds.size()}, aix::dtype(aix::DataType::kInt32)).to(device);
-
-        // Predict the next token (either a word or a sub-word).
-        auto logits = model.forward(inputs);
-        auto nextTokenTensor = aix::argmax(logits[-1]);     // Greedy sampling. Selecting the highest prob token.
+        kernels::setNumThreads(cmdLineOptions.numThreads);
+    }
 
-        // Synchronize to read data on the CPU.
+    // Create a GPT2 model and load its weights. The draft model of the speculative decoding uses the same formats.
+    auto model = loadModel(hParams, weightsFile, weightFormat, device, cmdLineOptions.numLoadThreads,
+                           cmdLineOptions.offloadBudget);
+    if (devices.size() > 1)
+    {
+        // The layers are split after the weights are loaded on the first device. The draft model is small, so it
+        // stays on the first device.
+        std::vector<aix::Device*> shardDevices;
+        for (auto& shardDevice : devices) shardDevices.emplace_back(shardDevice.get());
         device->synchronize();
+        try
+        {
+            model = GPT2::shard(std::move(model), shardDevices, cmdLineOptions.tensorParallel,
+                                cmdLineOptions.numMicroBatches);
+        }
+        catch (std::exception& e)
+        {
+            std::cerr << "Exception message: " << e.what() << std::endl;
+            exit(-1);
+        }
+    }
+    model->setPrefillChunkSize(cmdLineOptions.prefillChunkSize);
+    std::unique_ptr<GPT2> draftModel;
+    if (cmdLineOptions.speculative)
+    {
+        draftModel = loadModel(modelParams[draftModelType], draftWeightsFile, weightFormat, device,
+                               cmdLineOptions.numLoadThreads);
+        draftModel->setPrefillChunkSize(cmdLineOptions.prefillChunkSize);
+    }
+
+    SchedulerConfig schedulerConfig;
+    schedulerConfig.maxBatchSize   = cmdLineOptions.maxBatchSize;
+    schedulerConfig.maxBatchTokens = cmdLineOptions.maxBatchTokens;
+    schedulerConfig.ctxSize        = hParams["nCtx"];
+    schedulerConfig.numKVBlocks    = cmdLineOptions.numKVBlocks;
+    schedulerConfig.sampling       = cmdLineOptions.sampling;
 
-        // Decode the new token ID and print it.
-        auto nextTokenId = nextTokenTensor.value().item<int32_t>();     // Argmax return type is always int32_t.
-        std::cout << bpe.decode({nextTokenId}) << std::flush;
+    if (cmdLineOptions.serve)
+    {
+        // The model and the tokenizer stay loaded while serving all requests.
+        Scheduler scheduler(*model, device, schedulerConfig);
+        Server(scheduler, bpe).run();
+    }
+    else if (!cmdLineOptions.promptsFile.empty())
+    {
+        processPrompts(*model, bpe, device, loadPrompts(cmdLineOptions.promptsFile), schedulerConfig);
+    }
+    else
+    {
+        processPrompt(*model, draftModel.get(), bpe, device, cmdLineOptions.prompt, cmdLineOptions.sampling,
+                      cmdLineOptions.numDraftTokens);
+    }
 
-        // Append the new token ID to the current token sequence to predict the following token in the next iteration.
-        inputTokenIds.emplace_back(nextTokenId);
+    if (Profiler::enabled())
+    {
+        Profiler::instance().writeSummary(std::cerr);
+        Profiler::instance().writeChromeTrace(cmdLineOptions.profileFile);
     }
 
     return 0;
@@ -0,0 +1,746 @@
+//
+//  Copyright © 2024-Present, Arkin Terli. All rights reserved.
+//
+//  NOTICE:  All information contained herein is, and remains the property of Arkin Terli.
+//  The intellectual and technical concepts contained herein are proprietary to Arkin Terli
+//  and may be covered by U.S. and Foreign Patents, patents in process, and are protected by
+//  trade secret or copyright law. Dissemination of this information or reproduction of this
+//  material is strictly forbidden unless prior written permission is obtained from Arkin Terli.
+
+// Project includes
+#include "BPE.hpp"
+#include "Checkpoint.hpp"
+#include "KVCache.hpp"
+#include "Model.hpp"
+#include "ModelConfig.hpp"
+#include "Scheduler.hpp"
+// External includes
+#include <aix.hpp>
+#include <aixDevices.hpp>
+#include <docopt/docopt.h>
+// System includes
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <exception>
+#include <filesystem>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <numeric>
+#include <random>
+#include <regex>
+#include <sstream>
+#include <string>
+#include <utility>
+#include <vector>
+
+
+struct BenchOptions
+{
+    std::vector<std::string> models;
+    std::vector<std::string> devices;
+    std::vector<size_t> promptLengths;
+    size_t numDecodeTokens{64};
+    size_t moduleSeqLen{128};
+    size_t numIterations{10};
+    size_t numWarmups{2};
+    size_t numThreads{0};
+    std::string corpusFile;
+    std::string outputFile;
+    bool tokenizerOnly{false};
+    bool tokenizerConformance{false};
+    bool kernelConformance{false};
+};
+
+// Summary of the measured durations in milliseconds.
+struct BenchStats
+{
+    size_t iterations{0};
+    double mean{0};
+    double min{0};
+    double p50{0};
+    double p90{0};
+    double max{0};
+};
+
+// Benchmark labels, i.e. {"model", "124M"}. They are written in the given order.
+using BenchLabels = std::vector<std::pair<std::string, std::string>>;
+
+
+std::vector<std::string> splitList(const std::string& list)
+{
+    std::vector<std::string> items;
+    std::stringstream ss(list);
+    std::string item;
+    while (std::getline(ss, item, ','))
+    {
+        if (!item.empty()) items.emplace_back(item);
+    }
+    return items;
+}
+
+
+BenchOptions processCommandLineArguments(int argc, const char* argv[])
+{
+    static const char USAGE[] =
+    R"(
+    GPT2Bench - Copyright (c) 2024-Present, Arkin Terli. All rights reserved.
+
+    Usage:
+        GPT2Bench [options]
+
+    Example:
+        GPT2Bench --models=124M,355M --devices=CPU,MCS --output=results.jsonl
+
+    Options:
+        --models=<list>         Comma-separated model types. Options: [124M | 355M | 774M | 1558M] [default: 124M]
+                                The models without a weights file are skipped.
+        --devices=<list>        Comma-separated device types. Options: [CPU | MCS] [default: CPU]
+        --prompt-lengths=<list> Comma-separated prompt lengths of the prefill benchmarks. [default: 16,128,512]
+        --decode-tokens=<n>     Number of tokens of the decode benchmarks. [default: 64]
+        --module-seq=<n>        Sequence length of the module benchmarks. [default: 128]
+        --iterations=<n>        Number of measured iterations of each benchmark. [default: 10]
+        --warmup=<n>            Number of warmup iterations of each benchmark. [default: 2]
+        --threads=<n>           Number of threads of the CPU kernels. Zero uses all hardware threads. [default: 0]
+        --corpus=<file>         Text file of the tokenizer benchmarks. The built-in corpus is used if not given.
+        --output=<file>         JSON lines output file. The results are written to stdout if not given.
+        --tokenizer-only        Run only the tokenizer benchmarks.
+        --tokenizer-conformance Compare the pre-tokenizer with the std::wregex pattern it replaced on a random corpus.
+                                Exits with a non-zero code on the first difference.
+        --kernel-conformance    Compare the fused CPU GeLU layer with the AIX operations of the other devices.
+                                Exits with a non-zero code if they differ more than the tolerance.
+    )";
+
+    std::map <std::string, docopt::value>  args;
+    BenchOptions options;
+
+    try
+    {
+        args = docopt::docopt(USAGE, {argv + 1, argv + argc}, true, "GPT2Bench 0.0.0");
+
+        options.models  = splitList(args["--models"].asString());
+        options.devices = splitList(args["--devices"].asString());
+        for (const auto& length : splitList(args["--prompt-lengths"].asString()))
+        {
+            options.promptLengths.emplace_back(std::stoul(length));
+        }
+        options.numDecodeTokens = args["--decode-tokens"].asLong();
+        options.moduleSeqLen    = args["--module-seq"].asLong();
+        options.numIterations   = args["--iterations"].asLong();
+        options.numWarmups      = args["--warmup"].asLong();
+        options.numThreads      = args["--threads"].asLong();
+        if (args["--corpus"]) options.corpusFile = args["--corpus"].asString();
+        if (args["--output"]) options.outputFile = args["--output"].asString();
+        options.tokenizerOnly = args["--tokenizer-only"].asBool();
+        options.tokenizerConformance = args["--tokenizer-conformance"].asBool();
+        options.kernelConformance    = args["--kernel-conformance"].asBool();
+
+        for (const auto& model : options.models) parseModelType(model);
+        for (const auto& device : options.devices)
+        {
+            if (device != "CPU" && device != "MCS") throw std::invalid_argument("Unknown device type: " + device);
+        }
+        if (options.numIterations == 0)
+        {
+            throw std::invalid_argument("Number of iterations must be greater than zero.");
+        }
+        if (std::any_of(options.promptLengths.begin(), options.promptLengths.end(),
+                        [](size_t length) { return length == 0; }))
+        {
+            throw std::invalid_argument("Prompt lengths must be greater than zero.");
+        }
+    }
+    catch (std::exception& e)
+    {
+        std::cerr << "Exception message: " << e.what() << std::endl;
+        exit(-1);
+    }
+
+    return options;
+}
+
+
+// Returns the fixed corpus of the tokenizer benchmarks. The built-in corpus mixes prose, code, numbers and non-ASCII
+// text, and it is repeated to about 1 MB, so the results are comparable across the runs.
+std::string loadCorpus(const std::string& filename)
+{
+    if (!filename.empty())
+    {
+        std::ifstream ins(filename, std::ios::binary);
+        if (!ins)
+        {
+            throw std::runtime_error("Failed to open the corpus file: " + filename);
+        }
+        std::stringstream ss;
+        ss << ins.rdbuf();
+        return ss.str();
+    }
+
+    static const char kParagraph[] =
+        "The transformer is a deep learning architecture that relies on the attention mechanism. It was proposed in "
+        "the 2017 paper \"Attention Is All You Need\", and it's now the basis of most large language models. We'll "
+        "measure how quickly the tokenizer handles ordinary English sentences, numbers like 3.14159 and 1,024, and "
+        "punctuation!?\n\n"
+        "    for (size_t i=0; i<numLayers; ++i) x = blocks[i].forward(x);   // 12 layers, 768-dim.\n\n"
+        "Les modèles de langage prédisent le prochain mot. Die Größe des Modells ist wichtig. "
+        "日本語のテキストも含まれています。 Привет, мир! 😀 <|endoftext|>\n";
+
+    constexpr size_t kCorpusSize = 1 << 20;
+    std::string corpus;
+    while (corpus.size() < kCorpusSize) corpus += kParagraph;
+    return corpus;
+}
+
+
+BenchStats summarize(std::vector<double> samples)
+{
+    BenchStats stats;
+    if (samples.empty()) return stats;
+
+    std::sort(samples.begin(), samples.end());
+    auto percentile = [&](double p) { return samples[static_cast<size_t>(std::round(p * (samples.size() - 1)))]; };
+    stats.iterations = samples.size();
+    stats.mean = std::accumulate(samples.begin(), samples.end(), 0.0) / samples.size();
+    stats.min  = samples.front();
+    stats.p50  = percentile(0.5);
+    stats.p90  = percentile(0.9);
+    stats.max  = samples.back();
+    return stats;
+}
+
+
+// Runs the function numWarmups times, and then measures numIterations runs.
+template<typename F>
+BenchStats measure(size_t numWarmups, size_t numIterations, F&& fn)
+{
+    for (size_t i=0; i<numWarmups; ++i) fn();
+
+    std::vector<double> samples;
+    for (size_t i=0; i<numIterations; ++i)
+    {
+        auto start = std::chrono::steady_clock::now();
+        fn();
+        samples.emplace_back(std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start)
+                             .count());
+    }
+    return summarize(std::move(samples));
+}
+
+
+// Writes each result as a JSON line with stable names and keys, so the outputs of two runs can be diffed.
+class ResultWriter
+{
+public:
+    explicit ResultWriter(std::ostream& out) : m_out{out}
+    {
+    }
+
+    // Writes a result. The throughput is the amount of work per second, i.e. tokens/s, and it is omitted if the unit
+    // is empty.
+    void write(const std::string& name, const BenchLabels& labels, const BenchStats& stats,
+               const std::string& unit = "", double workPerIteration = 0)
+    {
+        m_out << std::fixed << std::setprecision(4) << "{\"name\": " << quote(name);
+        for (const auto& [key, value] : labels)
+        {
+            m_out << ", " << quote(key) << ": " << quote(value);
+        }
+        m_out << ", \"iterations\": " << stats.iterations << ", \"mean_ms\": " << stats.mean
+              << ", \"min_ms\": " << stats.min << ", \"p50_ms\": " << stats.p50 << ", \"p90_ms\": " << stats.p90
+              << ", \"max_ms\": " << stats.max;
+        if (!unit.empty() && stats.mean > 0)
+        {
+            m_out << ", \"throughput\": " << workPerIteration * 1000.0 / stats.mean << ", \"unit\": " << quote(unit);
+        }
+        m_out << "}" << std::defaultfloat << std::endl;
+    }
+
+private:
+    // The names and the labels are plain ASCII identifiers, so only the quotes and the backslashes are escaped.
+    static std::string quote(const std::string& str)
+    {
+        std::string out = "\"";
+        for (char c : str)
+        {
+            if (c == '"' || c == '\\') out += '\\';
+            out += c;
+        }
+        return out + "\"";
+    }
+
+    std::ostream&  m_out;
+};
+
+
+// Appends the UTF-8 bytes of a character.
+void appendUTF8(std::string& str, wchar_t wc)
+{
+    auto cp = static_cast<uint32_t>(wc);
+    if (cp <= 0x7f)
+    {
+        str += static_cast<char>(cp);
+    }
+    else if (cp <= 0x7ff)
+    {
+        str += static_cast<char>(0xc0 | (cp >> 6));
+        str += static_cast<char>(0x80 | (cp & 0x3f));
+    }
+    else if (cp <= 0xffff)
+    {
+        str += static_cast<char>(0xe0 | (cp >> 12));
+        str += static_cast<char>(0x80 | ((cp >> 6) & 0x3f));
+        str += static_cast<char>(0x80 | (cp & 0x3f));
+    }
+    else
+    {
+        str += static_cast<char>(0xf0 | (cp >> 18));
+        str += static_cast<char>(0x80 | ((cp >> 12) & 0x3f));
+        str += static_cast<char>(0x80 | ((cp >> 6) & 0x3f));
+        str += static_cast<char>(0x80 | (cp & 0x3f));
+    }
+}
+
+
+// Compares the words of the pre-tokenizer with the matches of the std::wregex pattern it replaced, on random texts
+// of a fixed seed. Returns false and prints the text at the first difference.
+bool checkTokenizerConformance(const BPE& bpe)
+{
+    constexpr uint32_t kSeed = 2024;
+    constexpr size_t kNumTexts = 20000;
+    constexpr size_t kMaxFragments = 48;
+
+    // The fragments cover each class of the pattern, the contractions and their prefixes, the space runs, NBSP,
+    // the non-ASCII letters, digits and spaces, and the characters out of the BMP.
+    static const std::vector<std::wstring> kFragments =
+    {
+        L"a", L"Z", L"hello", L"s", L"t", L"re", L"ll", L"0", L"42", L"_", L"'", L"'s", L"'t", L"'re", L"'ve", L"'m",
+        L"'ll", L"'d", L"'S", L"''", L" ", L"  ", L"    ", L"\n", L"\t", L"\r\n", L".", L",", L"!?", L"-", L"\"",
+        L"\u00a0", L"\u00e9", L"\u00df", L"\u00c7a", L"\u0436", L"\u4e2d", L"\u0627", L"\u0661", L"\u2003",
+        L"\u3000", L"\u2019", L"\u00b2", L"\U0001f600", L"\U0001f44d\U0001f3fd", L"\U00020000",
+    };
+
+    const std::wregex re(L"('s|'t|'re|'ve|'m|'ll|'d| ?[a-zA-Z]+| ?\\d+| ?[^\\s\\w]+|\\s+)");
+    std::mt19937 rng(kSeed);
+    std::uniform_int_distribution<size_t> fragmentDist(0, kFragments.size() - 1);
+    std::uniform_int_distribution<size_t> lengthDist(1, kMaxFragments);
+
+    for (size_t n=0; n<kNumTexts; ++n)
+    {
+        // The byte offsets of the characters map the regex matches to the UTF-8 text.
+        std::wstring wtext;
+        std::string text;
+        std::vector<size_t> offsets;
+        for (size_t i=0, numFragments=lengthDist(rng); i<numFragments; ++i)
+        {
+            for (auto wc : kFragments[fragmentDist(rng)])
+            {
+                offsets.emplace_back(text.size());
+                wtext += wc;
+                appendUTF8(text, wc);
+            }
+        }
+        offsets.emplace_back(text.size());
+
+        std::vector<std::string_view> expected;
+        for (auto it = std::wsregex_iterator(wtext.begin(), wtext.end(), re); it != std::wsregex_iterator(); ++it)
+        {
+            auto start = offsets[it->position()];
+            expected.emplace_back(std::string_view(text).substr(start, offsets[it->position() + it->length()] - start));
+        }
+
+        // The words must be the same spans of the text.
+        auto words = bpe.splitWords(text);
+        auto sameSpan = [](std::string_view a, std::string_view b)
+        {
+            return a.data() == b.data() && a.size() == b.size();
+        };
+        auto [word, match] = std::mismatch(words.begin(), words.end(), expected.begin(), expected.end(), sameSpan);
+        if (word != words.end() || match != expected.end())
+        {
+            auto quoted = [](auto it, auto end)
+            {
+                return it == end ? std::string("<end>") : '"' + std::string(*it) + '"';
+            };
+            std::cerr << "Tokenizer conformance failed on text " << n << ": \"" << text << "\"\n"
+                      << "  word " << (word - words.begin()) << ": " << quoted(word, words.end())
+                      << ", expected " << quoted(match, expected.end()) << std::endl;
+            return false;
+        }
+    }
+
+    std::cout << "Tokenizer conformance passed on " << kNumTexts << " texts." << std::endl;
+    return true;
+}
+
+
+void benchTokenizer(const BenchOptions& options, ResultWriter& writer)
+{
+    auto mergesFile = "Resources/GPT2/oaiBPEMergeRules.txt";
+    auto vocabsFile = "Resources/GPT2/oaiBPEVocabs.txt";
+    auto imageFile  = (std::filesystem::temp_directory_path() / "GPT2Bench-oaiBPE.bin").string();
+    auto corpus = loadCorpus(options.corpusFile);
+    auto corpusMB = corpus.size() / 1e6;
+    BenchLabels labels{{"corpus", options.corpusFile.empty() ? "builtin" : options.corpusFile}};
+
+    auto stats = measure(0, options.numIterations, [&] { BPE{mergesFile, vocabsFile}; });
+    writer.write("bpe.load_text", labels, stats);
+
+    BPE bpe(mergesFile, vocabsFile);
+    bpe.saveImage(imageFile);
+    stats = measure(options.numWarmups, options.numIterations, [&] { BPE{imageFile}; });
+    writer.write("bpe.load_image", labels, stats);
+    std::filesystem::remove(imageFile);
+
+    std::vector<ssize_t> tokenIds;
+    stats = measure(options.numWarmups, options.numIterations, [&] { tokenIds = bpe.encode(corpus); });
+    writer.write("bpe.encode", labels, stats, "MB/s", corpusMB);
+
+    stats = measure(options.numWarmups, options.numIterations, [&]
+    {
+        bpe.encodeStream(std::string_view(corpus), [](const uint16_t*, size_t) {});
+    });
+    writer.write("bpe.encode_stream", labels, stats, "MB/s", corpusMB);
+
+    std::string text;
+    stats = measure(options.numWarmups, options.numIterations, [&] { text = bpe.decode(tokenIds); });
+    writer.write("bpe.decode", labels, stats, "MB/s", corpusMB);
+
+    stats = measure(options.numWarmups, options.numIterations, [&]
+    {
+        StreamDecoder decoder(bpe);
+        size_t numBytes = 0;
+        for (auto tokenId : tokenIds) numBytes += decoder.decode(tokenId).size();
+        numBytes += decoder.flush().size();
+        if (numBytes != text.size()) throw std::logic_error("Stream decoder output does not match the decoder.");
+    });
+    writer.write("bpe.stream_decode", labels, stats, "tokens/s", static_cast<double>(tokenIds.size()));
+}
+
+
+// Fills the parameters of a module with small deterministic values. The modules are created with the inference
+// parameters, so they run without autograd like the loaded models.
+void fillParameters(aix::nn::Module& module)
+{
+    for (auto& [name, param] : module.parameters())
+    {
+        auto data = param.value().data<float>();
+        auto size = param.value().size();
+        for (size_t i=0; i<size; ++i) data[i] = 0.02f * std::sin(static_cast<float>(i));
+    }
+}
+
+
+aix::Tensor benchInput(size_t seqLen, size_t embdDim, aix::Device* device)
+{
+    std::vector<float> data(seqLen * embdDim);
+    for (size_t i=0; i<data.size(); ++i) data[i] = std::cos(static_cast<float>(i));
+    return aix::Tensor(data.data(), data.size(), aix::DataType::kFloat32, aix::Shape{seqLen, embdDim},
+                       aix::dtype(aix::DataType::kFloat32).device(device));
+}
+
+
+// Compares the fused bias and GeLU epilogue of the CPU matmul kernels with the same layer composed of the AIX
+// operations, which is the path of the other devices. Both run on the CPU device. Returns false and prints the largest
+// difference if it exceeds the tolerance.
+bool checkKernelConformance()
+{
+    constexpr size_t kSeqLen     = 16;
+    constexpr size_t kNumInputs  = 768;
+    constexpr size_t kNumOutputs = 3072;
+    constexpr float  kTolerance  = 1e-4f;
+
+    auto device = aix::createDevice(aix::DeviceType::kCPU);
+    Linear linear(kNumInputs, kNumOutputs, ParamInit::kNone);
+    fillParameters(linear);
+    linear.to(device);
+    NamedParameters params;
+    linear.namedParameters("fc", params);
+    const auto& b = params[0].second;
+    const auto& w = params[1].second;
+
+    auto x = benchInput(kSeqLen, kNumInputs, device.get());
+    auto fused = linear.forwardGeLU(x);
+    auto reference = geluActivation(x.matmul(w) + b);
+    device->synchronize();
+
+    float maxDiff = 0;
+    size_t maxIndex = 0;
+    auto fusedData = fused.value().data<float>();
+    auto referenceData = reference.value().data<float>();
+    for (size_t i=0; i<fused.value().size(); ++i)
+    {
+        auto diff = std::abs(fusedData[i] - referenceData[i]);
+        if (diff > maxDiff)
+        {
+            maxDiff = diff;
+            maxIndex = i;
+        }
+    }
+
+    if (maxDiff > kTolerance)
+    {
+        std::cerr << "Kernel conformance failed: GeLU layer output " << maxIndex << " is " << fusedData[maxIndex]
+                  << ", expected " << referenceData[maxIndex] << "." << std::endl;
+        return false;
+    }
+    std::cout << "Kernel conformance passed. Largest GeLU layer difference: " << maxDiff << std::endl;
+    return true;
+}
+
+
+void benchModules(const BenchOptions& options, const std::unordered_map<std::string, size_t>& hParams,
+                  BenchLabels labels, std::unique_ptr<aix::Device>& device, ResultWriter& writer)
+{
+    auto embdDim = hParams.at("nEmbd");
+    auto seqLen  = options.moduleSeqLen;
+    auto x = benchInput(seqLen, embdDim, device.get());
+    labels.emplace_back("seq", std::to_string(seqLen));
+    auto run = [&](const std::string& name, auto&& forward)
+    {
+        auto stats = measure(options.numWarmups, options.numIterations, [&]
+        {
+            forward();
+            device->synchronize();
+        });
+        writer.write(name, labels, stats, "tokens/s", static_cast<double>(seqLen));
+    };
+
+    LayerNorm layerNorm(embdDim, embdDim, 1e-5, -1, true, ParamInit::kNone);
+    fillParameters(layerNorm);
+    layerNorm.to(device);
+    run("module.layer_norm", [&] { layerNorm.forward(x); });
+
+    // The attention writes the keys and values of the sequence to a cache that is reused by all iterations. Each
+    // iteration starts with an empty cache, and the truncation writes out the rows of the previous one.
+    MultiHeadAttention attention(embdDim, hParams.at("nHeads"), ParamInit::kNone);
+    fillParameters(attention);
+    attention.to(device);
+    KVBlockPool pool(1, embdDim, seqLen, 1, device.get());
+    KVCache cache(pool);
+    run("module.attention", [&]
+    {
+        cache.truncate(0);
+        attention.forward(x, cache, 0);
+    });
+
+    FeedForwardNet ffn(embdDim, ParamInit::kNone);
+    fillParameters(ffn);
+    ffn.to(device);
+    run("module.ffn", [&] { ffn.forward(x); });
+}
+
+
+// Latency of the scheduler steps while a long prompt is prefilled in chunks between the decode steps of the running
+// sequences. The KV block pool is nearly full, so the decode steps preempt sequences to grow, but they must not take
+// the blocks of the prompt. Throws if any request does not finish.
+void benchScheduler(const BenchOptions& options, const GPT2& model, std::unique_ptr<aix::Device>& device,
+                    const std::vector<ssize_t>& corpusTokenIds, const BenchLabels& labels, ResultWriter& writer)
+{
+    constexpr size_t kNumDecodeSequences = 3;
+    constexpr size_t kShortPromptLength  = 16;
+    auto longPromptLength = std::min({4 * model.prefillChunkSize(), model.ctxSize() / 2, corpusTokenIds.size()});
+    auto numNewTokens = std::min(options.numDecodeTokens, model.ctxSize() / 2 - 1);
+    if (longPromptLength <= model.prefillChunkSize() || kShortPromptLength > corpusTokenIds.size()) return;
+
+    SchedulerConfig config;
+    config.maxBatchSize  = kNumDecodeSequences + 1;
+    config.ctxSize       = model.ctxSize();
+    config.prefixCaching = false;
+    auto blocksFor = [&](size_t numTokens) { return (numTokens + config.kvBlockSize - 1) / config.kvBlockSize; };
+    config.numKVBlocks = kNumDecodeSequences * blocksFor(kShortPromptLength + 1) + blocksFor(longPromptLength) + 1;
+    Scheduler scheduler(model, device, config);
+
+    size_t numRequests = 0;
+    size_t numFinished = 0;
+    std::vector<double> samples;
+    auto runStep = [&]()
+    {
+        auto stepStart = std::chrono::steady_clock::now();
+        numFinished += scheduler.step().size();
+        samples.emplace_back(std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - stepStart)
+                             .count());
+    };
+    auto submit = [&](size_t promptLength)
+    {
+        std::vector<ssize_t> prompt(corpusTokenIds.begin(), corpusTokenIds.begin() + promptLength);
+        scheduler.submit({std::to_string(numRequests++), prompt, numNewTokens});
+    };
+
+    // The short prompts are prefilled in a single step, and the long prompt arrives while they are decoding.
+    for (size_t i=0; i<kNumDecodeSequences; ++i) submit(kShortPromptLength);
+    runStep();
+    submit(longPromptLength);
+    while (!scheduler.idle()) runStep();
+
+    if (numFinished != numRequests)
+    {
+        throw std::runtime_error("Scheduler finished " + std::to_string(numFinished) + " of " +
+                                 std::to_string(numRequests) + " requests.");
+    }
+    auto schedulerLabels = labels;
+    schedulerLabels.emplace_back("prompt_tokens", std::to_string(longPromptLength));
+    writer.write("scheduler.step", schedulerLabels, summarize(std::move(samples)));
+}
+
+
+void benchModel(const BenchOptions& options, const std::string& modelName, const std::string& deviceName,
+                const std::vector<ssize_t>& corpusTokenIds, ResultWriter& writer)
+{
+    auto modelType = static_cast<size_t>(parseModelType(modelName));
+    const auto& hParams = modelParams[modelType];
+    BenchLabels labels{{"model", modelName}, {"device", deviceName}};
+    if (deviceName == "CPU") labels.emplace_back("threads", std::to_string(kernels::numThreads()));
+
+    auto device = aix::createDevice(deviceName == "MCS" ? aix::DeviceType::kGPU_METAL : aix::DeviceType::kCPU);
+    if (!device)
+    {
+        std::cerr << "Skipping the " << deviceName << " benchmarks. Device type is not supported." << std::endl;
+        return;
+    }
+
+    benchModules(options, hParams, labels, device, writer);
+
+    // The indexed checkpoint is used if the weights are converted. The model benchmarks use the float32 weights.
+    auto weightsFile = std::filesystem::path(modelWeightsFilenames[modelType]).replace_extension(".ckpt").string();
+    if (!std::filesystem::exists(weightsFile)) weightsFile = modelWeightsFilenames[modelType];
+    if (!std::filesystem::exists(weightsFile))
+    {
+        std::cerr << "Skipping the " << modelName << " model benchmarks. Weights file does not exist: "
+                  << weightsFile << std::endl;
+        return;
+    }
+
+    // The model is loaded once. The load time includes the upload to the device.
+    GPT2 model(hParams.at("nVocab"), hParams.at("nCtx"), hParams.at("nEmbd"), hParams.at("nHeads"),
+               hParams.at("nLayers"), ParamInit::kNone);
+    model.to(device);
+    auto start = std::chrono::steady_clock::now();
+    loadWeightsParallel(model.namedParameters(), weightsFile);
+    device->synchronize();
+    auto loadTime = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+    writer.write("model.load", labels, summarize({loadTime}));
+
+    constexpr size_t kvBlockSize = 16;
+    auto ctxSize = model.ctxSize();
+    auto pool = model.createKVPool(kvBlockSize, (ctxSize + kvBlockSize - 1) / kvBlockSize, device.get());
+    auto tokensTensor = [&](const ssize_t* tokenIds, size_t numTokens)
+    {
+        return aix::Tensor(tokenIds, numTokens, aix::DataType::kInt64, aix::Shape{numTokens},
+                           aix::dtype(aix::DataType::kInt32)).to(device);
+    };
+
+    // Time to the first token: the prefill of the prompt and the logits of its last token.
+    for (auto promptLength : options.promptLengths)
+    {
+        if (promptLength >= ctxSize || promptLength > corpusTokenIds.size()) continue;
+        std::vector<ssize_t> prompt(corpusTokenIds.begin(), corpusTokenIds.begin() + promptLength);
+        auto stats = measure(options.numWarmups, options.numIterations, [&]
+        {
+            KVCache cache(pool);
+            model.prefill(prompt, cache);
+            model.forwardLast(tokensTensor(&prompt.back(), 1), cache.size(), cache);
+            device->synchronize();
+        });
+        auto promptLabels = labels;
+        promptLabels.emplace_back("prompt_tokens", std::to_string(promptLength));
+        writer.write("model.prefill", promptLabels, stats, "tokens/s", static_cast<double>(promptLength));
+    }
+
+    // Latency of each decode step after a short prompt. Each step waits for its logits. The warmup steps are rolled
+    // back, so the measured steps start at the same position and stay within the context.
+    constexpr size_t kDecodePromptLength = 16;
+    auto numDecodeTokens = std::min(options.numDecodeTokens, ctxSize - kDecodePromptLength - 1);
+    std::vector<ssize_t> prompt(corpusTokenIds.begin(),
+                                corpusTokenIds.begin() + std::min(kDecodePromptLength, corpusTokenIds.size()));
+    {
+        KVCache cache(pool);
+        model.prefill(prompt, cache);
+        std::vector<double> samples;
+        auto decodeSteps = [&](size_t numSteps, bool record)
+        {
+            auto tokenId = prompt.back();
+            for (size_t i=0; i<numSteps; ++i)
+            {
+                auto stepStart = std::chrono::steady_clock::now();
+                model.forwardLast(tokensTensor(&tokenId, 1), cache.size(), cache);
+                device->synchronize();
+                auto stepTime = std::chrono::steady_clock::now() - stepStart;
+                if (record) samples.emplace_back(std::chrono::duration<double, std::milli>(stepTime).count());
+                tokenId = corpusTokenIds[(prompt.size() + i) % corpusTokenIds.size()];
+            }
+        };
+        decodeSteps(std::min(options.numWarmups, numDecodeTokens), false);
+        cache.truncate(prompt.size());
+        decodeSteps(numDecodeTokens, true);
+        auto decodeLabels = labels;
+        decodeLabels.emplace_back("prompt_tokens", std::to_string(prompt.size()));
+        writer.write("model.decode_step", decodeLabels, summarize(std::move(samples)), "tokens/s", 1);
+    }
+
+    // End-to-end greedy generation, which queues the steps without waiting for the host.
+    auto stats = measure(options.numWarmups, options.numIterations, [&]
+    {
+        model.generate(prompt, numDecodeTokens, device);
+    });
+    auto generateLabels = labels;
+    generateLabels.emplace_back("prompt_tokens", std::to_string(prompt.size()));
+    generateLabels.emplace_back("new_tokens", std::to_string(numDecodeTokens));
+    writer.write("model.generate", generateLabels, stats, "tokens/s", static_cast<double>(numDecodeTokens));
+
+    benchScheduler(options, model, device, corpusTokenIds, labels, writer);
+}
+
+
+int main(int argc, const char* argv[])
+{
+    auto options = processCommandLineArguments(argc, argv);
+
+    try
+    {
+        if (options.tokenizerConformance)
+        {
+            BPE bpe("Resources/GPT2/oaiBPEMergeRules.txt", "Resources/GPT2/oaiBPEVocabs.txt");
+            return checkTokenizerConformance(bpe) ? 0 : -1;
+        }
+        if (options.kernelConformance) return checkKernelConformance() ? 0 : -1;
+
+        std::ofstream outFile;
+        if (!options.outputFile.empty())
+        {
+            outFile.open(options.outputFile);
+            if (!outFile)
+            {
+                throw std::runtime_error("Failed to open the output file: " + options.outputFile);
+            }
+        }
+        ResultWriter writer(options.outputFile.empty() ? std::cout : outFile);
+        kernels::setNumThreads(options.numThreads);
+
+        benchTokenizer(options, writer);
+        if (options.tokenizerOnly) return 0;
+
+        // The prompts of the model benchmarks are the tokens of the corpus.
+        BPE bpe("Resources/GPT2/oaiBPEMergeRules.txt", "Resources/GPT2/oaiBPEVocabs.txt");
+        auto corpusTokenIds = bpe.encode(loadCorpus(options.corpusFile));
+        if (corpusTokenIds.empty())
+        {
+            throw std::runtime_error("Corpus has no tokens.");
+        }
+
+        for (const auto& device : options.devices)
+        {
+            for (const auto& model : options.models)
+            {
+                benchModel(options, model, device, corpusTokenIds, writer);
+            }
+        }
+    }
+    catch (std::exception& e)
+    {
+        std::cerr << "Exception message: " << e.what() << std::endl;
+        return -1;
+    }
+
+    return 0;
+}